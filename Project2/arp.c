@@ -0,0 +1,365 @@
+// ARP Cache Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (sends through eth0)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "arp.h"
+#include "eth0.h"
+#include "pool.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+// Entries are chained from a hash bucket, so a lookup only visits the entries
+// that share its bucket; unused entries are chained on a free list
+arpEntry arpTable[ARP_ENTRIES];
+uint8_t arpBuckets[ARP_BUCKETS];
+uint8_t arpFreeList;
+uint32_t arpClock;              // counts uses, so the least recently used entry can be evicted
+arpStats arpCounters;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Hosts on a local network mostly differ in the last bytes of their address
+uint8_t arpHash(const uint8_t ip[])
+{
+    return (ip[2] ^ ip[3]) & (ARP_BUCKETS - 1);
+}
+
+void initArp()
+{
+    uint8_t i;
+    for (i = 0; i < ARP_BUCKETS; i++)
+        arpBuckets[i] = ARP_NONE;
+    for (i = 0; i < ARP_ENTRIES; i++)
+    {
+        arpTable[i].state = ARP_FREE;
+        arpTable[i].queued = 0;
+        arpTable[i].next = (i + 1 < ARP_ENTRIES) ? i + 1 : ARP_NONE;
+    }
+    arpFreeList = 0;
+}
+
+// Returns the index of the entry for ip, or ARP_NONE
+uint8_t arpFind(const uint8_t ip[])
+{
+    uint8_t i = arpBuckets[arpHash(ip)];
+    while (i != ARP_NONE && memcmp(arpTable[i].ip, ip, IP_ADD_LENGTH) != 0)
+        i = arpTable[i].next;
+    return i;
+}
+
+// Unlinks an entry and returns it to the free list, dropping any frames waiting on it
+// Must be called with interrupts off
+void arpRemove(uint8_t index)
+{
+    arpEntry* entry = &arpTable[index];
+    uint8_t* link = &arpBuckets[arpHash(entry->ip)];
+    uint8_t i;
+
+    while (*link != index)
+        link = &arpTable[*link].next;
+    *link = entry->next;
+    if (entry->state == ARP_RESOLVED)
+        etherInvalidateRoutes();
+    for (i = 0; i < entry->queued; i++)
+        freePacketBuffer(entry->queue[i]);
+    arpCounters.dropped += entry->queued;
+    entry->queued = 0;
+    entry->state = ARP_FREE;
+    entry->next = arpFreeList;
+    arpFreeList = index;
+}
+
+// Adds an entry for ip, evicting the least recently used resolved entry if the table is full
+// Must be called with interrupts off
+// Returns its index, or ARP_NONE if every entry is still resolving
+uint8_t arpAdd(const uint8_t ip[], uint8_t state)
+{
+    arpEntry* entry;
+    uint8_t i, index = arpFreeList, hash;
+
+    if (index == ARP_NONE)
+    {
+        for (i = 0; i < ARP_ENTRIES; i++)
+            if (arpTable[i].state == ARP_RESOLVED
+                && (index == ARP_NONE || (int32_t)(arpTable[i].used - arpTable[index].used) < 0))
+                index = i;
+        if (index == ARP_NONE)
+            return ARP_NONE;
+        arpRemove(index);
+        arpCounters.evicted++;
+    }
+    entry = &arpTable[index];
+    arpFreeList = entry->next;
+    memcpy(entry->ip, ip, IP_ADD_LENGTH);
+    entry->state = state;
+    entry->retries = 0;
+    entry->ttl = ARP_TTL;
+    entry->used = ++arpClock;
+    entry->queued = 0;
+    hash = arpHash(ip);
+    entry->next = arpBuckets[hash];
+    arpBuckets[hash] = index;
+    return index;
+}
+
+// Broadcasts a request for the mac of ip
+void arpSendRequest(const uint8_t ip[])
+{
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
+    etherSendArpRequest(buffer->data, (uint8_t*)ip);
+    freePacketBuffer(buffer);
+    arpCounters.requests++;
+}
+
+// Starts resolving ip if it is not in the table
+// Must be called with interrupts off; returns the entry index, or ARP_NONE
+uint8_t arpStart(const uint8_t ip[], bool* request)
+{
+    uint8_t index = arpFind(ip);
+    *request = false;
+    if (index == ARP_NONE)
+    {
+        index = arpAdd(ip, ARP_INCOMPLETE);
+        if (index != ARP_NONE)
+        {
+            // the first request goes out now, the next after a second
+            arpTable[index].retries = 1;
+            arpTable[index].ttl = 1;
+            *request = true;
+        }
+    }
+    return index;
+}
+
+// Copies the mac of ip if it is resolved
+bool arpLookup(const uint8_t ip[], uint8_t mac[])
+{
+    uint8_t index;
+    bool ok;
+
+    __asm(" CPSID I");
+    index = arpFind(ip);
+    ok = index != ARP_NONE && arpTable[index].state == ARP_RESOLVED;
+    if (ok)
+        memcpy(mac, arpTable[index].mac, HW_ADD_LENGTH);
+    __asm(" CPSIE I");
+    return ok;
+}
+
+// Copies the mac of ip if it is resolved, otherwise starts resolving it
+// For senders that cannot leave a frame waiting (e.g. one sent as spans)
+bool arpResolve(const uint8_t ip[], uint8_t mac[])
+{
+    uint8_t index;
+    bool ok, request;
+
+    __asm(" CPSID I");
+    index = arpStart(ip, &request);
+    ok = index != ARP_NONE && arpTable[index].state == ARP_RESOLVED;
+    if (ok)
+    {
+        memcpy(mac, arpTable[index].mac, HW_ADD_LENGTH);
+        arpTable[index].used = ++arpClock;
+        arpCounters.hits++;
+    }
+    else
+        arpCounters.misses++;
+    __asm(" CPSIE I");
+    if (request)
+        arpSendRequest(ip);
+    return ok;
+}
+
+// Sends the ethernet frame in buffer to ip on the local network, filling in the destination mac
+// If ip is not resolved yet, the frame waits (up to ARP_QUEUE_SIZE for each address) and
+// goes out when the reply arrives; the buffer is always consumed
+// Returns false if the frame was dropped
+bool arpSendBuffer(packetBuffer* buffer, const uint8_t ip[])
+{
+    etherFrame* ether = (etherFrame*)buffer->data;
+    arpEntry* entry;
+    uint8_t index;
+    bool resolved = false, waiting = false, request;
+
+    __asm(" CPSID I");
+    index = arpStart(ip, &request);
+    if (index != ARP_NONE)
+    {
+        entry = &arpTable[index];
+        if (entry->state == ARP_RESOLVED)
+        {
+            memcpy(ether->destAddress, entry->mac, HW_ADD_LENGTH);
+            entry->used = ++arpClock;
+            resolved = true;
+            arpCounters.hits++;
+        }
+        else
+        {
+            arpCounters.misses++;
+            if (entry->queued < ARP_QUEUE_SIZE)
+            {
+                entry->queue[entry->queued++] = buffer;
+                waiting = true;
+                arpCounters.queued++;
+            }
+        }
+    }
+    if (!resolved && !waiting)
+        arpCounters.dropped++;
+    __asm(" CPSIE I");
+
+    if (request)
+        arpSendRequest(ip);
+    if (resolved)
+        return etherSendBuffer(buffer);
+    if (!waiting)
+        freePacketBuffer(buffer);
+    return waiting;
+}
+
+// Records that ip is at mac and sends any frames that were waiting for it
+// Existing entries are always refreshed, but new ones are only added if create
+// is set (the sender was talking to this host), as rfc 826 suggests
+void arpUpdate(const uint8_t ip[], const uint8_t mac[], bool create)
+{
+    packetBuffer* waiting[ARP_QUEUE_SIZE];
+    arpEntry* entry;
+    uint8_t i, index, count = 0;
+
+    if ((ip[0] == 0 && ip[1] == 0 && ip[2] == 0 && ip[3] == 0) || (mac[0] & 1) != 0)
+        return;
+
+    __asm(" CPSID I");
+    index = arpFind(ip);
+    if (index == ARP_NONE && create)
+    {
+        index = arpAdd(ip, ARP_RESOLVED);
+        if (index != ARP_NONE)
+            arpCounters.learned++;
+    }
+    if (index != ARP_NONE)
+    {
+        entry = &arpTable[index];
+        if (entry->state != ARP_RESOLVED || memcmp(entry->mac, mac, HW_ADD_LENGTH) != 0)
+            etherInvalidateRoutes();
+        memcpy(entry->mac, mac, HW_ADD_LENGTH);
+        entry->state = ARP_RESOLVED;
+        entry->retries = 0;
+        entry->ttl = ARP_TTL;
+        entry->used = ++arpClock;
+        count = entry->queued;
+        for (i = 0; i < count; i++)
+            waiting[i] = entry->queue[i];
+        entry->queued = 0;
+    }
+    __asm(" CPSIE I");
+
+    for (i = 0; i < count; i++)
+    {
+        memcpy(((etherFrame*)waiting[i]->data)->destAddress, mac, HW_ADD_LENGTH);
+        etherSendBuffer(waiting[i]);
+    }
+}
+
+// Learns from a received arp request or reply
+void arpInput(uint8_t packet[])
+{
+    etherFrame* ether = (etherFrame*)packet;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    uint8_t ip[IP_ADD_LENGTH];
+
+    if (arp->hardwareType != htons(1) || arp->protocolType != htons(0x0800))
+        return;
+    etherGetIpAddress(ip);
+    arpUpdate(arp->sourceIp, arp->sourceAddress, memcmp(arp->destIp, ip, IP_ADD_LENGTH) == 0);
+}
+
+// Refreshes the entry of the sender of a received ip frame, if it has one
+// Frames from other networks carry the router's mac, but their source address
+// is never in the table, so they cannot poison it
+void arpInputIp(uint8_t packet[])
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    arpUpdate(ip->sourceIp, ether->sourceAddress, false);
+}
+
+// Ages the table; call once a second from the main loop
+// Resolved entries expire after ARP_TTL seconds without a refresh, and incomplete
+// ones send another request each second until ARP_RETRIES have gone unanswered
+void arpTick()
+{
+    uint8_t ip[IP_ADD_LENGTH];
+    arpEntry* entry;
+    uint8_t i;
+    bool request;
+
+    for (i = 0; i < ARP_ENTRIES; i++)
+    {
+        request = false;
+        __asm(" CPSID I");
+        entry = &arpTable[i];
+        if (entry->state != ARP_FREE && entry->ttl > 0 && --entry->ttl == 0)
+        {
+            if (entry->state == ARP_RESOLVED)
+            {
+                arpRemove(i);
+                arpCounters.expired++;
+            }
+            else if (entry->retries >= ARP_RETRIES)
+            {
+                arpRemove(i);
+                arpCounters.failed++;
+            }
+            else
+            {
+                entry->retries++;
+                entry->ttl = 1;
+                memcpy(ip, entry->ip, IP_ADD_LENGTH);
+                request = true;
+            }
+        }
+        __asm(" CPSIE I");
+        if (request)
+            arpSendRequest(ip);
+    }
+}
+
+// Copies entry index of the table, for display
+// Returns false if the entry is not in use
+bool getArpEntry(uint8_t index, arpEntry* entry)
+{
+    bool used;
+    __asm(" CPSID I");
+    *entry = arpTable[index];
+    __asm(" CPSIE I");
+    used = entry->state != ARP_FREE;
+    return used;
+}
+
+void getArpStats(arpStats* stats)
+{
+    *stats = arpCounters;
+}
@@ -0,0 +1,77 @@
+// ARP Cache Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (sends through eth0)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef ARP_H_
+#define ARP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pool.h"
+
+#define ARP_ENTRIES     16      // table size, up to 254
+#define ARP_BUCKETS     16      // hash buckets, a power of 2
+#define ARP_TTL         300     // seconds a resolved entry is kept without being refreshed
+#define ARP_RETRIES     3       // requests sent before an incomplete entry is given up
+#define ARP_QUEUE_SIZE  2       // frames held for each address while it resolves
+#define ARP_NONE        0xFF
+
+#define ARP_FREE        0
+#define ARP_INCOMPLETE  1       // request sent, no reply yet
+#define ARP_RESOLVED    2
+
+typedef struct _arpEntry
+{
+    uint8_t ip[4];
+    uint8_t mac[6];
+    uint8_t state;
+    uint8_t retries;
+    uint16_t ttl;               // seconds until the entry expires or the request is sent again
+    uint32_t used;              // arp clock when the entry was last used or refreshed
+    uint8_t next;               // next entry in the same bucket, or in the free list
+    uint8_t queued;
+    packetBuffer* queue[ARP_QUEUE_SIZE];
+} arpEntry;
+
+typedef struct _arpStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t requests;
+    uint32_t learned;
+    uint32_t expired;
+    uint32_t failed;
+    uint32_t evicted;
+    uint32_t queued;
+    uint32_t dropped;
+} arpStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initArp();
+bool arpLookup(const uint8_t ip[], uint8_t mac[]);
+bool arpResolve(const uint8_t ip[], uint8_t mac[]);
+bool arpSendBuffer(packetBuffer* buffer, const uint8_t ip[]);
+void arpUpdate(const uint8_t ip[], const uint8_t mac[], bool create);
+void arpInput(uint8_t packet[]);
+void arpInputIp(uint8_t packet[]);
+void arpTick();
+bool getArpEntry(uint8_t index, arpEntry* entry);
+void getArpStats(arpStats* stats);
+
+#endif
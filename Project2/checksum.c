@@ -0,0 +1,336 @@
+// Checksum Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (uses wide timer 5A through getCycleCount for the benchmark only)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "checksum.h"
+#include "timer.h"
+#include "uart0.h"
+
+#define TEST_PACKETS 200
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Folds a 64-bit sum down to 16 bits with end-around carries
+uint16_t foldChecksum(uint64_t acc)
+{
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    return acc;
+}
+
+// Starts a new checksum
+void initChecksum(checksumContext* ctx)
+{
+    ctx->sum = 0;
+    ctx->odd = false;
+}
+
+// Adds size bytes of data to the checksum
+// Works a 32-bit word at a time; data may start at any address and size may be odd
+void addChecksumData(checksumContext* ctx, const void* data, uint16_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint32_t* w;
+    uint64_t acc = 0;
+    uint16_t result;
+    bool swap;
+
+    if (size == 0)
+        return;
+
+    // sum as aligned little-endian words, so the byte at an odd address is a high byte
+    // if that does not match the position of the byte in the checksum, swap at the end
+    swap = (((uintptr_t)p & 1) != 0) != ctx->odd;
+    ctx->odd ^= (size & 1);
+
+    if (((uintptr_t)p & 1) != 0)
+    {
+        acc += (uint32_t)*p << 8;
+        p++;
+        size--;
+    }
+    if (((uintptr_t)p & 2) != 0 && size >= 2)
+    {
+        acc += *(const uint16_t*)p;
+        p += 2;
+        size -= 2;
+    }
+
+    w = (const uint32_t*)p;
+    while (size >= 32)
+    {
+        acc += w[0];
+        acc += w[1];
+        acc += w[2];
+        acc += w[3];
+        acc += w[4];
+        acc += w[5];
+        acc += w[6];
+        acc += w[7];
+        w += 8;
+        size -= 32;
+    }
+    while (size >= 4)
+    {
+        acc += *w++;
+        size -= 4;
+    }
+
+    p = (const uint8_t*)w;
+    if (size >= 2)
+    {
+        acc += *(const uint16_t*)p;
+        p += 2;
+        size -= 2;
+    }
+    if (size != 0)
+        acc += *p;
+
+    result = foldChecksum(acc);
+    if (swap)
+        result = (result << 8) | (result >> 8);
+    ctx->sum += result;
+}
+
+// Adds a 16-bit word, given as it is stored in the packet (e.g. htons(length))
+void addChecksumWord(checksumContext* ctx, uint16_t word)
+{
+    if (ctx->odd)
+        word = (word << 8) | (word >> 8);
+    ctx->sum += word;
+}
+
+// Returns the folded sum (not inverted), e.g. to combine with another sum
+uint16_t getChecksumSum(checksumContext* ctx)
+{
+    return foldChecksum(ctx->sum);
+}
+
+// Completes 1's compliment addition and returns the value for the header field
+uint16_t getChecksum(checksumContext* ctx)
+{
+    return ~foldChecksum(ctx->sum);
+}
+
+// Updates a checksum after one 16-bit word changed from oldWord to newWord
+// Uses eqn 3 of rfc1624, so the rest of the data does not have to be summed again
+// Words are given as they are stored in the packet and must be at an even offset
+uint16_t updateChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum;
+    sum = (uint16_t)~check;
+    sum += (uint16_t)~oldWord;
+    sum += newWord;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+// Updates a checksum after a 32-bit field (e.g. a tcp sequence number) changed
+uint16_t updateChecksum32(uint16_t check, uint32_t oldValue, uint32_t newValue)
+{
+    check = updateChecksum(check, oldValue & 0xFFFF, newValue & 0xFFFF);
+    return updateChecksum(check, oldValue >> 16, newValue >> 16);
+}
+
+// Byte-at-a-time sum used before this module, kept as the reference for the test
+uint32_t sumBytesReference(const uint8_t* data, uint16_t size, uint32_t sum)
+{
+    uint16_t i;
+    uint8_t phase = 0;
+    for (i = 0; i < size; i++)
+    {
+        if (phase)
+            sum += (uint32_t)data[i] << 8;
+        else
+            sum += data[i];
+        phase = 1 - phase;
+    }
+    return sum;
+}
+
+// Checks addChecksumData against the byte-at-a-time sum on random packets with
+// random lengths, start alignments, and splits, then reports cycles per byte
+// Buffer must hold at least size bytes (1504 or more for a full frame)
+// Returns true if every packet matched
+bool testChecksum(uint8_t buffer[], uint16_t size)
+{
+    checksumContext ctx;
+    uint32_t seed = getCycleCount();
+    uint32_t ref, t0, newTime, refTime;
+    uint16_t i, j, offset, length, split, expected, actual, failures = 0;
+    char str[80];
+
+    for (i = 0; i < TEST_PACKETS; i++)
+    {
+        for (j = 0; j < size; j++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            buffer[j] = seed >> 24;
+        }
+        offset = (seed >> 8) & 3;
+        length = (seed >> 12) % (size - offset);
+        split = (length == 0) ? 0 : (seed >> 4) % length;
+
+        ref = sumBytesReference(&buffer[offset], length, 0);
+        while ((ref >> 16) > 0)
+            ref = (ref & 0xFFFF) + (ref >> 16);
+        expected = ~ref;
+
+        // the split exercises restarting at an odd position
+        initChecksum(&ctx);
+        addChecksumData(&ctx, &buffer[offset], split);
+        addChecksumData(&ctx, &buffer[offset + split], length - split);
+        actual = getChecksum(&ctx);
+
+        if (actual != expected)
+        {
+            failures++;
+            sprintf(str, "mismatch: offset %u, length %u, split %u (%04x != %04x)\r\n",
+                    offset, length, split, actual, expected);
+            putsUart0(str);
+        }
+    }
+    sprintf(str, "%u of %u random packets matched\r\n", TEST_PACKETS - failures, TEST_PACKETS);
+    putsUart0(str);
+
+    // cycles per byte over the whole buffer
+    t0 = getCycleCount();
+    initChecksum(&ctx);
+    addChecksumData(&ctx, buffer, size);
+    getChecksum(&ctx);
+    newTime = getCycleCount() - t0;
+    t0 = getCycleCount();
+    sumBytesReference(buffer, size, 0);
+    refTime = getCycleCount() - t0;
+    sprintf(str, "%u bytes: word sum %lu.%02lu cycles/byte, byte sum %lu.%02lu cycles/byte\r\n", size,
+            (unsigned long)(newTime / size), (unsigned long)(newTime * 100 / size % 100),
+            (unsigned long)(refTime / size), (unsigned long)(refTime * 100 / size % 100));
+    putsUart0(str);
+    return failures == 0;
+}
+
+// Checks updateChecksum and updateChecksum32 against recalculating the whole checksum
+// Random fields in random packets are changed one at a time, as a reply path does,
+// then two adjacent 32-bit fields are swapped and one of them moved on, as send_ack
+// does with the sequence and ack numbers
+// Returns true if every update matched
+bool testIncrementalChecksum(uint8_t buffer[], uint16_t size)
+{
+    checksumContext ctx;
+    uint32_t seed = getCycleCount();
+    uint32_t oldValue, newValue, oldSeq, oldAck;
+    uint16_t i, j, length, field, offset, check, full, failures = 0;
+    uint16_t* word;
+    uint32_t* dword;
+    char str[80];
+
+    for (i = 0; i < TEST_PACKETS; i++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        length = 8 + (((seed >> 8) % (size - 8)) & ~3);
+        for (j = 0; j < length; j++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            buffer[j] = seed >> 24;
+        }
+        // checksum field at a random word, changed field elsewhere
+        field = ((seed >> 4) % (length / 2)) * 2;
+        offset = ((seed >> 16) % (length / 4)) * 4;
+        if (offset == (field & ~3))
+            offset = (offset + 4) % length;
+        word = (uint16_t*)&buffer[field];
+        dword = (uint32_t*)&buffer[offset];
+
+        *word = 0;
+        initChecksum(&ctx);
+        addChecksumData(&ctx, buffer, length);
+        *word = getChecksum(&ctx);
+
+        // change a 16-bit and then a 32-bit field
+        seed = seed * 1664525 + 1013904223;
+        oldValue = *dword;
+        newValue = (oldValue & 0xFFFF0000) | (seed >> 16);
+        *dword = newValue;
+        check = updateChecksum(*word, oldValue & 0xFFFF, newValue & 0xFFFF);
+        seed = seed * 1664525 + 1013904223;
+        oldValue = newValue;
+        newValue = seed;
+        *dword = newValue;
+        check = updateChecksum32(check, oldValue, newValue);
+
+        *word = 0;
+        initChecksum(&ctx);
+        addChecksumData(&ctx, buffer, length);
+        full = getChecksum(&ctx);
+
+        // 0x0000 and 0xFFFF are both zero in 1's compliment
+        if (check != full && !((check == 0 || check == 0xFFFF) && (full == 0 || full == 0xFFFF)))
+        {
+            failures++;
+            sprintf(str, "mismatch: length %u, field %u, offset %u (%04x != %04x)\r\n",
+                    length, field, offset, check, full);
+            putsUart0(str);
+        }
+
+        // swap seq and ack at offset, checksum right after them; each update takes
+        // out the value the field holds at that point, not the one it first had
+        if (length < 12)
+            continue;
+        seed = seed * 1664525 + 1013904223;
+        offset = ((seed >> 16) % (length / 4 - 2)) * 4;
+        field = offset + 8;
+        word = (uint16_t*)&buffer[field];
+        dword = (uint32_t*)&buffer[offset];
+
+        *word = 0;
+        initChecksum(&ctx);
+        addChecksumData(&ctx, buffer, length);
+        *word = getChecksum(&ctx);
+
+        oldSeq = dword[0];
+        oldAck = dword[1];
+        check = updateChecksum32(*word, oldSeq, oldAck);
+        dword[0] = oldAck;
+        newValue = oldSeq + (seed >> 21);
+        check = updateChecksum32(check, oldAck, newValue);
+        dword[1] = newValue;
+
+        *word = 0;
+        initChecksum(&ctx);
+        addChecksumData(&ctx, buffer, length);
+        full = getChecksum(&ctx);
+
+        if (check != full && !((check == 0 || check == 0xFFFF) && (full == 0 || full == 0xFFFF)))
+        {
+            failures++;
+            sprintf(str, "swap mismatch: length %u, offset %u (%04x != %04x)\r\n",
+                    length, offset, check, full);
+            putsUart0(str);
+        }
+    }
+    sprintf(str, "%u of %u incremental updates matched\r\n", TEST_PACKETS - failures, TEST_PACKETS);
+    putsUart0(str);
+    return failures == 0;
+}
@@ -0,0 +1,48 @@
+// Checksum Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (uses wide timer 5A through getCycleCount for the benchmark only)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Running state of an internet (rfc1071) checksum
+// Each caller owns its context, so sums can be nested or run from an isr
+// Sums use the little-endian byte order of the M4 (the byte at an even offset
+// is the low byte), so getChecksum can be stored straight into a header field
+typedef struct _checksumContext
+{
+    uint32_t sum;
+    bool odd;                   // an odd number of bytes has been added
+} checksumContext;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initChecksum(checksumContext* ctx);
+void addChecksumData(checksumContext* ctx, const void* data, uint16_t size);
+void addChecksumWord(checksumContext* ctx, uint16_t word);
+uint16_t getChecksumSum(checksumContext* ctx);
+uint16_t getChecksum(checksumContext* ctx);
+uint16_t updateChecksum(uint16_t check, uint16_t oldWord, uint16_t newWord);
+uint16_t updateChecksum32(uint16_t check, uint32_t oldValue, uint32_t newValue);
+bool testChecksum(uint8_t buffer[], uint16_t size);
+bool testIncrementalChecksum(uint8_t buffer[], uint16_t size);
+
+#endif
@@ -16,7 +16,7 @@
 //   SCLK (SSI0Clk) on PA2
 //   ~CS (SW controlled) on PA3
 //   WOL on PB3
-//   INT on PC6
+//   INT on PC6 (falling edge, etherIntIsr in the GPIO Port C vector)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -33,6 +33,10 @@
 #include "spi0.h"
 #include "uart0.h"
 #include "timer.h"
+#include "checksum.h"
+#include "pool.h"
+#include "arp.h"
+#include "tcp.h"
 
 // Pins
 #define CS PORTA,3
@@ -56,20 +60,42 @@
 #define ERXRDPTH    0x0D
 #define ERXWRPTL    0x0E
 #define ERXWRPTH    0x0F
+#define EDMASTL     0x10
+#define EDMASTH     0x11
+#define EDMANDL     0x12
+#define EDMANDH     0x13
+#define EDMACSL     0x16
+#define EDMACSH     0x17
 #define EIE         0x1B
+#define RXERIE  0x01
+#define TXIE    0x08
+#define LINKIE  0x10
+#define PKTIE   0x40
+#define INTIE   0x80
 #define EIR         0x1C
 #define RXERIF  0x01
 #define TXERIF  0x02
 #define TXIF    0x08
+#define LINKIF  0x10
 #define PKTIF   0x40
 #define ESTAT       0x1D
 #define CLKRDY  0x01
 #define TXABORT 0x02
+#define RXBUSY  0x04
 #define ECON2       0x1E
 #define PKTDEC  0x40
 #define ECON1       0x1F
 #define RXEN    0x04
 #define TXRTS   0x08
+#define CSUMEN  0x10
+#define DMAST   0x20
+#define TXRST   0x80
+#define EHT0        0x20
+#define EPMM0       0x28
+#define EPMCSL      0x30
+#define EPMCSH      0x31
+#define EPMOL       0x34
+#define EPMOH       0x35
 #define ERXFCON     0x38
 #define EPKTCNT     0x39
 #define MACON1      0x40
@@ -115,22 +141,111 @@
 #define LSTAT  0x0400
 #define PHCON2      0x10
 #define HDLDIS 0x0100
+#define PHIE        0x12
+#define PGEIE  0x0002
+#define PLNKIE 0x0010
+#define PHIR        0x13
 #define PHLCON      0x14
 
+// Receive status vector (bits 16-31, after the size)
+#define RSV_RXOK    0x0080  // received ok: good crc, no length or code errors
+
 // Packets
-#define IP_ADD_LENGTH 4
-#define HW_ADD_LENGTH 6
 
 #define MAX_PACKET_SIZE 1522;
 
+// Buffer memory map
+// The receive ring always starts at 0 (errata) and transmit memory always ends
+// at the top, so a profile just picks the (odd) end of the receive ring
+#define RX_START    0x0000
+#define TX_END      0x1FFF
+
+// Register cache
+#define BANK_UNKNOWN 0xFF
+
+// Memory map adaptation
+#define ADAPT_TX_WAITS 8
+
+// Transmit queue
+// Each queued frame takes a control byte, the frame, and a 7-byte status vector
+#define TX_SLOTS    8
+#define TX_OVERHEAD 8
+#define TSV_SIZE    7
+
+// Local port of the sample segments the benchmarks build
+#define TCP_LOCAL_PORT 0x8963
+#define DHCP_CLIENT_PORT 68
+
+// MQTT broker, reached directly on the local network
+#define MQTT_BROKER_PORT 1883
+#define TCP_BENCH_PORT 9                // discard service on the broker host, e.g. nc -lk 9 > /dev/null
+#define TCP_BENCH_SIZE 65536
+
+// Receive filter manager
+#define MULTICAST_GROUPS 4
+#define PATTERN_MAX 16
+
+// Receive buffers whose l4 checksum was checked by the controller
+#define CSUM_VERIFIED_SLOTS 2
+
 // ------------------------------------------------------------------------------
 //  Globals
 // ------------------------------------------------------------------------------
 
+// Frame waiting in or being sent from transmit memory
+typedef struct _txSlot
+{
+    uint16_t start;
+    uint16_t size;
+    uint16_t seq;
+} txSlot;
+
+
 uint8_t nextPacketLsb = 0x00;
 uint8_t nextPacketMsb = 0x00;
+uint8_t* rxPacket;
+uint16_t rxSize;
+_etherCallback rxCallback;
+volatile bool rxBusy = false;
+bool intMode = false;
+uint8_t currentBank = BANK_UNKNOWN;
+uint8_t regCache[128];
+uint8_t regCacheValid[16];
+uint32_t spiTransactions = 0;
+bool earlyDrop = false;
+bool csumOffload = false;
+bool autoFilter = false;
+uint8_t filterState = ETHER_FILTER_FIXED;
+bool dhcpPending = false;
+uint8_t multicastGroups[MULTICAST_GROUPS][IP_ADD_LENGTH];
+uint8_t groupCount = 0;
+uint16_t rxFrameAddr = RX_START;
+// end of receive ring for each profile: 6666/1526, 5120/3072, 3072/5120 bytes rx/tx
+const uint16_t memProfiles[ETHER_MEM_PROFILES] = {0x1A09, 0x13FF, 0x0BFF};
+uint8_t memProfile = ETHER_MEM_RXHEAVY;
+bool memAdaptive = false;
+uint32_t lastOverflows = 0;
+uint32_t lastTxWaits = 0;
+uint16_t rxEnd = 0x1A09;
+uint16_t txStart = 0x1A0A;
+uint8_t* csumVerified[CSUM_VERIFIED_SLOTS];
+etherRxStats rxStats;
+etherSpiStats spiStats;
+volatile bool csActive = false;
+volatile bool intDeferred = false;
+volatile uint8_t pendingEvents = 0;
 uint8_t sequenceId = 1;
-uint32_t sum;
+// Frames are only queued from the main loop (timer callbacks run there, through
+// processTimers), so the ring is not locked
+txSlot txQueue[TX_SLOTS];
+uint8_t txHead = 0;
+uint8_t txTail = 0;
+uint8_t txCount = 0;
+uint16_t txFree = 0x1A0A;
+bool txActive = false;
+uint16_t txSeq = 0;
+uint16_t txDoneSeq = 0;
+etherTxStats txStats;
 uint8_t macAddress[HW_ADD_LENGTH] = {2,3,4,5,6,7};
 uint8_t ipAddress[IP_ADD_LENGTH] = {0,0,0,0};
 uint8_t ipSubnetMask[IP_ADD_LENGTH] = {255,255,255,0};
@@ -143,9 +258,19 @@ uint8_t g_gateway[4];
 uint8_t g_dns[4];
 uint8_t g_ether_server[6];
 uint8_t ack_ip_lease[4];
-uint32_t g_sekno;
-uint32_t g_ackno;
-uint8_t id=0;
+uint8_t brokerIp[IP_ADD_LENGTH] = {192,168,1,198};
+uint8_t broadcastAddress[HW_ADD_LENGTH] = {0xFF,0xFF,0xFF,0xFF,0xFF,0xFF};
+uint8_t broadcastIp[IP_ADD_LENGTH] = {0xFF,0xFF,0xFF,0xFF};
+uint8_t unspecifiedIp[IP_ADD_LENGTH] = {0,0,0,0};
+uint8_t mqttConnection = TCP_NONE;
+uint8_t benchConnection = TCP_NONE;
+uint8_t benchPass;                      // 0 windowed, 1 stop-and-wait
+uint8_t* benchData;
+uint32_t benchQueued, benchAcked, benchStart;
+uint32_t benchTime[2];
+uint32_t routeGeneration = 1;
+etherPathMtu pathMtus[ETHER_PMTU_ENTRIES];
+uint16_t ipId = 1;
 
 bool isUnicast =0;
 //bool isOffer =0;
@@ -235,11 +360,20 @@ typedef struct _dhcp_ack_requestoptions
 //-----------------------------------------------------------------------------
 
 // Buffer is configured as follows
-// Receive buffer starts at 0x0000 (bottom 6666 bytes of 8K space)
-// Transmit buffer at 01A0A (top 1526 bytes of 8K space)
+// Receive buffer starts at 0x0000 and ends at rxEnd (6666 bytes by default)
+// Transmit buffer from txStart to the top of the 8K space (1526 bytes by default)
+// Transmit buffer holds up to TX_SLOTS queued frames, allocated as a ring
+// The split moves with the memory profile
+
+void etherServiceInt();
+void etherPollTx();
+void etherUpdateFilter();
 
 void etherCsOn()
 {
+    while (isSpi0Busy());              // wait for any background transfer to finish
+    csActive = true;
+    spiTransactions++;
     setPinValue(CS, 0);
     __asm (" NOP");                    // allow line to settle
     __asm (" NOP");
@@ -250,18 +384,70 @@ void etherCsOn()
 void etherCsOff()
 {
     setPinValue(CS, 1);
+    csActive = false;
+    // service an INT edge that arrived while the bus was in use
+    if (intDeferred)
+    {
+        intDeferred = false;
+        etherServiceInt();
+    }
+}
+
+// Returns true if reg holds its value until written again
+// (pointers the hardware moves, and registers with side effects such as ERXST
+// resetting the write ptr, are excluded)
+bool etherIsCacheable(uint8_t reg)
+{
+    return (reg >= ETXSTL && reg <= ETXNDH)
+        || reg == ERXNDL || reg == ERXNDH
+        || (reg >= EDMASTL && reg <= EDMANDH)
+        || (reg >= EHT0 && reg <= EPMCSH)
+        || reg == EPMOL || reg == EPMOH || reg == ERXFCON
+        || (reg >= MACON1 && reg <= MAMXFLH)
+        || reg == MIREGADR
+        || (reg >= MAADR1 && reg <= MAADR4);
+}
+
+// Forgets the selected bank and cached register values (after a reset)
+void etherInvalidateCache()
+{
+    currentBank = BANK_UNKNOWN;
+    memset(regCacheValid, 0, sizeof(regCacheValid));
 }
 
 void etherWriteReg(uint8_t reg, uint8_t data)
 {
+    bool cacheable = etherIsCacheable(reg);
+    uint8_t index = reg & 0x7F;
+
+    // skip writes that would not change a cached register
+    if (cacheable && (regCacheValid[index >> 3] & (1 << (index & 7))) != 0
+        && regCache[index] == data)
+    {
+        spiStats.cachedWrites++;
+        return;
+    }
     etherCsOn();
     writeSpi0Data(0x40 | (reg & 0x1F));
     readSpi0Data();
     writeSpi0Data(data);
     readSpi0Data();
     etherCsOff();
+    if (cacheable)
+    {
+        regCache[index] = data;
+        regCacheValid[index >> 3] |= 1 << (index & 7);
+    }
+}
+
+// Writes a 16-bit pointer to a low/high register pair, low byte first
+void etherWriteReg16(uint8_t regL, uint16_t data)
+{
+    etherWriteReg(regL, LOBYTE(data));
+    etherWriteReg(regL + 1, HIBYTE(data));
 }
 
+
 uint8_t etherReadReg(uint8_t reg)
 {
     uint8_t data;
@@ -294,10 +480,46 @@ void etherClearReg(uint8_t reg, uint8_t mask)
     etherCsOff();
 }
 
+// Selects the bank of reg, skipping the spi writes if it is already selected
+// Common registers (1Bh-1Fh) are in every bank
 void etherSetBank(uint8_t reg)
 {
-    etherClearReg(ECON1, 0x03);
-    etherSetReg(ECON1, reg >> 5);
+    uint8_t bank = (reg >> 5) & 0x03;
+
+    // a background transfer may finish with a bank change, so let it end first
+    while (isSpi0Busy());
+    if ((reg & 0x1F) >= EIE || bank == currentBank)
+    {
+        spiStats.bankSkips++;
+        return;
+    }
+    if (currentBank == BANK_UNKNOWN)
+    {
+        etherClearReg(ECON1, 0x03);
+        etherSetReg(ECON1, bank);
+    }
+    // only bits to set or only bits to clear takes one write
+    else if ((currentBank & ~bank) == 0)
+        etherSetReg(ECON1, bank & ~currentBank);
+    else if ((bank & ~currentBank) == 0)
+        etherClearReg(ECON1, currentBank & ~bank);
+    else
+    {
+        etherClearReg(ECON1, currentBank & ~bank);
+        etherSetReg(ECON1, bank & ~currentBank);
+    }
+    currentBank = bank;
+    spiStats.bankSwitches++;
+}
+
+// Writes count consecutive registers of one bank
+// The spi protocol needs a cs edge per write, but the bank is selected once
+void etherWriteRegs(uint8_t reg, const uint8_t data[], uint8_t count)
+{
+    uint8_t i;
+    etherSetBank(reg);
+    for (i = 0; i < count; i++)
+        etherWriteReg(reg + i, data[i]);
 }
 
 void etherWritePhy(uint8_t reg, uint16_t data)
@@ -361,14 +583,244 @@ void etherReadMemStop()
     etherCsOff();
 }
 
+// Streams a block into buffer memory at EWRPT using the spi fifo
+void etherWriteMemBlock(const uint8_t data[], uint16_t size)
+{
+    etherWriteMemStart();
+    writeSpi0Block(data, size);
+    etherWriteMemStop();
+}
+
+// Writes a block into buffer memory at addr
+void etherWriteMemAt(uint16_t addr, const uint8_t data[], uint16_t size)
+{
+    etherSetBank(EWRPTL);
+    etherWriteReg(EWRPTL, LOBYTE(addr));
+    etherWriteReg(EWRPTH, HIBYTE(addr));
+    etherWriteMemBlock(data, size);
+}
+
+// Streams a block out of buffer memory at ERDPT using the spi fifo
+void etherReadMemBlock(uint8_t data[], uint16_t size)
+{
+    etherReadMemStart();
+    readSpi0Block(data, size);
+    etherReadMemStop();
+}
+
+// Sets the pattern match filter to the bytes at the given frame offsets
+// All offsets must be within the first 64 bytes of the frame
+void etherSetPattern(const uint8_t offsets[], const uint8_t values[], uint8_t count)
+{
+    checksumContext csum;
+    uint8_t mask[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t i;
+    uint16_t checksum;
+
+    for (i = 0; i < count; i++)
+        mask[offsets[i] >> 3] |= 1 << (offsets[i] & 7);
+
+    // the controller compares the checksum of the masked bytes taken in order
+    initChecksum(&csum);
+    addChecksumData(&csum, (void*)values, count);
+    checksum = getChecksum(&csum);
+
+    etherWriteRegs(EPMM0, mask, 8);
+    etherWriteReg(EPMCSL, HIBYTE(checksum));
+    etherWriteReg(EPMCSH, LOBYTE(checksum));
+    etherWriteReg(EPMOL, 0);
+    etherWriteReg(EPMOH, 0);
+}
+
+// Calculates the hash table bit for a destination address
+// The controller uses bits 28:23 of the crc-32 of the address
+uint8_t etherGetHashIndex(uint8_t mac[])
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint8_t i, j, data, next;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        data = mac[i];
+        for (j = 0; j < 8; j++)
+        {
+            next = ((crc >> 31) ^ data) & 1;
+            crc <<= 1;
+            if (next)
+                crc ^= 0x04C11DB7;
+            data >>= 1;
+        }
+    }
+    return (crc >> 23) & 0x3F;
+}
+
+// Sets the hash table so only the joined multicast groups pass
+void etherSetHashTable()
+{
+    uint8_t table[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    uint8_t mac[HW_ADD_LENGTH] = {0x01, 0x00, 0x5E, 0, 0, 0};
+    uint8_t i, index;
+
+    for (i = 0; i < groupCount; i++)
+    {
+        mac[3] = multicastGroups[i][1] & 0x7F;
+        mac[4] = multicastGroups[i][2];
+        mac[5] = multicastGroups[i][3];
+        index = etherGetHashIndex(mac);
+        table[index >> 3] |= 1 << (index & 7);
+    }
+    etherWriteRegs(EHT0, table, 8);
+}
+
+// Reprograms the receive filter from the stack state
+//   no ip:                unicast only
+//   ip and no dhcp in progress: unicast and arp requests for this ip (pattern match)
+//   dhcp waiting, no ip:  unicast and broadcast dhcp replies (pattern match)
+//   dhcp waiting with ip: unicast and broadcast (renew or rebind needs both)
+// Joined multicast groups are added with the hash table
+void etherUpdateFilter()
+{
+    const uint8_t arpOffsets[] = {12, 13, 20, 21, 38, 39, 40, 41};
+    const uint8_t dhcpOffsets[] = {12, 13, 23, 30, 31, 32, 33, 36, 37};
+    uint8_t values[PATTERN_MAX];
+    uint8_t state, rxfcon = ETHER_UNICAST | ETHER_CHECKCRC;
+
+    if (!autoFilter)
+        return;
+    if (dhcpEnabled && dhcpPending)
+        state = etherIsIpValid() ? ETHER_FILTER_BROADCAST : ETHER_FILTER_DHCP;
+    else if (etherIsIpValid())
+        state = ETHER_FILTER_ARP;
+    else
+        state = ETHER_FILTER_UNICAST;
+
+    // disable the pattern while it changes
+    etherSetBank(ERXFCON);
+    etherWriteReg(ERXFCON, rxfcon);
+    if (state == ETHER_FILTER_ARP)
+    {
+        values[0] = 0x08;                       // type arp
+        values[1] = 0x06;
+        values[2] = 0x00;                       // op request
+        values[3] = 0x01;
+        memcpy(&values[4], ipAddress, IP_ADD_LENGTH);
+        etherSetPattern(arpOffsets, values, sizeof(arpOffsets));
+        rxfcon |= ETHER_PATTERNMATCH;
+    }
+    else if (state == ETHER_FILTER_DHCP)
+    {
+        values[0] = 0x08;                       // type ip
+        values[1] = 0x00;
+        values[2] = 0x11;                       // udp
+        memset(&values[3], 0xFF, IP_ADD_LENGTH);  // to 255.255.255.255
+        values[7] = HIBYTE(DHCP_CLIENT_PORT);
+        values[8] = LOBYTE(DHCP_CLIENT_PORT);
+        etherSetPattern(dhcpOffsets, values, sizeof(dhcpOffsets));
+        rxfcon |= ETHER_PATTERNMATCH;
+    }
+    else if (state == ETHER_FILTER_BROADCAST)
+        rxfcon |= ETHER_BROADCAST;
+    if (groupCount > 0)
+    {
+        etherSetHashTable();
+        rxfcon |= ETHER_HASHTABLE;
+    }
+    etherSetBank(ERXFCON);
+    etherWriteReg(ERXFCON, rxfcon);
+    if (state != filterState)
+        rxStats.filterChanges++;
+    filterState = state;
+}
+
+// Records whether a dhcp exchange is waiting for a broadcast reply
+void etherSetDhcpPending(bool pending)
+{
+    dhcpPending = pending;
+    etherUpdateFilter();
+}
+
+// Returns true if ip is a joined multicast group
+bool etherIsJoinedGroup(uint8_t ip[])
+{
+    uint8_t i;
+    for (i = 0; i < groupCount; i++)
+        if (memcmp(multicastGroups[i], ip, IP_ADD_LENGTH) == 0)
+            return true;
+    return false;
+}
+
+// Starts receiving a multicast group
+// Returns false if the group table is full or ip is not a multicast address
+bool etherJoinMulticastGroup(uint8_t ip[4])
+{
+    if ((ip[0] & 0xF0) != 0xE0)
+        return false;
+    if (etherIsJoinedGroup(ip))
+        return true;
+    if (groupCount == MULTICAST_GROUPS)
+        return false;
+    memcpy(multicastGroups[groupCount++], ip, IP_ADD_LENGTH);
+    etherUpdateFilter();
+    return true;
+}
+
+// Returns the receive filter manager state
+uint8_t etherGetFilterState()
+{
+    return filterState;
+}
+
+// Stops receiving a multicast group
+void etherLeaveMulticastGroup(uint8_t ip[4])
+{
+    uint8_t i;
+    for (i = 0; i < groupCount; i++)
+    {
+        if (memcmp(multicastGroups[i], ip, IP_ADD_LENGTH) == 0)
+        {
+            memcpy(multicastGroups[i], multicastGroups[--groupCount], IP_ADD_LENGTH);
+            etherUpdateFilter();
+            return;
+        }
+    }
+}
+
+// Sets up an empty receive ring from 0 to end, and transmit memory above it
+// Reception must be off
+void etherSetRxRing(uint16_t end)
+{
+    rxEnd = end;
+    txStart = end + 1;
+    txFree = txStart;
+
+    etherSetBank(ERXSTL);
+    etherWriteReg(ERXSTL, LOBYTE(RX_START));
+    etherWriteReg(ERXSTH, HIBYTE(RX_START));
+    etherWriteReg(ERXNDL, LOBYTE(rxEnd));
+    etherWriteReg(ERXNDH, HIBYTE(rxEnd));
+
+    // initialize receiver write and read ptrs
+    // will write from 0 to rxEnd-1 only and will not overwrite rd ptr
+    etherWriteReg(ERXWRPTL, LOBYTE(RX_START));
+    etherWriteReg(ERXWRPTH, HIBYTE(RX_START));
+    etherWriteReg(ERXRDPTL, LOBYTE(rxEnd));
+    etherWriteReg(ERXRDPTH, HIBYTE(rxEnd));
+    etherWriteReg(ERDPTL, LOBYTE(RX_START));
+    etherWriteReg(ERDPTH, HIBYTE(RX_START));
+    nextPacketLsb = LOBYTE(RX_START);
+    nextPacketMsb = HIBYTE(RX_START);
+}
+
 // Initializes ethernet device
 // Uses order suggested in Chapter 6 of datasheet except 6.4 OST which is first here
 void etherInit(uint16_t mode)
 {
     // Initialize SPI0
+    etherInvalidateCache();
     initSpi0(USE_SSI0_RX);
     setSpi0BaudRate(4e6, 40e6);
     setSpi0Mode(0, 0);
+    if ((mode & ETHER_UDMA) != 0)
+        initSpi0Dma();
 
     // Enable clocks
     enablePort(PORTA);
@@ -388,25 +840,16 @@ void etherInit(uint16_t mode)
     etherClearReg(ECON1, TXRTS);
 
     // initialize receive buffer space
-    etherSetBank(ERXSTL);
-    etherWriteReg(ERXSTL, LOBYTE(0x0000));
-    etherWriteReg(ERXSTH, HIBYTE(0x0000));
-    etherWriteReg(ERXNDL, LOBYTE(0x1A09));
-    etherWriteReg(ERXNDH, HIBYTE(0x1A09));
-
-    // initialize receiver write and read ptrs
-    // at startup, will write from 0 to 1A08 only and will not overwrite rd ptr
-    etherWriteReg(ERXWRPTL, LOBYTE(0x0000));
-    etherWriteReg(ERXWRPTH, HIBYTE(0x0000));
-    etherWriteReg(ERXRDPTL, LOBYTE(0x1A09));
-    etherWriteReg(ERXRDPTH, HIBYTE(0x1A09));
-    etherWriteReg(ERDPTL, LOBYTE(0x0000));
-    etherWriteReg(ERDPTH, HIBYTE(0x0000));
+    etherSetRxRing(memProfiles[memProfile]);
 
     // setup receive filter
     // always check CRC, use OR mode
+    // with auto filtering, the filter manager reprograms this from stack state
     etherSetBank(ERXFCON);
     etherWriteReg(ERXFCON, (mode | ETHER_CHECKCRC) & 0xFF);
+    autoFilter = (mode & ETHER_AUTOFILTER) != 0;
+    filterState = ETHER_FILTER_FIXED;
+    etherUpdateFilter();
 
     // bring mac out of reset
     etherSetBank(MACON2);
@@ -467,6 +910,77 @@ void etherInit(uint16_t mode)
     etherWritePhy(PHLCON, 0x0472);
     // enable reception
     etherSetReg(ECON1, RXEN);
+
+    // interrupt on packet, rx error, tx done, and link change
+    if ((mode & ETHER_INTERRUPT) != 0)
+    {
+        selectPinInterruptFallingEdge(INT);
+        clearPinInterrupt(INT);
+        enablePinInterrupt(INT);
+        NVIC_EN0_R |= 1 << (INT_GPIOC-16);
+        intMode = true;
+        etherWritePhy(PHIE, PGEIE | PLNKIE);
+        etherWriteReg(EIE, INTIE | PKTIE | LINKIE | TXIE | RXERIE);
+    }
+
+    // classify frames from their headers before copying the payload
+    earlyDrop = (mode & ETHER_EARLYDROP) != 0;
+
+    // let the dma engine calculate l4 checksums in buffer memory
+    // This saves the software sums, but reception is off while the engine runs, so
+    // frames arriving then are lost; it suits light traffic better than bursts
+    csumOffload = (mode & ETHER_CSUMOFFLOAD) != 0;
+
+    // move the rx/tx split as traffic changes
+    memAdaptive = (mode & ETHER_ADAPTIVEMEM) != 0;
+}
+
+// Latches the pending interrupt flags and masks INT until they are handled
+void etherServiceInt()
+{
+    pendingEvents |= etherReadReg(EIR) & (PKTIF | RXERIF | TXIF | LINKIF);
+    etherClearReg(EIE, INTIE);
+}
+
+// Handles the INT pin falling edge
+// If the bus is in use, the flags are read when the current transfer ends
+void etherIntIsr()
+{
+    clearPinInterrupt(INT);
+    if (csActive || isSpi0Busy())
+        intDeferred = true;
+    else
+        etherServiceInt();
+}
+
+// Unmasks INT once latched events are handled; flags still set re-trigger it
+void etherRearmInt()
+{
+    if (intMode)
+        etherSetReg(EIE, INTIE);
+}
+
+// Handles latched tx and link events
+// Packet and overflow events are left for the receive path
+void etherHandleEvents()
+{
+    uint8_t events = pendingEvents & (TXIF | LINKIF);
+    if (events == 0)
+        return;
+    if ((events & LINKIF) != 0)
+        etherReadPhy(PHIR);                     // reading PHIR clears LINKIF
+    pendingEvents &= ~events;
+    if ((events & TXIF) != 0)
+        etherPollTx();
+    if ((pendingEvents & PKTIF) == 0)
+    {
+        if ((pendingEvents & RXERIF) != 0)
+        {
+            etherClearReg(EIR, RXERIF);
+            pendingEvents &= ~RXERIF;
+        }
+        etherRearmInt();
+    }
 }
 
 // Returns true if link is up
@@ -476,215 +990,1938 @@ bool etherIsLinkUp()
 }
 
 // Returns TRUE if packet received
+// In interrupt mode this uses the latched flags and costs no spi traffic when idle
 bool etherIsDataAvailable()
 {
+    if (intMode)
+    {
+        etherHandleEvents();
+        return (pendingEvents & PKTIF) != 0;
+    }
+    etherPollTx();
     return ((etherReadReg(EIR) & PKTIF) != 0);
 }
 
 // Returns true if rx buffer overflowed after correcting the problem
+// In interrupt mode an overflow alone leaves INT masked (etherHandleEvents only
+// rearms on tx and link events), so it is unmasked here unless a packet is waiting
 bool etherIsOverflow()
 {
     bool err;
-    err = (etherReadReg(EIR) & RXERIF) != 0;
+    if (intMode)
+        err = (pendingEvents & RXERIF) != 0;
+    else
+        err = (etherReadReg(EIR) & RXERIF) != 0;
     if (err)
+    {
         etherClearReg(EIR, RXERIF);
+        pendingEvents &= ~RXERIF;
+        rxStats.overflows++;
+        if ((pendingEvents & PKTIF) == 0)
+            etherRearmInt();
+    }
     return err;
 }
 
-// Returns up to max_size characters in data buffer
-// Returns number of bytes copied to buffer
-// Contents written are 16-bit size, 16-bit status, payload excl crc
-uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize)
+// Wraps an address that has run past the end of the receive ring
+uint16_t etherWrapRxAddr(uint16_t addr)
 {
-    uint16_t i = 0, size, tmp16, status;
-
-    // enable read from FIFO buffers
-    etherReadMemStart();
-
-    // get next packet information
-    nextPacketLsb = etherReadMem();
-    nextPacketMsb = etherReadMem();
-
-    // calc size
-    // don't return crc, instead return size + status, so size is correct
-    size = etherReadMem();
-    tmp16 = etherReadMem();
-    size |= (tmp16 << 8);
-
-    // get status (currently unused)
-    status = etherReadMem();
-    tmp16 = etherReadMem();
-    status |= (tmp16 << 8);
-
-    // copy data
-    if (size > maxSize)
-        size = maxSize;
-    while (i < size)
-        packet[i++] = etherReadMem();
-
-    // end read from FIFO buffers
-    etherReadMemStop();
+    if (addr > rxEnd)
+        addr -= rxEnd - RX_START + 1;
+    return addr;
+}
 
-    // advance read pointer
-    etherSetBank(ERXRDPTL);
-    etherWriteReg(ERXRDPTL, nextPacketLsb); // hw ptr
-    etherWriteReg(ERXRDPTH, nextPacketMsb);
-    etherWriteReg(ERDPTL, nextPacketLsb);   // dma rd ptr
-    etherWriteReg(ERDPTH, nextPacketMsb);
+// Calculates the 1's compliment sum of size bytes of buffer memory with the dma engine
+// Regions in the receive ring may wrap past its end
+// Returns the folded sum with the byte order used by checksumContext (not inverted)
+uint16_t etherSumMem(uint16_t start, uint16_t size)
+{
+    uint16_t end;
+    uint8_t csL, csH;
+
+    if (size == 0)
+        return 0;
+    end = start + size - 1;
+    if (start <= rxEnd)
+        end = etherWrapRxAddr(end);
+
+    // errata: the checksum can be corrupted if a packet is received meanwhile,
+    // so pause reception while the engine runs; frames that arrive until RXEN is
+    // set again are lost, which is why offload is not on by default
+    etherClearReg(ECON1, RXEN);
+    while ((etherReadReg(ESTAT) & RXBUSY) != 0);
+
+    etherSetBank(EDMASTL);
+    etherWriteReg16(EDMASTL, start);
+    etherWriteReg16(EDMANDL, end);
+    etherSetReg(ECON1, CSUMEN);
+    etherSetReg(ECON1, DMAST);
+    while ((etherReadReg(ECON1) & DMAST) != 0);
+    etherClearReg(ECON1, CSUMEN);
+    csL = etherReadReg(EDMACSL);
+    csH = etherReadReg(EDMACSH);
 
-    // decrement packet counter so that PKTIF is maintained correctly
-    etherSetReg(ECON2, PKTDEC);
+    etherSetReg(ECON1, RXEN);
 
-    return size;
+    // EDMACSH:EDMACSL is the inverted sum in network order
+    return ~(csH | (csL << 8));
 }
 
-// Writes a packet
-bool etherPutPacket(uint8_t packet[], uint16_t size)
+// Finds the l4 checksum of an unfragmented ipv4 icmp, tcp, or udp frame
+// Returns the offset of the l4 header and sets the checksum field offset,
+// size of the checksummed data, and pseudo-header sum, or returns 0
+uint16_t etherGetL4ChecksumInfo(uint8_t packet[], uint16_t size, uint16_t* field,
+                                uint16_t* l4Size, checksumContext* pseudoSum)
 {
-    uint16_t i;
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    uint16_t offset = 14 + ((ip->revSize & 0xF) * 4);
+    uint16_t tmp16;
 
-    // clear out any tx errors
-    if ((etherReadReg(EIR) & TXERIF) != 0)
+    if (ether->frameType != htons(0x0800) || (ip->flagsAndOffset & htons(0x3FFF)) != 0)
+        return 0;
+    if (14 + ntohs(ip->length) > size)
+        return 0;
+    *l4Size = ntohs(ip->length) - ((ip->revSize & 0xF) * 4);
+    if (ip->protocol == 0x01)
+        *field = 2;
+    else if (ip->protocol == 0x06)
+        *field = 16;
+    else if (ip->protocol == 0x11)
     {
-        etherClearReg(EIR, TXERIF);
-        etherSetReg(ECON1, TXRTS);
-        etherClearReg(ECON1, TXRTS);
+        *field = 6;
+        *l4Size = ntohs(udp->length);
     }
+    else
+        return 0;
+    if (offset + *field + 2 > size)
+        return 0;
 
-    // set DMA start address
-    etherSetBank(EWRPTL);
-    etherWriteReg(EWRPTL, LOBYTE(0x1A0A));
-    etherWriteReg(EWRPTH, HIBYTE(0x1A0A));
-
-    // start FIFO buffer write
-    etherWriteMemStart();
-
-    // write control byte
-    etherWriteMem(0);
-
-    // write data
-    for (i = 0; i < size; i++)
-        etherWriteMem(packet[i]);
-
-    // stop write
-    etherWriteMemStop();
-
-    // request transmit
-    etherWriteReg(ETXSTL, LOBYTE(0x1A0A));
-    etherWriteReg(ETXSTH, HIBYTE(0x1A0A));
-    etherWriteReg(ETXNDL, LOBYTE(0x1A0A+size));
-    etherWriteReg(ETXNDH, HIBYTE(0x1A0A+size));
-    etherClearReg(EIR, TXIF);
-    etherSetReg(ECON1, TXRTS);
+    // 32-bit sum over pseudo-header (tcp and udp only)
+    initChecksum(pseudoSum);
+    if (ip->protocol != 0x01)
+    {
+        addChecksumData(pseudoSum, ip->sourceIp, 8);
+        tmp16 = ip->protocol;
+        addChecksumWord(pseudoSum, (tmp16 & 0xff) << 8);
+        addChecksumWord(pseudoSum, htons(*l4Size));
+    }
+    return offset;
+}
 
-    // wait for completion
-    while ((etherReadReg(ECON1) & TXRTS) != 0);
+// Fills in the l4 checksum of a frame already written to buffer memory at addr
+// packet is the copy of the frame in ram, used for the headers
+void etherFillTxChecksum(uint8_t packet[], uint16_t addr, uint16_t size)
+{
+    uint16_t offset, field, l4Size, result;
+    checksumContext csum;
+    uint8_t zero[2] = {0, 0};
+
+    offset = etherGetL4ChecksumInfo(packet, size, &field, &l4Size, &csum);
+    if (offset == 0)
+        return;
+
+    // clear the field so it does not count in the sum
+    etherWriteMemAt(addr + offset + field, zero, 2);
+
+    addChecksumWord(&csum, etherSumMem(addr + offset, l4Size));
+    result = getChecksum(&csum);
+    if (result == 0 && field == 6)
+        result = 0xFFFF;                        // udp uses 0 for no checksum
+    etherWriteMemAt(addr + offset + field, (uint8_t*)&result, 2);
+}
 
-    // determine success
-    return ((etherReadReg(ESTAT) & TXABORT) == 0);
+// Checks the l4 checksum of the frame being received while it is still in the receive ring
+// Must be called between etherReadMemStart and etherReadMemStop once the headers are peeked
+// Returns false if the checksum is bad; sets verified if the controller checked it
+bool etherCheckRxChecksum(uint8_t packet[], uint16_t size, bool* verified)
+{
+    uint16_t offset, field, l4Size;
+    checksumContext csum;
+
+    *verified = false;
+    offset = etherGetL4ChecksumInfo(packet, size, &field, &l4Size, &csum);
+    if (offset == 0 || field == 2)
+        return true;
+    if (field == 6 && *(uint16_t*)(packet + offset + field) == 0)
+        return true;                            // udp sent without a checksum
+
+    // the read command has to end while the engine is programmed
+    // ERDPT is left where it was, so the copy can carry on afterwards
+    etherReadMemStop();
+    addChecksumWord(&csum, etherSumMem(etherWrapRxAddr(rxFrameAddr + offset), l4Size));
+    etherReadMemStart();
+    *verified = true;
+    return getChecksum(&csum) == 0;
 }
 
-// Calculate sum of words
-// Must use getEtherChecksum to complete 1's compliment addition
-void etherSumWords(void* data, uint16_t sizeInBytes)
+// Records whether the l4 checksum of the frame now in a receive buffer has been checked
+void etherSetVerified(uint8_t packet[], bool verified)
 {
-    uint8_t* pData = (uint8_t*)data;
-    uint16_t i;
-    uint8_t phase = 0;
-    uint16_t data_temp;
-    for (i = 0; i < sizeInBytes; i++)
+    uint8_t i;
+    for (i = 0; i < CSUM_VERIFIED_SLOTS; i++)
+        if (csumVerified[i] == packet)
+            csumVerified[i] = NULL;
+    if (verified)
     {
-        if (phase)
-        {
-            data_temp = *pData;
-            sum += data_temp << 8;
-        }
-        else
-            sum += *pData;
-        phase = 1 - phase;
-        pData++;
+        for (i = CSUM_VERIFIED_SLOTS - 1; i > 0; i--)
+            csumVerified[i] = csumVerified[i-1];
+        csumVerified[0] = packet;
     }
 }
 
-// Completes 1's compliment addition by folding carries back into field
-uint16_t getEtherChecksum()
+// Returns true if the controller already checked the l4 checksum of the frame in packet
+bool etherIsVerified(uint8_t packet[])
 {
-    uint16_t result;
-    // this is based on rfc1071
-    while ((sum >> 16) > 0)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-    result = sum & 0xFFFF;
-    return ~result;
+    uint8_t i;
+    bool found = false;
+    for (i = 0; i < CSUM_VERIFIED_SLOTS; i++)
+        found |= (csumVerified[i] == packet);
+    return found;
 }
 
-uint16_t *get_g_ip_l_time()
+// Moves the split between the receive ring and transmit memory to a profile
+// Reception is paused and the transmit queue drained while the pointers move
+// Returns false, leaving the map alone, if frames are waiting in the receive ring
+bool etherSetMemoryProfile(uint8_t profile)
 {
-    static uint16_t ip_l_time[4];
-    int i=0;
-    for (i = 0; i < 4; i++)
+    if (profile >= ETHER_MEM_PROFILES || rxBusy)
+        return false;
+    if (profile == memProfile)
+        return true;
+
+    // pause reception and let a frame in progress land
+    etherClearReg(ECON1, RXEN);
+    while ((etherReadReg(ESTAT) & RXBUSY) != 0);
+    etherSetBank(EPKTCNT);
+    if (etherReadReg(EPKTCNT) != 0)
     {
-       ip_l_time[i] = ack_ip_lease[i];
+        etherSetReg(ECON1, RXEN);
+        return false;
     }
+    while (txCount > 0)
+        etherPollTx();
 
-    return ip_l_time;
+    etherSetRxRing(memProfiles[profile]);
+    pendingEvents &= ~PKTIF;
+    memProfile = profile;
+    rxStats.repartitions++;
+    etherSetReg(ECON1, RXEN);
+    return true;
+}
 
+// Returns the memory profile in use
+uint8_t etherGetMemoryProfile()
+{
+    return memProfile;
 }
 
-void etherCalcIpChecksum(ipFrame* ip)
+// Returns the size of the receive ring in bytes, which holds every frame not yet read
+uint16_t etherGetRxRingSize()
 {
-    // 32-bit sum over ip header
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
+    return rxEnd - RX_START + 1;
 }
 
-// Converts from host to network order and vice versa
-uint16_t htons(uint16_t value)
+// Turns adaptive repartitioning on or off
+void etherSetMemoryAdaptive(bool enable)
 {
-    return ((value & 0xFF00) >> 8) + ((value & 0x00FF) << 8);
+    memAdaptive = enable;
+    lastOverflows = rxStats.overflows;
+    lastTxWaits = txStats.full;
 }
-#define ntohs htons
 
-// Determines whether packet is IP datagram
-bool etherIsIp(uint8_t packet[])
+// Returns true if the memory map adapts to traffic
+bool etherIsMemoryAdaptive()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    bool ok;
-    ok = (ether->frameType == htons(0x0800));
-    if (ok)
-    {
-        sum = 0;
-        etherSumWords(&ip->revSize, (ip->revSize & 0xF) * 4);
-        ok = (getEtherChecksum() == 0);
-    }
-    return ok;
+    return memAdaptive;
 }
 
-// Determines whether packet is unicast to this ip
-// Must be an IP packet
-bool etherIsIpUnicast(uint8_t packet[])
+// Moves one profile toward receive if the ring overflowed, or toward transmit
+// if senders kept waiting for transmit memory, since the last call
+// Call about once a second from the main loop
+void etherAdaptMemoryMap()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    uint8_t i = 0;
-    bool ok = true;
-    while (ok & (i < IP_ADD_LENGTH))
+    uint32_t overflows = rxStats.overflows - lastOverflows;
+    uint32_t waits = txStats.full - lastTxWaits;
+    uint8_t profile = memProfile;
+
+    if (!memAdaptive)
+        return;
+    if (overflows > 0 && profile > ETHER_MEM_RXHEAVY)
+        profile--;
+    else if (overflows == 0 && waits >= ADAPT_TX_WAITS && profile < ETHER_MEM_TXHEAVY)
+        profile++;
+
+    // if frames are waiting, try again on the next call
+    if (etherSetMemoryProfile(profile))
     {
-        ok = (ip->destIp[i] == ipAddress[i]);
-        i++;
+        lastOverflows = rxStats.overflows;
+        lastTxWaits = txStats.full;
     }
-    return ok;
 }
 
-// Determines whether packet is broadcast to this ip
-// Must be an IP packet
-bool etherIsIpBroadcast(uint8_t packet[])
+// Returns true if l4 checksums are calculated by the controller
+bool etherIsChecksumOffload()
 {
-    etherFrame* ether = (etherFrame*)packet;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    uint8_t i = 0;
+    return csumOffload;
+}
+
+// Reads the next packet pointer, size, and status from the receive ring
+// Must be called between etherReadMemStart and etherReadMemStop
+// Returns the number of bytes to copy, limited to maxSize, or 0 if the mac
+// flagged the frame as bad
+uint16_t etherReadRxHeader(uint16_t maxSize)
+{
+    uint8_t header[6];
+    uint16_t size, status;
+
+    // frame data follows the 6-byte header at the old next packet pointer
+    rxFrameAddr = etherWrapRxAddr((nextPacketLsb | (nextPacketMsb << 8)) + 6);
+
+    // get next packet information, size, and status in one burst
+    readSpi0Block(header, 6);
+    nextPacketLsb = header[0];
+    nextPacketMsb = header[1];
+
+    // calc size
+    // don't return crc, instead return size + status, so size is correct
+    size = header[2] | (header[3] << 8);
+
+    // frames the mac flags as bad (only possible if the crc filter is off) are skipped
+    status = header[4] | (header[5] << 8);
+    rxStats.frames++;
+    if ((status & RSV_RXOK) == 0)
+    {
+        rxStats.errors++;
+        return 0;
+    }
+
+    if (size > maxSize)
+        size = maxSize;
+    rxStats.delivered[filterState]++;
+    return size;
+}
+
+// Determines from the headers alone whether the stack has a use for a frame
+// Accepts arp requests for this ip, unicast icmp and udp, tcp to a listening or
+// connected port, udp to joined multicast groups, and broadcast dhcp replies
+// Unicast fragments are all kept, since only the first one carries the ports
+bool etherIsWanted(uint8_t packet[], uint16_t size)
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    udpFrame* udp;                              // tcp dest port is at the same offset
+    uint8_t i;
+    bool broadcast = true;
+
+    // requests and replies for this ip (replies feed the arp cache)
+    if (ether->frameType == htons(0x0806))
+        return size >= 42 && (arp->op == htons(1) || arp->op == htons(2))
+            && memcmp(arp->destIp, ipAddress, IP_ADD_LENGTH) == 0;
+    if (ether->frameType != htons(0x0800))
+        return false;
+    if (size < 14 + ((ip->revSize & 0xF) * 4) + 4)
+        return false;
+    udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    if (memcmp(ip->destIp, ipAddress, IP_ADD_LENGTH) == 0)
+    {
+        if (ip->protocol == 0x01 || ip->protocol == 0x11)
+            return true;
+        if ((ip->flagsAndOffset & htons(0x3FFF)) != 0)
+            return ip->protocol == 0x06;
+        if (ip->protocol == 0x06)
+            return tcpIsLocalPort(ntohs(udp->destPort));
+        return false;
+    }
+    if (etherIsJoinedGroup(ip->destIp))
+        return ip->protocol == 0x11;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        broadcast &= (ip->destIp[i] == 0xFF);
+    return broadcast && ip->protocol == 0x11 && ntohs(udp->destPort) == DHCP_CLIENT_PORT;
+}
+
+// Reads just the ethernet, ip, and first 8 l4 header bytes of the frame (42 bytes without ip options)
+// Must be called after etherReadRxHeader, before etherReadMemStop
+// Returns the number of bytes read into packet, or 0 if the frame is to be dropped
+uint16_t etherPeekPacket(uint8_t packet[], uint16_t size)
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    uint16_t peek, need;
+
+    // ethernet and minimum ip header first, then any ip options and the l4 ports
+    peek = (size < 34) ? size : 34;
+    readSpi0Block(packet, peek);
+    need = peek;
+    if (peek == 34)
+    {
+        if (ether->frameType == htons(0x0800))
+            need = 14 + ((ip->revSize & 0xF) * 4) + 8;
+        else if (ether->frameType == htons(0x0806))
+            need = 42;
+    }
+    if (need > size)
+        need = size;
+    if (need > peek)
+    {
+        readSpi0Block(packet + peek, need - peek);
+        peek = need;
+    }
+
+    if (etherIsWanted(packet, peek))
+        return peek;
+    rxStats.dropped++;
+    rxStats.unwanted[filterState]++;
+    rxStats.bytesSaved += size - peek;
+    return 0;
+}
+
+// Peeks at the headers and, with checksum offload, checks the l4 checksum in place
+// Returns the number of bytes read into packet, or 0 if the frame is to be dropped
+uint16_t etherPeekAndCheck(uint8_t packet[], uint16_t size)
+{
+    uint16_t peek;
+    bool verified = false;
+
+    peek = etherPeekPacket(packet, size);
+    if (peek != 0 && csumOffload)
+    {
+        if (!etherCheckRxChecksum(packet, size, &verified))
+        {
+            rxStats.badChecksum++;
+            rxStats.bytesSaved += size - peek;
+            peek = 0;
+        }
+    }
+    etherSetVerified(packet, verified);
+    return peek;
+}
+
+// Frees the packet just read by advancing the read pointers to the next packet
+void etherAdvanceRxPtr()
+{
+    uint16_t next = nextPacketLsb | (nextPacketMsb << 8);
+    uint16_t hwPtr;
+
+    // errata: ERXRDPT must be odd, so free up to the byte before the next packet
+    // (packets always start on even addresses)
+    hwPtr = (next == RX_START) ? rxEnd : next - 1;
+
+    // advance read pointer
+    etherSetBank(ERXRDPTL);
+    etherWriteReg(ERXRDPTL, LOBYTE(hwPtr)); // hw ptr
+    etherWriteReg(ERXRDPTH, HIBYTE(hwPtr));
+    etherWriteReg(ERDPTL, nextPacketLsb);   // dma rd ptr
+    etherWriteReg(ERDPTH, nextPacketMsb);
+
+    // decrement packet counter so that PKTIF is maintained correctly
+    etherSetReg(ECON2, PKTDEC);
+
+    // INT re-triggers if more packets are waiting
+    pendingEvents &= ~PKTIF;
+    etherRearmInt();
+}
+
+// Returns up to max_size characters in data buffer
+// Returns number of bytes copied to buffer
+// Contents written are 16-bit size, 16-bit status, payload excl crc
+// Returns 0 for frames with receive errors and, with early drop enabled, for
+// frames skipped after the header peek
+uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize)
+{
+    uint16_t size, peek = 0;
+    uint32_t t0 = spiTransactions;
+
+    // enable read from FIFO buffers
+    etherReadMemStart();
+
+    // get header and copy data
+    size = etherReadRxHeader(maxSize);
+    etherSetVerified(packet, false);
+    if (size > 0 && earlyDrop)
+    {
+        peek = etherPeekAndCheck(packet, size);
+        if (peek == 0)
+            size = 0;
+    }
+    if (size == 0)
+    {
+        // skip the payload by moving straight to the next packet
+        etherReadMemStop();
+        etherAdvanceRxPtr();
+        spiStats.rxFrames++;
+        spiStats.rxTransactions += spiTransactions - t0;
+        return 0;
+    }
+    readSpi0Block(packet + peek, size - peek);
+
+    // end read from FIFO buffers
+    etherReadMemStop();
+
+    etherAdvanceRxPtr();
+    spiStats.rxFrames++;
+    spiStats.rxTransactions += spiTransactions - t0;
+    return size;
+}
+
+// Returns the number of packets waiting in the receive ring
+uint8_t etherGetPacketCount()
+{
+    etherSetBank(EPKTCNT);
+    return etherReadReg(EPKTCNT);
+}
+
+// Receives and handles the packets waiting in the receive ring, up to budget
+// EPKTCNT is read once, so packets arriving meanwhile wait for the next call
+// handler is called with packet and its size for each packet not dropped early
+// Returns the number of packets taken from the ring
+uint8_t etherDrainPackets(uint8_t packet[], uint16_t maxSize, _etherHandler handler, uint8_t budget)
+{
+    uint8_t count, i;
+    uint16_t size;
+
+    if (!etherIsDataAvailable())
+        return 0;
+    count = etherGetPacketCount();
+    if (count == 0)
+        return 0;
+    if (count > budget)
+    {
+        count = budget;
+        rxStats.drainBudgetHits++;
+    }
+    for (i = 0; i < count; i++)
+    {
+        size = etherGetPacket(packet, maxSize);
+        if (size > 0)
+            (*handler)(packet, size);
+    }
+
+    rxStats.drainCalls++;
+    rxStats.drainFrames += count;
+    if (count > rxStats.drainMax)
+        rxStats.drainMax = count;
+    // batch sizes 1, 2, 3-4, 5-8, 9+
+    if (count <= 2)
+        rxStats.drainBatches[count - 1]++;
+    else if (count <= 4)
+        rxStats.drainBatches[2]++;
+    else if (count <= 8)
+        rxStats.drainBatches[3]++;
+    else
+        rxStats.drainBatches[4]++;
+    return count;
+}
+
+// Completes an asynchronous receive once the payload has been streamed in
+void etherGetPacketDone()
+{
+    etherReadMemStop();
+    etherAdvanceRxPtr();
+    rxBusy = false;
+    if (rxCallback != NULL)
+        (*rxCallback)(rxSize);
+}
+
+// Starts receiving the next packet into the buffer without waiting for the copy
+// callback is called with the size once the packet is in the buffer (from the
+// spi0 interrupt in uDMA mode, or before returning in polled mode)
+// Other eth0 calls made meanwhile wait for the transfer to finish
+// Frames with receive errors or dropped after the header peek are skipped
+// without calling callback
+// Returns false if a receive is already in progress
+bool etherGetPacketAsync(uint8_t packet[], uint16_t maxSize, _etherCallback callback)
+{
+    uint16_t peek = 0;
+    if (rxBusy)
+        return false;
+    rxBusy = true;
+    rxPacket = packet;
+    rxCallback = callback;
+
+    etherReadMemStart();
+    rxSize = etherReadRxHeader(maxSize);
+    etherSetVerified(rxPacket, false);
+    if (rxSize > 0 && earlyDrop)
+    {
+        peek = etherPeekAndCheck(rxPacket, rxSize);
+        if (peek == 0)
+            rxSize = 0;
+    }
+    if (rxSize == 0)
+    {
+        etherReadMemStop();
+        etherAdvanceRxPtr();
+        rxBusy = false;
+        return true;
+    }
+    startSpi0Transfer(NULL, rxPacket + peek, rxSize - peek, etherGetPacketDone);
+    return true;
+}
+
+// Returns true while an asynchronous receive is in progress
+bool etherIsRxBusy()
+{
+    return rxBusy;
+}
+
+// Returns true if buffer memory transfers use uDMA
+bool etherIsDmaMode()
+{
+    return isSpi0DmaMode();
+}
+
+// Starts sending the oldest queued frame
+void etherStartTx()
+{
+    txSlot* slot = &txQueue[txTail];
+
+    // clear out any tx errors (errata: tx logic may need a reset after an abort)
+    if ((etherReadReg(EIR) & TXERIF) != 0)
+    {
+        etherClearReg(EIR, TXERIF);
+        etherSetReg(ECON1, TXRST);
+        etherClearReg(ECON1, TXRST);
+    }
+
+    etherSetBank(ETXSTL);
+    etherWriteReg16(ETXSTL, slot->start);
+    etherWriteReg16(ETXNDL, slot->start + slot->size);
+    etherClearReg(EIR, TXIF);
+    etherSetReg(ECON1, TXRTS);
+    txActive = true;
+}
+
+// Retires the frame that just finished sending and starts the next one
+// Reads the status vector the controller wrote after the frame
+void etherCompleteTx()
+{
+    txSlot* slot = &txQueue[txTail];
+    uint16_t tsvAddr = slot->start + slot->size + 1;
+    uint8_t tsv[TSV_SIZE];
+    uint32_t t0 = spiTransactions;
+    bool aborted;
+
+    aborted = (etherReadReg(ESTAT) & TXABORT) != 0;
+    etherSetBank(ERDPTL);
+    etherWriteReg(ERDPTL, LOBYTE(tsvAddr));
+    etherWriteReg(ERDPTH, HIBYTE(tsvAddr));
+    etherReadMemBlock(tsv, TSV_SIZE);
+    etherWriteReg(ERDPTL, nextPacketLsb);   // restore dma rd ptr
+    etherWriteReg(ERDPTH, nextPacketMsb);
+
+    // tsv byte 2: collision count (3:0), done (7)
+    // tsv byte 3: excessive collisions (4), late collision (5), underrun (7)
+    if (aborted || (tsv[2] & 0x80) == 0)
+        txStats.aborted++;
+    else
+    {
+        txStats.sent++;
+        txStats.bytesOnWire += tsv[4] | (tsv[5] << 8);
+    }
+    txStats.collisions += tsv[2] & 0x0F;
+    if ((tsv[3] & 0x20) != 0)
+        txStats.lateCollisions++;
+    if ((tsv[3] & 0x10) != 0)
+        txStats.excessCollisions++;
+    if ((tsv[3] & 0x80) != 0)
+        txStats.underruns++;
+
+    txDoneSeq = slot->seq;
+    txTail = (txTail + 1) % TX_SLOTS;
+    txCount--;
+    txActive = false;
+    if (txCount > 0)
+        etherStartTx();
+    spiStats.txTransactions += spiTransactions - t0;
+}
+
+// Checks whether the frame being sent has finished
+void etherPollTx()
+{
+    if (txActive && (etherReadReg(ECON1) & TXRTS) == 0)
+        etherCompleteTx();
+}
+
+// Returns the address of a free area of size bytes in transmit memory, or 0
+// Frames are never split across the end of transmit memory
+uint16_t etherAllocTx(uint16_t size)
+{
+    uint16_t tail;
+    if (txCount == TX_SLOTS)
+        return 0;
+    if (txCount == 0)
+        txFree = txStart;
+    tail = txQueue[txTail].start;
+    if (txCount == 0 || txFree > tail)
+    {
+        if (size <= TX_END + 1 - txFree)
+            return txFree;
+        if (txCount == 0 || size > tail - txStart)
+            return 0;
+        return txStart;
+    }
+    if (size <= tail - txFree)
+        return txFree;
+    return 0;
+}
+
+// Waits until transmit memory has room for a frame of size bytes
+// Returns the start of the area, or 0 if the frame can never fit
+uint16_t etherReserveTx(uint16_t size)
+{
+    uint16_t start;
+    if (size + TX_OVERHEAD > TX_END + 1 - txStart)
+        return 0;
+    while ((start = etherAllocTx(size + TX_OVERHEAD)) == 0)
+    {
+        txStats.full++;
+        etherPollTx();
+    }
+    return start;
+}
+
+// Adds a frame written at start to the transmit queue
+// Returns its sequence number for etherIsTxDone
+uint16_t etherCommitTx(uint16_t start, uint16_t size)
+{
+    txSlot* slot;
+
+    if (++txSeq == 0)
+        txSeq = 1;
+    slot = &txQueue[txHead];
+    slot->start = start;
+    slot->size = size;
+    slot->seq = txSeq;
+    txHead = (txHead + 1) % TX_SLOTS;
+    txFree = start + size + TX_OVERHEAD;
+    txCount++;
+    txStats.queued++;
+    if (txCount > txStats.maxDepth)
+        txStats.maxDepth = txCount;
+
+    // request transmit if the transmitter is idle
+    if (!txActive)
+        etherStartTx();
+    spiStats.txFrames++;
+    return txSeq;
+}
+
+// Queues a packet for transmission and returns without waiting for it to be sent
+// Waits only while transmit memory is full
+// Returns a sequence number for etherIsTxDone, or 0 if the packet is too large
+uint16_t etherQueuePacket(uint8_t packet[], uint16_t size)
+{
+    uint8_t control = 0;
+    uint16_t start, seq;
+    uint32_t t0;
+
+    start = etherReserveTx(size);
+    if (start == 0)
+        return 0;
+    t0 = spiTransactions;
+
+    // set DMA start address
+    etherSetBank(EWRPTL);
+    etherWriteReg(EWRPTL, LOBYTE(start));
+    etherWriteReg(EWRPTH, HIBYTE(start));
+
+    // write control byte and data
+    etherWriteMemStart();
+    writeSpi0Block(&control, 1);
+    writeSpi0Block(packet, size);
+    etherWriteMemStop();
+    if (csumOffload)
+        etherFillTxChecksum(packet, start + 1, size);
+
+    seq = etherCommitTx(start, size);
+    spiStats.txTransactions += spiTransactions - t0;
+    return seq;
+}
+
+// Queues a frame given as a list of spans, e.g. headers, a topic, and a payload
+// Each span streams into transmit memory in turn, so the frame is never copied
+// together in ram
+// The first span must hold the ethernet, ip, and l4 headers, with the l4 checksum
+// field zero; the checksum is summed a span at a time while each one streams out
+// (in uDMA mode the sum overlaps the transfer), or by the dma engine when offloaded
+// Returns a sequence number for etherIsTxDone, or 0 if the frame is too large
+uint16_t etherQueueSpans(const etherSpan spans[], uint8_t count)
+{
+    checksumContext csum;
+    uint8_t control = 0;
+    uint16_t start, seq, size = 0, offset = 0, field, l4Size, skip, length, result;
+    uint32_t t0;
+    uint8_t i;
+
+    for (i = 0; i < count; i++)
+        size += spans[i].size;
+    start = etherReserveTx(size);
+    if (start == 0)
+        return 0;
+    t0 = spiTransactions;
+
+    if (!csumOffload)
+    {
+        offset = etherGetL4ChecksumInfo((uint8_t*)spans[0].data, size, &field, &l4Size, &csum);
+        if (offset != 0 && offset + field + 2 > spans[0].size)
+            offset = 0;
+    }
+
+    // set DMA start address
+    etherSetBank(EWRPTL);
+    etherWriteReg(EWRPTL, LOBYTE(start));
+    etherWriteReg(EWRPTH, HIBYTE(start));
+
+    // write control byte and each span
+    etherWriteMemStart();
+    writeSpi0Block(&control, 1);
+    skip = offset;
+    for (i = 0; i < count; i++)
+    {
+        startSpi0Transfer(spans[i].data, NULL, spans[i].size, NULL);
+        if (offset != 0 && skip < spans[i].size && l4Size > 0)
+        {
+            length = spans[i].size - skip;
+            if (length > l4Size)
+                length = l4Size;
+            addChecksumData(&csum, spans[i].data + skip, length);
+            l4Size -= length;
+        }
+        skip = (skip > spans[i].size) ? skip - spans[i].size : 0;
+        while (isSpi0Busy());
+    }
+    etherWriteMemStop();
+
+    if (csumOffload)
+        etherFillTxChecksum((uint8_t*)spans[0].data, start + 1, size);
+    else if (offset != 0)
+    {
+        result = getChecksum(&csum);
+        if (result == 0 && field == 6)
+            result = 0xFFFF;                    // udp uses 0 for no checksum
+        etherWriteMemAt(start + 1 + offset + field, (uint8_t*)&result, 2);
+    }
+
+    seq = etherCommitTx(start, size);
+    spiStats.txTransactions += spiTransactions - t0;
+    return seq;
+}
+
+// Returns true once the frame with sequence number seq has been sent or aborted
+bool etherIsTxDone(uint16_t seq)
+{
+    etherPollTx();
+    return txCount == 0 || (int16_t)(txDoneSeq - seq) >= 0;
+}
+
+// Returns the number of frames waiting in or being sent from transmit memory
+uint8_t etherGetTxQueueDepth()
+{
+    return txCount;
+}
+
+// Copies the transmit counters
+void etherGetTxStats(etherTxStats* stats)
+{
+    *stats = txStats;
+}
+
+// Copies the receive counters
+void etherGetRxStats(etherRxStats* stats)
+{
+    *stats = rxStats;
+}
+
+// Copies the spi transaction counters
+void etherGetSpiStats(etherSpiStats* stats)
+{
+    *stats = spiStats;
+    stats->transactions = spiTransactions;
+}
+
+// Writes a packet
+// The packet is queued and sent in the background
+bool etherPutPacket(uint8_t packet[], uint16_t size)
+{
+    return etherQueuePacket(packet, size) != 0;
+}
+
+// Writes a packet given as a list of spans
+bool etherPutSpans(const etherSpan spans[], uint8_t count)
+{
+    return etherQueueSpans(spans, count) != 0;
+}
+
+// Adds a tcp header in front of the segment data (and any options) in buffer
+// seq and ack are given as stored in the frame; offsetAndFlags as in htons(0x5018)
+tcpFrame* etherPrependTcp(packetBuffer* buffer, uint16_t sourcePort, uint16_t destPort,
+                          uint32_t seq, uint32_t ack, uint16_t offsetAndFlags, uint16_t window)
+{
+    tcpFrame* tcp = (tcpFrame*)prependPacketBuffer(buffer, 20);
+    tcp->srcport = htons(sourcePort);
+    tcp->destport = htons(destPort);
+    tcp->seq_no = seq;
+    tcp->ack_no = ack;
+    tcp->data_offset = htons(offsetAndFlags);
+    tcp->win_size = htons(window);
+    tcp->checksum = 0;
+    tcp->urgent_pointer = 0;
+    return tcp;
+}
+
+// Adds a udp header in front of the datagram data in buffer
+udpFrame* etherPrependUdp(packetBuffer* buffer, uint16_t sourcePort, uint16_t destPort)
+{
+    udpFrame* udp = (udpFrame*)prependPacketBuffer(buffer, 8);
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(buffer->size);
+    udp->check = 0;
+    return udp;
+}
+
+// Adds an ip header in front of the segment in buffer
+// The tcp or udp checksum covers the ip addresses, so it is completed here
+ipFrame* etherPrependIp(packetBuffer* buffer, uint8_t protocol, const uint8_t sourceIp[], const uint8_t destIp[])
+{
+    checksumContext csum;
+    uint16_t* check = NULL;
+    uint16_t l4Size = buffer->size;
+    uint8_t* l4 = buffer->data;
+
+    if (protocol == 0x06)
+        check = (uint16_t*)(l4 + 16);
+    else if (protocol == 0x11)
+        check = (uint16_t*)(l4 + 6);
+    if (check != NULL && !etherIsChecksumOffload())
+    {
+        // 32-bit sum over pseudo-header and segment
+        initChecksum(&csum);
+        addChecksumData(&csum, sourceIp, IP_ADD_LENGTH);
+        addChecksumData(&csum, destIp, IP_ADD_LENGTH);
+        addChecksumWord(&csum, protocol << 8);
+        addChecksumWord(&csum, htons(l4Size));
+        addChecksumData(&csum, l4, l4Size);
+        *check = getChecksum(&csum);
+        if (*check == 0 && protocol == 0x11)
+            *check = 0xFFFF;                    // udp uses 0 for no checksum
+    }
+
+    return etherPrependIpHeader(buffer, protocol, sourceIp, destIp, l4Size);
+}
+
+// Adds an ip header for an l4Size-byte segment in front of buffer, leaving the
+// tcp or udp checksum alone (e.g. when the rest of the segment is sent as spans)
+ipFrame* etherPrependIpHeader(packetBuffer* buffer, uint8_t protocol, const uint8_t sourceIp[],
+                              const uint8_t destIp[], uint16_t l4Size)
+{
+    ipFrame* ip = (ipFrame*)prependPacketBuffer(buffer, 20);
+    uint8_t i;
+
+    ip->revSize = 0x45;
+    ip->typeOfService = 0;
+    ip->length = htons(20 + l4Size);
+    ip->id = 0;
+    ip->flagsAndOffset = 0;
+    ip->ttl = 0xFF;
+    ip->protocol = protocol;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ip->sourceIp[i] = sourceIp[i];
+        ip->destIp[i] = destIp[i];
+    }
+    etherCalcIpChecksum(ip);
+    return ip;
+}
+
+// Adds the ethernet header in front of the packet in buffer
+etherFrame* etherPrependEther(packetBuffer* buffer, const uint8_t destAddress[], uint16_t frameType)
+{
+    etherFrame* ether = (etherFrame*)prependPacketBuffer(buffer, 14);
+    uint8_t i;
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = destAddress[i];
+        ether->sourceAddress[i] = macAddress[i];
+    }
+    ether->frameType = htons(frameType);
+    return ether;
+}
+
+// Queues the frame in buffer and gives the buffer back to the pool
+bool etherSendBuffer(packetBuffer* buffer)
+{
+    bool ok = etherPutPacket(buffer->data, buffer->size);
+    freePacketBuffer(buffer);
+    return ok;
+}
+
+// Marks every cached route stale, e.g. after the address, mask, gateway, or an arp entry changed
+void etherInvalidateRoutes()
+{
+    if (++routeGeneration == 0)
+        routeGeneration = 1;
+}
+
+// Determines whether ip is on the network of address and mask
+bool etherIsOnNetwork(const uint8_t ip[], const uint8_t address[], const uint8_t mask[])
+{
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+        if ((ip[i] & mask[i]) != (address[i] & mask[i]))
+            return false;
+    return true;
+}
+
+// Determines whether ip is the limited broadcast or the broadcast of the network
+// of address and mask
+bool etherIsBroadcastOnNetwork(const uint8_t ip[], const uint8_t address[], const uint8_t mask[])
+{
+    bool limited = true, directed = true;
+    uint8_t i;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        limited &= ip[i] == 0xFF;
+        directed &= (ip[i] | mask[i]) == 0xFF;
+    }
+    return limited || (directed && etherIsOnNetwork(ip, address, mask));
+}
+
+// Picks the address a frame for ip is sent to from the network of address and
+// mask: ip itself if it is on that network (or there is no gateway), otherwise gateway
+void etherSelectNextHop(const uint8_t ip[], const uint8_t address[], const uint8_t mask[],
+                        const uint8_t gateway[], uint8_t nextHop[])
+{
+    bool direct = etherIsOnNetwork(ip, address, mask)
+                  || (gateway[0] == 0 && gateway[1] == 0 && gateway[2] == 0 && gateway[3] == 0);
+    memcpy(nextHop, direct ? ip : gateway, IP_ADD_LENGTH);
+}
+
+// Determines whether ip is on the local network
+bool etherIsOnLink(const uint8_t ip[])
+{
+    return etherIsOnNetwork(ip, ipAddress, ipSubnetMask);
+}
+
+// Determines whether ip is the limited broadcast or the local network's broadcast
+bool etherIsBroadcastIp(const uint8_t ip[])
+{
+    return etherIsBroadcastOnNetwork(ip, ipAddress, ipSubnetMask);
+}
+
+// Picks the address a frame for ip is sent to: ip itself if it is on the local
+// network (or there is no gateway), otherwise the gateway
+void etherGetNextHop(const uint8_t ip[], uint8_t nextHop[])
+{
+    etherSelectNextHop(ip, ipAddress, ipSubnetMask, ipGwAddress, nextHop);
+}
+
+// Starts a route cache entry for frames to destIp
+void etherInitRoute(etherRoute* route, const uint8_t destIp[])
+{
+    memcpy(route->destIp, destIp, IP_ADD_LENGTH);
+    route->generation = 0;
+}
+
+// Finds the next hop and its mac for a route whose cached result is stale
+// Returns true with the route valid again, or false if the mac is not resolved
+// (resolve starts an arp request in that case)
+bool etherUpdateRoute(etherRoute* route, bool resolve)
+{
+    uint32_t generation = routeGeneration;
+    bool ok;
+
+    if (etherIsBroadcastIp(route->destIp))
+    {
+        memcpy(route->nextHop, route->destIp, IP_ADD_LENGTH);
+        memset(route->mac, 0xFF, HW_ADD_LENGTH);
+        ok = true;
+    }
+    else
+    {
+        etherGetNextHop(route->destIp, route->nextHop);
+        ok = resolve ? arpResolve(route->nextHop, route->mac) : arpLookup(route->nextHop, route->mac);
+    }
+    if (ok)
+        route->generation = generation;
+    return ok;
+}
+
+// Copies the mac frames on route are sent to
+// While nothing has changed since the route was last resolved, this is one compare
+bool etherResolveRoute(etherRoute* route, uint8_t mac[])
+{
+    if (route->generation != routeGeneration && !etherUpdateRoute(route, true))
+        return false;
+    memcpy(mac, route->mac, HW_ADD_LENGTH);
+    return true;
+}
+
+// Sends the ethernet frame in buffer along route, filling in the destination mac
+// If the next hop is not resolved, the frame waits for it in the arp cache
+bool etherSendRouted(packetBuffer* buffer, etherRoute* route)
+{
+    etherFrame* ether = (etherFrame*)buffer->data;
+    if (route->generation == routeGeneration || etherUpdateRoute(route, false))
+    {
+        memcpy(ether->destAddress, route->mac, HW_ADD_LENGTH);
+        return etherSendBuffer(buffer);
+    }
+    return arpSendBuffer(buffer, route->nextHop);
+}
+
+// Returns the largest datagram that reaches destIp unfragmented, as far as is known
+uint16_t etherGetPathMtu(const uint8_t destIp[])
+{
+    uint8_t i;
+    for (i = 0; i < ETHER_PMTU_ENTRIES; i++)
+        if (pathMtus[i].ttl != 0 && memcmp(pathMtus[i].ip, destIp, IP_ADD_LENGTH) == 0)
+            return pathMtus[i].mtu;
+    return ETHER_MTU;
+}
+
+// Records a smaller path mtu for destIp; larger values are ignored
+// When the cache is full, the entry closest to expiring is replaced
+void etherUpdatePathMtu(const uint8_t destIp[], uint16_t mtu)
+{
+    etherPathMtu* entry = NULL;
+    uint8_t i;
+
+    if (mtu < ETHER_MIN_MTU)
+        mtu = ETHER_MIN_MTU;
+    if (mtu >= etherGetPathMtu(destIp))
+        return;
+    for (i = 0; i < ETHER_PMTU_ENTRIES; i++)
+    {
+        if (pathMtus[i].ttl != 0 && memcmp(pathMtus[i].ip, destIp, IP_ADD_LENGTH) == 0)
+            entry = &pathMtus[i];
+    }
+    for (i = 0; i < ETHER_PMTU_ENTRIES && entry == NULL; i++)
+        if (pathMtus[i].ttl == 0)
+            entry = &pathMtus[i];
+    if (entry == NULL)
+    {
+        entry = &pathMtus[0];
+        for (i = 1; i < ETHER_PMTU_ENTRIES; i++)
+            if (pathMtus[i].ttl < entry->ttl)
+                entry = &pathMtus[i];
+    }
+    memcpy(entry->ip, destIp, IP_ADD_LENGTH);
+    entry->mtu = mtu;
+    entry->ttl = ETHER_PMTU_TTL;
+    txStats.pmtuUpdates++;
+}
+
+// Ages the path mtu cache; call once a second from the main loop
+void etherPathMtuTick()
+{
+    uint8_t i;
+    for (i = 0; i < ETHER_PMTU_ENTRIES; i++)
+        if (pathMtus[i].ttl != 0)
+            pathMtus[i].ttl--;
+}
+
+// Lowers the path mtu of the destination of a datagram this host sent when a
+// router reports it needed fragmenting (destination unreachable, code 4)
+// Routers that leave out the next hop mtu get the next plateau below the
+// datagram's size, as in rfc 1191; other icmp messages are ignored
+void etherHandleIcmpError(uint8_t packet[])
+{
+    const uint16_t plateaus[] = {1492, 1006, 508, 296, ETHER_MIN_MTU};
+    checksumContext csum;
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    ipFrame* original = (ipFrame*)&icmp->data;
+    uint16_t icmpSize = ntohs(ip->length) - ((ip->revSize & 0xF) * 4);
+    uint16_t mtu;
+    uint8_t i;
+
+    if (icmp->type != 3 || icmp->code != 4 || icmpSize < 8 + 20)
+        return;
+    initChecksum(&csum);
+    addChecksumData(&csum, icmp, icmpSize);
+    if (getChecksum(&csum) != 0 || memcmp(original->sourceIp, ipAddress, IP_ADD_LENGTH) != 0)
+        return;
+    mtu = ntohs(icmp->seq_no);
+    if (mtu == 0)
+    {
+        mtu = ETHER_MIN_MTU;
+        for (i = 0; i < sizeof(plateaus) / sizeof(plateaus[0]) && mtu == ETHER_MIN_MTU; i++)
+            if (plateaus[i] < ntohs(original->length))
+                mtu = plateaus[i];
+    }
+    etherUpdatePathMtu(original->destIp, mtu);
+}
+
+// Picks out size bytes starting offset bytes into a list of spans, as spans
+// Returns the number of spans written to out (at most count)
+uint8_t etherSliceSpans(const etherSpan spans[], uint8_t count, uint16_t offset, uint16_t size, etherSpan out[])
+{
+    uint8_t i, used = 0;
+    uint16_t n;
+
+    for (i = 0; i < count && size > 0; i++)
+    {
+        if (offset >= spans[i].size)
+            offset -= spans[i].size;
+        else
+        {
+            n = spans[i].size - offset;
+            if (n > size)
+                n = size;
+            out[used].data = spans[i].data + offset;
+            out[used].size = n;
+            used++;
+            size -= n;
+            offset = 0;
+        }
+    }
+    return used;
+}
+
+// Sends a datagram to destIp, whose l4 header (up to 60 bytes, checksum zero) is
+// data[0] and whose payload is the rest of the spans (up to ETHER_MAX_SPANS in all)
+// Datagrams up to 64 kB are split into fragments that fit the path mtu; the payload
+// streams out from where it is, so it is never copied together in ram
+// The l4 checksum covers the whole datagram, so it is summed in full before the first
+// fragment goes; an unfragmented datagram gets it as it streams out
+bool etherPutIpSpans(const uint8_t destMac[], const uint8_t destIp[], uint8_t protocol,
+                     const etherSpan data[], uint8_t count)
+{
+    uint8_t header[34 + 60];
+    etherSpan spans[ETHER_MAX_SPANS + 1];
+    etherFrame* ether = (etherFrame*)header;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    checksumContext csum;
+    uint32_t total = 0;
+    uint16_t l4Header, field = 0, payload, offset, n, result;
+    uint8_t i, used;
+    bool ok = true;
+
+    if (count == 0 || count > ETHER_MAX_SPANS || data[0].size > 60)
+        return false;
+    for (i = 0; i < count; i++)
+        total += data[i].size;
+    if (20 + total > 0xFFFF)
+        return false;
+    l4Header = data[0].size;
+
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+    {
+        ether->destAddress[i] = destMac[i];
+        ether->sourceAddress[i] = macAddress[i];
+    }
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->typeOfService = 0;
+    ip->id = htons(ipId++);
+    ip->ttl = 0xFF;
+    ip->protocol = protocol;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ip->sourceIp[i] = ipAddress[i];
+        ip->destIp[i] = destIp[i];
+    }
+    memcpy(header + 34, data[0].data, l4Header);
+
+    if (20 + total <= etherGetPathMtu(destIp))
+    {
+        ip->length = htons(20 + total);
+        ip->flagsAndOffset = 0;
+        etherCalcIpChecksum(ip);
+        spans[0].data = header;
+        spans[0].size = 34 + l4Header;
+        for (i = 1; i < count; i++)
+            spans[i] = data[i];
+        return etherPutSpans(spans, count);
+    }
+
+    if (protocol == 0x06)
+        field = 16;
+    else if (protocol == 0x11)
+        field = 6;
+    if (field != 0 && l4Header >= field + 2)
+    {
+        // 32-bit sum over pseudo-header and the whole datagram
+        initChecksum(&csum);
+        addChecksumData(&csum, ip->sourceIp, 8);
+        addChecksumWord(&csum, protocol << 8);
+        addChecksumWord(&csum, htons(total));
+        addChecksumData(&csum, header + 34, l4Header);
+        for (i = 1; i < count; i++)
+            addChecksumData(&csum, data[i].data, data[i].size);
+        result = getChecksum(&csum);
+        if (result == 0 && protocol == 0x11)
+            result = 0xFFFF;                    // udp uses 0 for no checksum
+        memcpy(header + 34 + field, &result, 2);
+    }
+
+    // every fragment but the last carries a multiple of 8 bytes
+    payload = (etherGetPathMtu(destIp) - 20) & ~7;
+    if (payload < l4Header)
+        return false;
+    for (offset = 0; offset < total && ok; offset += n)
+    {
+        n = (total - offset > payload) ? payload : total - offset;
+        ip->length = htons(20 + n);
+        ip->flagsAndOffset = htons(((offset + n < total) ? 0x2000 : 0) | (offset / 8));
+        etherCalcIpChecksum(ip);
+        spans[0].data = header;
+        if (offset == 0)
+        {
+            spans[0].size = 34 + l4Header;
+            used = etherSliceSpans(data + 1, count - 1, 0, n - l4Header, spans + 1);
+        }
+        else
+        {
+            spans[0].size = 34;
+            used = etherSliceSpans(data + 1, count - 1, offset - l4Header, n, spans + 1);
+        }
+        ok = etherPutSpans(spans, used + 1);
+        txStats.fragments++;
+    }
+    txStats.fragmented++;
+    return ok;
+}
+
+// Sends a udp datagram along route whose data is given as spans (up to ETHER_MAX_SPANS - 1)
+// It is fragmented to the path mtu if needed; since the spans belong to the caller,
+// it is dropped if the next hop mac is not resolved (an arp request goes out)
+bool etherSendUdpSpans(etherRoute* route, uint16_t sourcePort, uint16_t destPort,
+                       const etherSpan data[], uint8_t count)
+{
+    uint8_t header[8];
+    udpFrame* udp = (udpFrame*)header;
+    uint8_t mac[HW_ADD_LENGTH];
+    etherSpan spans[ETHER_MAX_SPANS];
+    uint32_t size = 8;
+    uint8_t i;
+
+    if (count >= ETHER_MAX_SPANS)
+        return false;
+    for (i = 0; i < count; i++)
+    {
+        spans[i + 1] = data[i];
+        size += data[i].size;
+    }
+    if (20 + size > 0xFFFF || !etherResolveRoute(route, mac))
+        return false;
+    udp->sourcePort = htons(sourcePort);
+    udp->destPort = htons(destPort);
+    udp->length = htons(size);
+    udp->check = 0;
+    spans[0].data = header;
+    spans[0].size = 8;
+    return etherPutIpSpans(mac, route->destIp, 0x11, spans, count + 1);
+}
+
+// Checks the path mtu cache, the reaction to fragmentation needed messages, and
+// span slicing, then clears the cache
+// Returns true if every case passed
+bool etherTestFragmentation()
+{
+    const uint8_t host[4] = {192, 0, 2, 10};
+    const uint8_t a[5] = {1, 2, 3, 4, 5};
+    const uint8_t b[3] = {6, 7, 8};
+    const uint8_t c[4] = {9, 10, 11, 12};
+    uint8_t packet[14 + 20 + 8 + 28];
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + 20);
+    ipFrame* original = (ipFrame*)&icmp->data;
+    checksumContext csum;
+    etherSpan spans[3], out[3];
+    uint8_t failures = 0, used, i;
+    char str[80];
+
+    // a router reports a 576-byte next hop mtu
+    memset(packet, 0, sizeof(packet));
+    ip->revSize = 0x45;
+    ip->length = htons(20 + 8 + 28);
+    icmp->type = 3;
+    icmp->code = 4;
+    icmp->seq_no = htons(576);
+    original->revSize = 0x45;
+    original->length = htons(1500);
+    memcpy(original->sourceIp, ipAddress, IP_ADD_LENGTH);
+    memcpy(original->destIp, host, IP_ADD_LENGTH);
+    initChecksum(&csum);
+    addChecksumData(&csum, icmp, 8 + 28);
+    icmp->check = getChecksum(&csum);
+    etherHandleIcmpError(packet);
+    if (etherGetPathMtu(host) != 576)
+    {
+        failures++;
+        putsUart0("fragmentation needed not applied\r\n");
+    }
+    // larger values never raise it
+    etherUpdatePathMtu(host, 1400);
+    if (etherGetPathMtu(host) != 576)
+    {
+        failures++;
+        putsUart0("path mtu raised\r\n");
+    }
+    // no next hop mtu: the plateau below the datagram size
+    icmp->seq_no = 0;
+    original->length = htons(576);
+    icmp->check = 0;
+    initChecksum(&csum);
+    addChecksumData(&csum, icmp, 8 + 28);
+    icmp->check = getChecksum(&csum);
+    etherHandleIcmpError(packet);
+    if (etherGetPathMtu(host) != 508)
+    {
+        failures++;
+        putsUart0("plateau not used\r\n");
+    }
+
+    // 4 bytes from offset 4 of a 5, 3, 4 byte chain
+    spans[0].data = a;
+    spans[0].size = 5;
+    spans[1].data = b;
+    spans[1].size = 3;
+    spans[2].data = c;
+    spans[2].size = 4;
+    used = etherSliceSpans(spans, 3, 4, 5, out);
+    if (used != 3 || out[0].data != a + 4 || out[0].size != 1 || out[1].size != 3
+        || out[2].data != c || out[2].size != 1)
+    {
+        failures++;
+        putsUart0("span slice wrong\r\n");
+    }
+
+    for (i = 0; i < ETHER_PMTU_ENTRIES; i++)
+        pathMtus[i].ttl = 0;
+    sprintf(str, "fragmentation: %u failures\r\n", failures);
+    putsUart0(str);
+    return failures == 0;
+}
+
+// Checks next hop selection on a test network given to the selection functions,
+// so the live address, mask, gateway, and arp cache are left alone, then times
+// a cached route lookup (to the limited broadcast, which needs no arp entry)
+// The route cache with arp entries and address changes is covered by the host
+// tests in test/, where changing them is harmless
+// Returns true if every case passed
+bool etherTestRouting()
+{
+    const uint8_t gw[4] = {192, 0, 2, 1};
+    const uint8_t host[4] = {192, 0, 2, 10};
+    const uint8_t remote[4] = {198, 51, 100, 7};
+    const uint8_t limited[4] = {255, 255, 255, 255};
+    const uint8_t directed[4] = {192, 0, 2, 255};
+    const uint8_t testIp[4] = {192, 0, 2, 118};
+    const uint8_t mask24[4] = {255, 255, 255, 0};
+    const uint8_t mask1[4] = {128, 0, 0, 0};
+    const uint8_t noGw[4] = {0, 0, 0, 0};
+    uint8_t hop[4], mac[6];
+    etherRoute route;
+    uint32_t t0, hitTime;
+    uint8_t failures = 0;
+    char str[80];
+
+    // on-subnet: straight to the host
+    etherSelectNextHop(host, testIp, mask24, gw, hop);
+    if (memcmp(hop, host, 4) != 0)
+    {
+        failures++;
+        putsUart0("on-subnet host not sent direct\r\n");
+    }
+
+    // off-subnet: through the gateway, or direct without one
+    etherSelectNextHop(remote, testIp, mask24, gw, hop);
+    if (memcmp(hop, gw, 4) != 0)
+    {
+        failures++;
+        putsUart0("off-subnet host not sent to gateway\r\n");
+    }
+    etherSelectNextHop(remote, testIp, mask24, noGw, hop);
+    if (memcmp(hop, remote, 4) != 0)
+    {
+        failures++;
+        putsUart0("off-subnet host not sent direct without a gateway\r\n");
+    }
+
+    // a wider mask puts the remote network on-link
+    if (!etherIsOnNetwork(remote, testIp, mask1))
+    {
+        failures++;
+        putsUart0("/1 mask does not cover remote host\r\n");
+    }
+
+    // broadcasts
+    if (!etherIsBroadcastOnNetwork(limited, testIp, mask24) || !etherIsBroadcastOnNetwork(directed, testIp, mask24)
+        || etherIsBroadcastOnNetwork(host, testIp, mask24))
+    {
+        failures++;
+        putsUart0("broadcast not recognized\r\n");
+    }
+
+    // broadcasts need no arp, and a cached route is one compare while nothing changes
+    etherInitRoute(&route, limited);
+    if (!etherResolveRoute(&route, mac) || mac[0] != 0xFF || mac[5] != 0xFF)
+    {
+        failures++;
+        putsUart0("limited broadcast not sent to ff:ff:ff:ff:ff:ff\r\n");
+    }
+    t0 = getCycleCount();
+    etherResolveRoute(&route, mac);
+    hitTime = getCycleCount() - t0;
+
+    sprintf(str, "routing: %u failures, cached route lookup %lu cycles\r\n", failures, (unsigned long)hitTime);
+    putsUart0(str);
+    return failures == 0;
+}
+
+// Builds the headers for a tcp connection from this host to destIp
+// Sums of the fields that never change are kept, so a segment only has to add
+// its lengths, id, sequence numbers, flags, window, and data
+// The destination mac is filled in from the route as each segment is sent
+void etherInitTcpTemplate(etherTcpTemplate* t, const uint8_t destIp[], uint16_t sourcePort, uint16_t destPort)
+{
+    etherFrame* ether = (etherFrame*)t->header;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + 20);
+    checksumContext csum;
+    uint8_t i;
+
+    memset(t->header, 0, ETHER_TCP_HEADERS);
+    for (i = 0; i < HW_ADD_LENGTH; i++)
+        ether->sourceAddress[i] = macAddress[i];
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->flagsAndOffset = htons(0x4000);         // don't fragment, so routers report the path mtu
+    ip->ttl = 0xFF;
+    ip->protocol = 0x06;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        ip->sourceIp[i] = ipAddress[i];
+        ip->destIp[i] = destIp[i];
+    }
+    tcp->srcport = htons(sourcePort);
+    tcp->destport = htons(destPort);
+
+    // length, id, window, and checksums are still zero
+    initChecksum(&csum);
+    addChecksumData(&csum, ip, 20);
+    t->ipSum = getChecksumSum(&csum);
+    // pseudo-header less the length, and the tcp header less seq, ack, flags, and window
+    initChecksum(&csum);
+    addChecksumData(&csum, ip->sourceIp, 8);
+    addChecksumWord(&csum, 0x06 << 8);
+    addChecksumData(&csum, tcp, 20);
+    t->tcpSum = getChecksumSum(&csum);
+    t->id = 0;
+    etherInitRoute(&t->route, destIp);
+    t->valid = true;
+}
+
+// Copies the template headers in front of the segment data in buffer and patches
+// the lengths, id, seq, ack, flags, and window; seq and ack are given as stored in the frame
+// spanSize counts data that will follow buffer as spans, in which case the tcp
+// checksum is left for etherQueueSpans
+// A segment queued before the path mtu dropped can be larger than it; that one goes
+// without don't fragment so the router splits it instead of dropping every copy
+tcpFrame* etherPrependTcpTemplate(packetBuffer* buffer, etherTcpTemplate* t, uint32_t seq, uint32_t ack,
+                                  uint16_t offsetAndFlags, uint16_t window, uint16_t spanSize)
+{
+    checksumContext csum;
+    uint8_t* data = buffer->data;
+    uint16_t dataSize = buffer->size;
+    uint16_t tcpSize = 20 + dataSize + spanSize;
+    ipFrame* ip;
+    tcpFrame* tcp;
+
+    prependPacketBuffer(buffer, ETHER_TCP_HEADERS);
+    memcpy(buffer->data, t->header, ETHER_TCP_HEADERS);
+    ip = (ipFrame*)(buffer->data + 14);
+    tcp = (tcpFrame*)(buffer->data + 34);
+    ip->length = htons(20 + tcpSize);
+    ip->id = htons(t->id++);
+    if (20 + tcpSize > etherGetPathMtu(ip->destIp))
+        ip->flagsAndOffset = 0;
+    tcp->seq_no = seq;
+    tcp->ack_no = ack;
+    tcp->data_offset = htons(offsetAndFlags);
+    tcp->win_size = htons(window);
+
+    initChecksum(&csum);
+    addChecksumWord(&csum, t->ipSum);
+    addChecksumWord(&csum, ip->length);
+    addChecksumWord(&csum, ip->id);
+    ip->headerChecksum = getChecksum(&csum);
+    if (ip->flagsAndOffset == 0)
+        ip->headerChecksum = updateChecksum(ip->headerChecksum, htons(0x4000), 0);
+
+    if (spanSize == 0 && !csumOffload)
+    {
+        initChecksum(&csum);
+        addChecksumWord(&csum, t->tcpSum);
+        addChecksumWord(&csum, htons(tcpSize));
+        addChecksumData(&csum, &tcp->seq_no, 12);
+        addChecksumData(&csum, data, dataSize);
+        tcp->checksum = getChecksum(&csum);
+    }
+    return tcp;
+}
+
+// Adds the connection headers from t to the segment in buffer and sends it
+// The segment waits in the arp cache if the next hop mac is not resolved yet
+bool etherSendTcp(etherTcpTemplate* t, packetBuffer* buffer, uint32_t seq, uint32_t ack, uint16_t offsetAndFlags,
+                  uint16_t window)
+{
+    etherPrependTcpTemplate(buffer, t, seq, ack, offsetAndFlags, window, 0);
+    return etherSendRouted(buffer, &t->route);
+}
+
+// Measures the cycles spent on the headers of a publish with a 64-byte message,
+// built field by field with full checksums and then patched from a template
+void etherBenchmarkTemplate()
+{
+    etherTcpTemplate t;
+    packetBuffer* buffer = allocPacketBuffer();
+    uint32_t t0, oldTime, newTime, initTime;
+    uint8_t i;
+    char str[80];
+
+    if (buffer == NULL)
+    {
+        putsUart0("no free packet buffer\r\n");
+        return;
+    }
+    for (i = 0; i < 64; i++)
+        buffer->data[i] = i;
+
+    t0 = getCycleCount();
+    for (i = 0; i < 100; i++)
+    {
+        resetPacketBuffer(buffer, PACKET_HEADROOM);
+        appendPacketBuffer(buffer, 64);
+        etherPrependTcp(buffer, TCP_LOCAL_PORT, MQTT_BROKER_PORT, htonl(1000), htonl(2000), 0x5018, 0xFFFF);
+        etherPrependIp(buffer, 0x06, ipAddress, brokerIp);
+        etherPrependEther(buffer, broadcastAddress, 0x0800);
+    }
+    oldTime = getCycleCount() - t0;
+
+    t0 = getCycleCount();
+    etherInitTcpTemplate(&t, brokerIp, TCP_LOCAL_PORT, MQTT_BROKER_PORT);
+    initTime = getCycleCount() - t0;
+    t0 = getCycleCount();
+    for (i = 0; i < 100; i++)
+    {
+        resetPacketBuffer(buffer, PACKET_HEADROOM);
+        appendPacketBuffer(buffer, 64);
+        etherPrependTcpTemplate(buffer, &t, htonl(1000), htonl(2000), 0x5018, 0xFFFF, 0);
+    }
+    newTime = getCycleCount() - t0;
+    freePacketBuffer(buffer);
+
+    sprintf(str, "Headers per publish: %lu cycles field by field, %lu from template\r\n",
+            (unsigned long)(oldTime / 100), (unsigned long)(newTime / 100));
+    putsUart0(str);
+    sprintf(str, "Template built once in %lu cycles (tcp checksum %s)\r\n", (unsigned long)initTime,
+            csumOffload ? "offloaded" : "in software");
+    putsUart0(str);
+}
+
+// Runs one pass of the tcp throughput benchmark, refilling the send queue as data is acked
+void etherBenchEvent(uint8_t connection, uint8_t event, const uint8_t data[], uint16_t size)
+{
+    char str[80];
+    uint16_t n;
+
+    // a discard sink sends nothing back, so data is never looked at
+    (void)data;
+    // the connection of the first pass may still be closing
+    if (connection != benchConnection)
+        return;
+    if (event == TCP_EVENT_CONNECTED)
+    {
+        tcpSetStopAndWait(connection, benchPass == 1);
+        benchQueued = 0;
+        benchAcked = 0;
+        benchStart = getMillis();
+    }
+    else if (event == TCP_EVENT_SENT)
+    {
+        benchAcked += size;
+        if (benchAcked >= TCP_BENCH_SIZE)
+        {
+            benchTime[benchPass] = getMillis() - benchStart;
+            if (benchTime[benchPass] == 0)
+                benchTime[benchPass] = 1;
+            tcpClose(connection);
+            if (benchPass++ == 0)
+            {
+                benchConnection = tcpOpen(brokerIp, TCP_BENCH_PORT, etherBenchEvent);
+                if (benchConnection == TCP_NONE)
+                    putsUart0("TCP bench: no free connection\r\n");
+            }
+            else
+            {
+                sprintf(str, "TCP bench: %lu bytes windowed in %lu ms (%lu kB/s)\r\n", (unsigned long)TCP_BENCH_SIZE,
+                        (unsigned long)benchTime[0], (unsigned long)(TCP_BENCH_SIZE / benchTime[0]));
+                putsUart0(str);
+                sprintf(str, "TCP bench: %lu bytes stop-and-wait in %lu ms (%lu kB/s)\r\n", (unsigned long)TCP_BENCH_SIZE,
+                        (unsigned long)benchTime[1], (unsigned long)(TCP_BENCH_SIZE / benchTime[1]));
+                putsUart0(str);
+                benchConnection = TCP_NONE;
+            }
+            return;
+        }
+    }
+    else if (event == TCP_EVENT_CLOSED)
+    {
+        tcpClose(connection);
+        return;
+    }
+    else if (event == TCP_EVENT_ABORTED)
+    {
+        putsUart0("TCP bench: the sink did not answer\r\n");
+        benchConnection = TCP_NONE;
+        return;
+    }
+    else
+        return;
+
+    // queue as much as the connection takes; tcp sends it as the windows open
+    while (benchQueued < TCP_BENCH_SIZE)
+    {
+        n = (TCP_BENCH_SIZE - benchQueued > ETHER_MTU - 40) ? ETHER_MTU - 40 : TCP_BENCH_SIZE - benchQueued;
+        if (!tcpSend(connection, benchData, n))
+            break;
+        benchQueued += n;
+    }
+}
+
+// Measures tcp throughput by streaming TCP_BENCH_SIZE bytes to a discard sink on
+// the broker host, first with the sliding window and then stop-and-wait
+// The results are printed once both passes are done
+// Buffer must hold at least 1460 bytes; what is in it does not matter to the sink
+void etherBenchmarkTcp(uint8_t buffer[])
+{
+    if (benchConnection != TCP_NONE)
+    {
+        putsUart0("TCP bench: already running\r\n");
+        return;
+    }
+    benchData = buffer;
+    benchPass = 0;
+    benchConnection = tcpOpen(brokerIp, TCP_BENCH_PORT, etherBenchEvent);
+    if (benchConnection == TCP_NONE)
+        putsUart0("TCP bench: no free connection\r\n");
+}
+
+// Measures buffer memory throughput for byte-at-a-time and burst transfers
+// Uses the transmit area so the receive ring is not disturbed
+// Buffer must hold at least 1518 bytes
+void etherBenchmarkSpi(uint8_t buffer[])
+{
+    const uint16_t sizes[] = {64, 128, 256, 512, 1024, 1518};
+    uint32_t t0, byteRd, burstRd, byteWr, burstWr;
+    uint16_t i, j, size;
+    char str[80];
+
+    // the transmit area is reused here, so let queued frames drain first
+    while (txCount > 0)
+        etherPollTx();
+
+    putsUart0("size  byte rd B/s  burst rd B/s  byte wr B/s  burst wr B/s\r\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size = sizes[i];
+        for (j = 0; j < size; j++)
+            buffer[j] = j;
+
+        etherSetBank(EWRPTL);
+        etherWriteReg(EWRPTL, LOBYTE(txStart));
+        etherWriteReg(EWRPTH, HIBYTE(txStart));
+        t0 = getCycleCount();
+        etherWriteMemStart();
+        for (j = 0; j < size; j++)
+            etherWriteMem(buffer[j]);
+        etherWriteMemStop();
+        byteWr = getCycleCount() - t0;
+
+        etherWriteReg(EWRPTL, LOBYTE(txStart));
+        etherWriteReg(EWRPTH, HIBYTE(txStart));
+        t0 = getCycleCount();
+        etherWriteMemBlock(buffer, size);
+        burstWr = getCycleCount() - t0;
+
+        etherWriteReg(ERDPTL, LOBYTE(txStart));
+        etherWriteReg(ERDPTH, HIBYTE(txStart));
+        t0 = getCycleCount();
+        etherReadMemStart();
+        for (j = 0; j < size; j++)
+            buffer[j] = etherReadMem();
+        etherReadMemStop();
+        byteRd = getCycleCount() - t0;
+
+        etherWriteReg(ERDPTL, LOBYTE(txStart));
+        etherWriteReg(ERDPTH, HIBYTE(txStart));
+        t0 = getCycleCount();
+        etherReadMemBlock(buffer, size);
+        burstRd = getCycleCount() - t0;
+
+        sprintf(str, "%4u  %11lu  %12lu  %11lu  %12lu\r\n", size,
+                (unsigned long)((uint64_t)size * 40000000 / byteRd),
+                (unsigned long)((uint64_t)size * 40000000 / burstRd),
+                (unsigned long)((uint64_t)size * 40000000 / byteWr),
+                (unsigned long)((uint64_t)size * 40000000 / burstWr));
+        putsUart0(str);
+    }
+
+    // restore dma rd ptr to the next packet in the receive ring
+    etherWriteReg(ERDPTL, nextPacketLsb);
+    etherWriteReg(ERDPTH, nextPacketMsb);
+}
+
+// Checks the dma checksum engine against addChecksumData on random data of several sizes
+// Uses the transmit area so the receive ring is not disturbed
+// Buffer must hold at least 1518 bytes
+// Returns true if every size matched
+bool etherTestChecksum(uint8_t buffer[])
+{
+    const uint16_t sizes[] = {1, 2, 3, 20, 21, 64, 255, 512, 1023, 1480, 1518};
+    checksumContext csum;
+    uint32_t t0, hwTime, swTime;
+    uint32_t seed = getCycleCount();
+    uint16_t i, j, size, hw, sw;
+    bool ok, allOk = true;
+    char str[80];
+
+    while (txCount > 0)
+        etherPollTx();
+
+    putsUart0("size  hw sum  sw sum  hw cycles  sw cycles\r\n");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size = sizes[i];
+        for (j = 0; j < size; j++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            buffer[j] = seed >> 24;
+        }
+        etherSetBank(EWRPTL);
+        etherWriteReg(EWRPTL, LOBYTE(txStart));
+        etherWriteReg(EWRPTH, HIBYTE(txStart));
+        etherWriteMemBlock(buffer, size);
+
+        t0 = getCycleCount();
+        hw = etherSumMem(txStart, size);
+        hwTime = getCycleCount() - t0;
+
+        t0 = getCycleCount();
+        initChecksum(&csum);
+        addChecksumData(&csum, buffer, size);
+        sw = getChecksumSum(&csum);
+        swTime = getCycleCount() - t0;
+
+        // 0x0000 and 0xFFFF are both zero in 1's compliment
+        ok = (hw == sw) || ((hw == 0 || hw == 0xFFFF) && (sw == 0 || sw == 0xFFFF));
+        allOk &= ok;
+        sprintf(str, "%4u  %04x    %04x    %9lu  %9lu  %s\r\n", size, hw, sw,
+                (unsigned long)hwTime, (unsigned long)swTime, ok ? "ok" : "FAIL");
+        putsUart0(str);
+    }
+    return allOk;
+}
+
+uint16_t *get_g_ip_l_time()
+{
+    static uint16_t ip_l_time[4];
+    int i=0;
+    for (i = 0; i < 4; i++)
+    {
+       ip_l_time[i] = ack_ip_lease[i];
+    }
+
+    return ip_l_time;
+
+}
+
+void etherCalcIpChecksum(ipFrame* ip)
+{
+    checksumContext csum;
+    // 32-bit sum over ip header
+    initChecksum(&csum);
+    addChecksumData(&csum, &ip->revSize, 10);
+    addChecksumData(&csum, ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
+    ip->headerChecksum = getChecksum(&csum);
+}
+
+// Converts from host to network order and vice versa
+uint16_t htons(uint16_t value)
+{
+    return ((value & 0xFF00) >> 8) + ((value & 0x00FF) << 8);
+}
+#define ntohs htons
+
+// Determines whether packet is IP datagram
+// Fragments are not, until they have been reassembled
+bool etherIsIp(uint8_t packet[])
+{
+    checksumContext csum;
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    bool ok;
+    ok = (ether->frameType == htons(0x0800)) && (ip->flagsAndOffset & htons(0x3FFF)) == 0;
+    if (ok)
+    {
+        initChecksum(&csum);
+        addChecksumData(&csum, &ip->revSize, (ip->revSize & 0xF) * 4);
+        ok = (getChecksum(&csum) == 0);
+    }
+    return ok;
+}
+
+// Determines whether packet is a fragment of a larger IP datagram (more fragments
+// set or a non-zero offset) with a good header checksum
+bool etherIsIpFragment(uint8_t packet[], uint16_t size)
+{
+    checksumContext csum;
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    bool ok;
+    ok = size >= 34 && ether->frameType == htons(0x0800) && (ip->flagsAndOffset & htons(0x3FFF)) != 0
+         && (ip->revSize & 0xF) >= 5 && 14 + ((ip->revSize & 0xF) * 4) <= size;
+    if (ok)
+    {
+        initChecksum(&csum);
+        addChecksumData(&csum, &ip->revSize, (ip->revSize & 0xF) * 4);
+        ok = (getChecksum(&csum) == 0);
+    }
+    return ok;
+}
+
+// Determines whether packet is unicast to this ip
+// Must be an IP packet
+bool etherIsIpUnicast(uint8_t packet[])
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    uint8_t i = 0;
+    bool ok = true;
+    while (ok & (i < IP_ADD_LENGTH))
+    {
+        ok = (ip->destIp[i] == ipAddress[i]);
+        i++;
+    }
+    return ok;
+}
+
+// Determines whether packet is broadcast to this ip
+// Must be an IP packet
+bool etherIsIpBroadcast(uint8_t packet[])
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    uint8_t i = 0;
     bool ok = true;
     while (ok & (i < IP_ADD_LENGTH))
     {
@@ -760,8 +2997,9 @@ void etherSendPingResponse(uint8_t packet[])
     etherFrame* ether = (etherFrame*)packet;
     ipFrame* ip = (ipFrame*)&ether->data;
     icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    etherSpan spans[2];
     uint8_t i, tmp;
-    uint16_t icmp_size;
+    uint16_t oldType;
     // swap source and destination fields
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
@@ -776,14 +3014,24 @@ void etherSendPingResponse(uint8_t packet[])
         ip->sourceIp[i] = tmp;
     }
     // this is a response
+    oldType = *(uint16_t*)&icmp->type;
     icmp->type = 0;
-    // calc icmp checksum
-    sum = 0;
-    etherSumWords(&icmp->type, 2);
-    icmp_size = ntohs(ip->length);
-    icmp_size -= 24; // sub ip header and icmp code, type, and check
-    etherSumWords(&icmp->id, icmp_size);
-    icmp->check = getEtherChecksum();
+    // only the type changed, so update the icmp checksum instead of summing the data again
+    // swapping the addresses leaves the ip header checksum alone
+    // a reassembled request too large for one frame is answered in fragments, which
+    // the checksum engine does not fill in, so its checksum is always updated here
+    if (ntohs(ip->length) > ETHER_MTU)
+    {
+        icmp->check = updateChecksum(icmp->check, oldType, *(uint16_t*)&icmp->type);
+        spans[0].data = (uint8_t*)icmp;
+        spans[0].size = 8;
+        spans[1].data = (uint8_t*)icmp + 8;
+        spans[1].size = ntohs(ip->length) - ((ip->revSize & 0xF) * 4) - 8;
+        etherPutIpSpans(ether->destAddress, ip->destIp, 0x01, spans, 2);
+        return;
+    }
+    if (!etherIsChecksumOffload())
+        icmp->check = updateChecksum(icmp->check, oldType, *(uint16_t*)&icmp->type);
     // send packet
     etherPutPacket(ether, 14 + ntohs(ip->length));
 }
@@ -857,7 +3105,7 @@ void etherSendArpRequest(uint8_t packet[], uint8_t ip[])
     }
     for (i = 0; i < IP_ADD_LENGTH; i++)
     {
-        arp->sourceIp[i] = g_yiaddr[i];
+        arp->sourceIp[i] = ipAddress[i];
         arp->destIp[i] = ip[i];
     }
     // send packet
@@ -866,18 +3114,14 @@ void etherSendArpRequest(uint8_t packet[], uint8_t ip[])
 
 void etherSendGratuitousArpRequest()
 {
-    uint8_t blah[1522];
-    etherFrame* ether = (etherFrame*)blah;
-    arpFrame* arp = (arpFrame*)&ether->data;
+    packetBuffer* buffer = allocPacketBuffer();
+    arpFrame* arp;
     uint8_t i;
-    // fill ethernet frame
-    for (i = 0; i < HW_ADD_LENGTH; i++)
-    {
-        ether->destAddress[i] = 0xFF;
-        ether->sourceAddress[i] = macAddress[i];
-    }
-    ether->frameType = 0x0608;
+
+    if (buffer == NULL)
+        return;
     // fill arp frame
+    arp = (arpFrame*)appendPacketBuffer(buffer, sizeof(arpFrame));
     arp->hardwareType = htons(1);
     arp->protocolType = htons(0x0800);
     arp->hardwareSize = HW_ADD_LENGTH;
@@ -893,31 +3137,34 @@ void etherSendGratuitousArpRequest()
         arp->sourceIp[i] = g_yiaddr[i];
         arp->destIp[i] = g_yiaddr[i];
     }
-    // send packet
-    etherPutPacket(ether, 42);
+    // add ethernet header and send
+    etherPrependEther(buffer, broadcastAddress, 0x0806);
+    etherSendBuffer(buffer);
 }
 
 // Determines whether packet is UDP datagram
 // Must be an IP packet
 bool etherIsUdp(uint8_t packet[])
 {
+    checksumContext csum;
     etherFrame* ether = (etherFrame*)packet;
     ipFrame* ip = (ipFrame*)&ether->data;
     udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
     bool ok;
     uint16_t tmp16;
     ok = (ip->protocol == 0x11);
-    if (ok)
+    // the controller may already have checked it in the receive ring
+    if (ok && !etherIsVerified(packet))
     {
         // 32-bit sum over pseudo-header
-        sum = 0;
-        etherSumWords(ip->sourceIp, 8);
+        initChecksum(&csum);
+        addChecksumData(&csum, ip->sourceIp, 8);
         tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        etherSumWords(&udp->length, 2);
+        addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+        addChecksumData(&csum, &udp->length, 2);
         // add udp header and data
-        etherSumWords(udp, ntohs(udp->length));
-        ok = (getEtherChecksum() == 0);
+        addChecksumData(&csum, udp, ntohs(udp->length));
+        ok = (getChecksum(&csum) == 0);
     }
     return ok;
 }
@@ -1186,27 +3433,29 @@ void etherSetAck(uint8_t packet[])
 
 bool etherIsTcp(uint8_t packet[])
 {
+    checksumContext csum;
     etherFrame* ether = (etherFrame*)packet;
     ipFrame* ip = (ipFrame*)&ether->data;
     tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
     //tcpFrame*
     bool ok;
     uint16_t tmp16;
-    uint8_t tcp_length = 0;
+    uint16_t tcp_length = 0;
     tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
     ok = (ip->protocol == 0x06);
-    if (ok)
+    // the controller may already have checked it in the receive ring
+    if (ok && !etherIsVerified(packet))
     {
         // 32-bit sum over pseudo-header
-        sum = 0;
-        etherSumWords(ip->sourceIp, 8);
+        initChecksum(&csum);
+        addChecksumData(&csum, ip->sourceIp, 8);
         tmp16 = ip->protocol;
-        sum += (tmp16 & 0xff) << 8;
-        sum += htons(tcp_length);
+        addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+        addChecksumWord(&csum, htons(tcp_length));
         //etherSumWords(tcp_length, 2);
         // add udp header and data
-        etherSumWords(tcp, (tcp_length));
-        ok = (getEtherChecksum() == 0);
+        addChecksumData(&csum, tcp, (tcp_length));
+        ok = (getChecksum(&csum) == 0);
     }
     return ok;
 }
@@ -1249,29 +3498,316 @@ uint32_t get_ip_lease_time()
 
     //}
 
-    return i_ip_lease_time;
+    return i_ip_lease_time;
+}
+// Gets pointer to UDP payload of frame
+uint8_t* etherGetUdpData(uint8_t packet[])
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    return &udp->data;
+}
+
+// Parses a received frame once into a packet descriptor
+// The ip and l4 checksums are checked here, so handlers can rely on the flags
+// Returns the packet class used to pick a handler
+uint8_t etherClassifyPacket(uint8_t packet[], uint16_t size, etherPacket* info)
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    icmpFrame* icmp;
+    tcpFrame* tcp;
+    udpFrame* udp;
+    checksumContext csum;
+    uint16_t headerSize, ipSize, l4Size, tmp16;
+    uint8_t i;
+    bool unicast = true, broadcast = true, ok;
+
+    info->frame = packet;
+    info->size = size;
+    info->frameType = ntohs(ether->frameType);
+    info->l3Offset = 14;
+    info->l4Offset = 0;
+    info->payloadOffset = 0;
+    info->payloadSize = 0;
+    info->sourcePort = 0;
+    info->destPort = 0;
+    info->tcpFlags = 0;
+    info->protocol = 0;
+    info->packetClass = ETHER_CLASS_OTHER;
+    info->flags = 0;
+
+    if (info->frameType == 0x0806)
+    {
+        info->packetClass = ETHER_CLASS_ARP;
+        if (etherIsArpRequest(packet))
+            info->flags |= ETHER_PKT_ARP_REQUEST;
+        return info->packetClass;
+    }
+    if (info->frameType != 0x0800 || size < 34)
+        return info->packetClass;
+
+    // ip header
+    headerSize = (ip->revSize & 0xF) * 4;
+    ipSize = ntohs(ip->length);
+    if (headerSize < 20 || ipSize < headerSize || 14 + ipSize > size)
+        return info->packetClass;
+    initChecksum(&csum);
+    addChecksumData(&csum, &ip->revSize, headerSize);
+    if (getChecksum(&csum) != 0)
+        return info->packetClass;
+    // fragments only hold part of the l4 data; they are classified once reassembled
+    if ((ip->flagsAndOffset & htons(0x3FFF)) != 0)
+        return info->packetClass;
+    info->flags |= ETHER_PKT_IP;
+    for (i = 0; i < IP_ADD_LENGTH; i++)
+    {
+        unicast &= (ip->destIp[i] == ipAddress[i]);
+        broadcast &= (ip->destIp[i] == 0xFF);
+    }
+    if (unicast)
+        info->flags |= ETHER_PKT_UNICAST;
+    else if (broadcast)
+        info->flags |= ETHER_PKT_BROADCAST;
+    else
+        return info->packetClass;
+
+    info->protocol = ip->protocol;
+    info->l4Offset = 14 + headerSize;
+    l4Size = ipSize - headerSize;
+    if (ip->protocol == 0x01 && l4Size >= 8)
+    {
+        icmp = (icmpFrame*)(packet + info->l4Offset);
+        if (icmp->type == 8)
+            info->flags |= ETHER_PKT_PING_REQUEST;
+        info->payloadOffset = info->l4Offset + 8;
+        info->packetClass = ETHER_CLASS_ICMP;
+    }
+    else if (ip->protocol == 0x06 && l4Size >= 20)
+    {
+        tcp = (tcpFrame*)(packet + info->l4Offset);
+        info->sourcePort = ntohs(tcp->srcport);
+        info->destPort = ntohs(tcp->destport);
+        info->tcpFlags = tcp->data_offset;
+        info->payloadOffset = info->l4Offset + ((packet[info->l4Offset + 12] >> 4) * 4);
+        // the controller may already have checked it in the receive ring
+        ok = etherIsVerified(packet);
+        if (!ok)
+        {
+            initChecksum(&csum);
+            addChecksumData(&csum, ip->sourceIp, 8);
+            tmp16 = ip->protocol;
+            addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+            addChecksumWord(&csum, htons(l4Size));
+            addChecksumData(&csum, tcp, l4Size);
+            ok = (getChecksum(&csum) == 0);
+        }
+        if (ok)
+        {
+            info->flags |= ETHER_PKT_L4_OK;
+            info->packetClass = ETHER_CLASS_TCP;
+        }
+    }
+    else if (ip->protocol == 0x11 && l4Size >= 8)
+    {
+        udp = (udpFrame*)(packet + info->l4Offset);
+        if (ntohs(udp->length) < 8 || ntohs(udp->length) > l4Size)
+            return info->packetClass;
+        l4Size = ntohs(udp->length);
+        info->sourcePort = ntohs(udp->sourcePort);
+        info->destPort = ntohs(udp->destPort);
+        info->payloadOffset = info->l4Offset + 8;
+        // a zero checksum means the sender did not calculate one
+        ok = etherIsVerified(packet) || udp->check == 0;
+        if (!ok)
+        {
+            initChecksum(&csum);
+            addChecksumData(&csum, ip->sourceIp, 8);
+            tmp16 = ip->protocol;
+            addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+            addChecksumData(&csum, &udp->length, 2);
+            addChecksumData(&csum, udp, l4Size);
+            ok = (getChecksum(&csum) == 0);
+        }
+        if (ok)
+        {
+            info->flags |= ETHER_PKT_L4_OK;
+            if (info->destPort == DHCP_CLIENT_PORT)
+                info->packetClass = ETHER_CLASS_DHCP;
+            else
+                info->packetClass = ETHER_CLASS_UDP;
+        }
+    }
+    if (info->payloadOffset != 0 && info->payloadOffset <= info->l4Offset + l4Size)
+        info->payloadSize = info->l4Offset + l4Size - info->payloadOffset;
+    return info->packetClass;
 }
-// Gets pointer to UDP payload of frame
-uint8_t* etherGetUdpData(uint8_t packet[])
+
+// Compares the cycles per frame of etherClassifyPacket with the chain of etherIs...
+// calls the main loop made before, on a fixed mix of frames like those seen with
+// the mqtt broker (mostly tcp, some pings, udp, arp, dhcp, and foreign frames)
+// Buffer must hold at least 342 bytes
+void etherBenchmarkClassifier(uint8_t buffer[])
 {
-    etherFrame* ether = (etherFrame*)packet;
+    const uint8_t mixClass[] = {ETHER_CLASS_TCP, ETHER_CLASS_ICMP, ETHER_CLASS_UDP, ETHER_CLASS_ARP,
+                                ETHER_CLASS_DHCP, ETHER_CLASS_OTHER};
+    const uint8_t mixCount[] = {40, 20, 10, 10, 5, 15};
+    const uint8_t srcIp[] = {192, 168, 1, 1};
+    etherFrame* ether = (etherFrame*)buffer;
     ipFrame* ip = (ipFrame*)&ether->data;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    return &udp->data;
+    arpFrame* arp = (arpFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + 20);
+    udpFrame* udp = (udpFrame*)((uint8_t*)ip + 20);
+    checksumContext csum;
+    etherPacket info;
+    uint32_t t0, oldTime, newTime, oldTotal = 0, newTotal = 0, frames = 0;
+    uint16_t i, j, size, ipSize, offset, field, l4Size;
+    char str[80];
+
+    etherSetVerified(buffer, false);
+    putsUart0("class  frames  old cycles/frame  new cycles/frame\r\n");
+    for (i = 0; i < sizeof(mixClass); i++)
+    {
+        // build the frame
+        for (j = 0; j < 342; j++)
+            buffer[j] = 0;
+        for (j = 0; j < HW_ADD_LENGTH; j++)
+        {
+            ether->destAddress[j] = macAddress[j];
+            ether->sourceAddress[j] = j;
+        }
+        ether->frameType = htons(0x0800);
+        ip->revSize = 0x45;
+        ip->ttl = 64;
+        for (j = 0; j < IP_ADD_LENGTH; j++)
+        {
+            ip->sourceIp[j] = srcIp[j];
+            ip->destIp[j] = ipAddress[j];
+        }
+        ipSize = 0;
+        if (mixClass[i] == ETHER_CLASS_TCP)
+        {
+            ip->protocol = 0x06;
+            tcp->srcport = htons(1883);
+            tcp->destport = htons(TCP_LOCAL_PORT);
+            tcp->data_offset = htons(0x5018);
+            tcp->win_size = htons(1024);
+            ipSize = 20 + 20 + 48;
+        }
+        else if (mixClass[i] == ETHER_CLASS_ICMP)
+        {
+            ip->protocol = 0x01;
+            buffer[34] = 8;
+            ipSize = 20 + 8 + 56;
+        }
+        else if (mixClass[i] == ETHER_CLASS_UDP || mixClass[i] == ETHER_CLASS_DHCP)
+        {
+            ip->protocol = 0x11;
+            udp->sourcePort = htons(1024);
+            udp->destPort = htons(1024);
+            ipSize = 20 + 8 + 16;
+            if (mixClass[i] == ETHER_CLASS_DHCP)
+            {
+                for (j = 0; j < IP_ADD_LENGTH; j++)
+                    ip->destIp[j] = 0xFF;
+                udp->sourcePort = htons(67);
+                udp->destPort = htons(DHCP_CLIENT_PORT);
+                ipSize = 20 + 8 + 300;
+            }
+            udp->length = htons(ipSize - 20);
+        }
+        if (ipSize != 0)
+        {
+            ip->length = htons(ipSize);
+            etherCalcIpChecksum(ip);
+            offset = etherGetL4ChecksumInfo(buffer, 14 + ipSize, &field, &l4Size, &csum);
+            addChecksumData(&csum, buffer + offset, l4Size);
+            *(uint16_t*)(buffer + offset + field) = getChecksum(&csum);
+            size = 14 + ipSize;
+        }
+        else if (mixClass[i] == ETHER_CLASS_ARP)
+        {
+            ether->frameType = htons(0x0806);
+            arp->hardwareType = htons(1);
+            arp->protocolType = htons(0x0800);
+            arp->hardwareSize = HW_ADD_LENGTH;
+            arp->protocolSize = IP_ADD_LENGTH;
+            arp->op = htons(1);
+            for (j = 0; j < IP_ADD_LENGTH; j++)
+            {
+                arp->sourceIp[j] = srcIp[j];
+                arp->destIp[j] = ipAddress[j];
+            }
+            size = 42;
+        }
+        else
+        {
+            ether->frameType = htons(0x86DD);
+            size = 14 + 40 + 32;
+        }
+
+        // before: each test rebuilds the header pointers and ip and tcp/udp are summed
+        // on their own, then the tcp flags are read until one matches
+        t0 = getCycleCount();
+        for (j = 0; j < mixCount[i]; j++)
+        {
+            etherIsArpRequest(buffer);
+            if (etherIsIp(buffer))
+            {
+                if (etherIsIpUnicast(buffer))
+                {
+                    etherIsAck(buffer);
+                    etherIsPingRequest(buffer);
+                    if (etherIsTcp(buffer))
+                    {
+                        if (get_mqtt_tcp_flag(buffer) != htons(0x8012) && get_mqtt_tcp_flag(buffer) != htons(0x5018))
+                            get_mqtt_tcp_flag(buffer);
+                    }
+                    etherIsUdp(buffer);
+                }
+                if (etherIsIpBroadcast(buffer))
+                {
+                    etherIsOffer(buffer);
+                    etherIsAck(buffer);
+                }
+            }
+        }
+        oldTime = getCycleCount() - t0;
+
+        // after: one pass fills the descriptor
+        t0 = getCycleCount();
+        for (j = 0; j < mixCount[i]; j++)
+            etherClassifyPacket(buffer, size, &info);
+        newTime = getCycleCount() - t0;
+
+        oldTotal += oldTime;
+        newTotal += newTime;
+        frames += mixCount[i];
+        sprintf(str, "%5u  %6u  %16lu  %16lu%s\r\n", mixClass[i], mixCount[i],
+                (unsigned long)(oldTime / mixCount[i]), (unsigned long)(newTime / mixCount[i]),
+                info.packetClass == mixClass[i] ? "" : "  (misclassified)");
+        putsUart0(str);
+    }
+    sprintf(str, "mix    %6lu  %16lu  %16lu\r\n", (unsigned long)frames,
+            (unsigned long)(oldTotal / frames), (unsigned long)(newTotal / frames));
+    putsUart0(str);
 }
 
 // Send responses to a udp datagram
 // destination port, ip, and hardware address are extracted from provided data
 // uses destination port of received packet as destination of this packet
 
-void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize)
+void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint16_t udpSize)
 {
+    checksumContext csum;
     etherFrame* ether = (etherFrame*)packet;
     ipFrame* ip = (ipFrame*)&ether->data;
     udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    etherSpan spans[2];
     uint8_t *copyData;
-    uint8_t i, tmp8;
-    uint16_t tmp16;
+    uint8_t tmp8;
+    uint16_t i, tmp16, oldLength;
     // swap source and destination fields
     for (i = 0; i < HW_ADD_LENGTH; i++)
     {
@@ -1290,28 +3826,44 @@ void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize)
     // unusual nomenclature, but this allows a different tx
     // and rx port on other machine
     udp->sourcePort = udp->destPort;
+    // a response too large for one frame goes out in fragments, straight from udpData
+    if (((ip->revSize & 0xF) * 4) + 8 + udpSize > etherGetPathMtu(ip->destIp))
+    {
+        udp->length = htons(8 + udpSize);
+        udp->check = 0;
+        spans[0].data = (uint8_t*)udp;
+        spans[0].size = 8;
+        spans[1].data = udpData;
+        spans[1].size = udpSize;
+        etherPutIpSpans(ether->destAddress, ip->destIp, 0x11, spans, 2);
+        return;
+    }
     // adjust lengths
+    oldLength = ip->length;
     ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + udpSize);
-    // 32-bit sum over ip header
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
+    // only the length changed in the ip header
+    ip->headerChecksum = updateChecksum(ip->headerChecksum, oldLength, ip->length);
     udp->length = htons(8 + udpSize);
     // copy data
     copyData = &udp->data;
     for (i = 0; i < udpSize; i++)
         copyData[i] = udpData[i];
     // 32-bit sum over pseudo-header
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, udpSize);
-    udp->check = getEtherChecksum();
+    // the payload is new, so the udp checksum is calculated in full
+    if (!etherIsChecksumOffload())
+    {
+        initChecksum(&csum);
+        addChecksumData(&csum, ip->sourceIp, 8);
+        tmp16 = ip->protocol;
+        addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+        addChecksumData(&csum, &udp->length, 2);
+        // add udp header except crc
+        addChecksumData(&csum, udp, 6);
+        addChecksumData(&csum, &udp->data, udpSize);
+        udp->check = getChecksum(&csum);
+        if (udp->check == 0)
+            udp->check = 0xFFFF;
+    }
 
     // send packet with size = ether + udp hdr + ip header + udp_size
     etherPutPacket(ether, 22 + ((ip->revSize & 0xF) * 4) + udpSize);
@@ -1326,6 +3878,7 @@ void etherSet_g_IP()
 //    uint8_t g_subnet[4];
 //    uint8_t g_gateway[4];
 //    uint8_t g_dns[4];
+    dhcpPending = false;
     etherSetIpAddress(g_yiaddr[0], g_yiaddr[1], g_yiaddr[2], g_yiaddr[3]);
     etherSetIpSubnetMask(g_subnet[0],g_subnet[1], g_subnet[2], g_subnet[3]);
     etherSetIpGatewayAddress(g_gateway[0], g_gateway[1], g_gateway[2], g_gateway[3]);
@@ -1337,59 +3890,16 @@ void etherSet_g_IP()
 
 void etherSendDiscoverMessage()
 {
-    uint8_t blah[1522];
-    etherFrame* ether = (etherFrame*)blah;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    ip->revSize = 0x45;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t i, tmp8;
-    uint16_t tmp16;
-
-    ether->sourceAddress[0]=0x02;
-    ether->sourceAddress[1]=0x03;
-    ether->sourceAddress[2]=0x04;
-    ether->sourceAddress[3]=0x05;
-    ether->sourceAddress[4]=0x06;
-    ether->sourceAddress[5]=0x76;
-
-    ether->destAddress[0]=0xff;
-    ether->destAddress[1]=0xff;
-    ether->destAddress[2]=0xff;
-    ether->destAddress[3]=0xff;
-    ether->destAddress[4]=0xff;
-    ether->destAddress[5]=0xff;
-
-    ether->frameType =  htons(0x0800);
-
-    ip->sourceIp[0]=0;
-    ip->sourceIp[1]=0;
-    ip->sourceIp[2]=0;
-    ip->sourceIp[3]=0;
-
-    ip->destIp[0]=0xff;
-    ip->destIp[1]=0xff;
-    ip->destIp[2]=0xff;
-    ip->destIp[3]=0xff;
-
-
-    ip->typeOfService = 0x00;
-    ip->id = htons(0x0000);
-    ip->flagsAndOffset =htons(0x0000);
-    ip->ttl=0xff;
-    ip->protocol= 17;
-    ip->headerChecksum =0x00;
-
-    // set source port of resp will be dest port of req
-    // dest port of resp will be left at source port of req
-    // unusual nomenclature, but this allows a different tx
-    // and rx port on other machine
-    udp->sourcePort = htons(68);
-    udp->destPort = htons(67);
-    udp->check =0;
-
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    packetBuffer* buffer;
+    uint8_t i;
 
-    memset(dhcp, 0, 400);
+    // replies are broadcast until the lease is bound
+    etherSetDhcpPending(true);
+    buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
+    dhcpFrame* dhcp = (dhcpFrame*)appendPacketBuffer(buffer, 240 + 19);
+    memset(dhcp, 0, 240 + 19);
 
 
     dhcp->op = 1;
@@ -1470,84 +3980,22 @@ void etherSendDiscoverMessage()
 
     d_options->endoption = 255;
 
-
-    udp->length=htons(8+240+19);
-    //adjust lengths
-    ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + 240+19);
-
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
-
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, 259);
-    udp->check = getEtherChecksum();
-    // send packet with size = ether + udp hdr + ip header + udp_size + dhcp size + options
-    etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + 240+19);
+    etherPrependUdp(buffer, DHCP_CLIENT_PORT, 67);
+    etherPrependIp(buffer, 17, unspecifiedIp, broadcastIp);
+    etherPrependEther(buffer, broadcastAddress, 0x0800);
+    etherSendBuffer(buffer);
 }
 
 void etherSendDeclineMessage()
 {
-    uint8_t blah[500];
-    etherFrame* ether = (etherFrame*)blah;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    ip->revSize = 0x45;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t i, tmp8;
-    uint16_t tmp16;
-
-    ether->sourceAddress[0]=0x02;
-    ether->sourceAddress[1]=0x03;
-    ether->sourceAddress[2]=0x04;
-    ether->sourceAddress[3]=0x05;
-    ether->sourceAddress[4]=0x06;
-    ether->sourceAddress[5]=0x76;
-
-    ether->destAddress[0]=0xff;
-    ether->destAddress[1]=0xff;
-    ether->destAddress[2]=0xff;
-    ether->destAddress[3]=0xff;
-    ether->destAddress[4]=0xff;
-    ether->destAddress[5]=0xff;
-
-    ether->frameType =  htons(0x0800);
-
-    ip->sourceIp[0]=0;
-    ip->sourceIp[1]=0;
-    ip->sourceIp[2]=0;
-    ip->sourceIp[3]=0;
-
-    ip->destIp[0]=0xff;
-    ip->destIp[1]=0xff;
-    ip->destIp[2]=0xff;
-    ip->destIp[3]=0xff;
-
-
-    ip->typeOfService = 0x00;
-    ip->id = htons(0x0000);
-    ip->flagsAndOffset =htons(0x0000);
-    ip->ttl=0xff;
-    ip->protocol= 17;
-    ip->headerChecksum =0x00;
-
-    // set source port of resp will be dest port of req
-    // dest port of resp will be left at source port of req
-    // unusual nomenclature, but this allows a different tx
-    // and rx port on other machine
-    udp->sourcePort = htons(68);
-    udp->destPort = htons(67);
-    udp->check =0;
-
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    packetBuffer* buffer;
+    uint8_t i;
 
-    memset(dhcp, 0, 400);
+    buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
+    dhcpFrame* dhcp = (dhcpFrame*)appendPacketBuffer(buffer, 240 + 19);
+    memset(dhcp, 0, 240 + 19);
 
 
     dhcp->op = 1;
@@ -1628,85 +4076,23 @@ void etherSendDeclineMessage()
 
     d_options->endoption = 255;
 
-
-    udp->length=htons(8+240+19);
-    //adjust lengths
-    ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + 240+19);
-
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
-
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, 259);
-    udp->check = getEtherChecksum();
-    // send packet with size = ether + udp hdr + ip header + udp_size + dhcp size + options
-    etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + 240+19);
+    etherPrependUdp(buffer, DHCP_CLIENT_PORT, 67);
+    etherPrependIp(buffer, 17, unspecifiedIp, broadcastIp);
+    etherPrependEther(buffer, broadcastAddress, 0x0800);
+    etherSendBuffer(buffer);
 }
 
 
 void etherSendDHCPRelease()
 {
-    uint8_t blah[500];
-    etherFrame* ether = (etherFrame*)blah;
-    ipFrame* ip = (ipFrame*)&ether->data;
-    ip->revSize = 0x45;
-    udpFrame* udp = (udpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-    uint8_t i, tmp8;
-    uint16_t tmp16;
-
-    ether->sourceAddress[0]=0x02;
-    ether->sourceAddress[1]=0x03;
-    ether->sourceAddress[2]=0x04;
-    ether->sourceAddress[3]=0x05;
-    ether->sourceAddress[4]=0x06;
-    ether->sourceAddress[5]=0x76;
-
-    ether->destAddress[0]=0xff;
-    ether->destAddress[1]=0xff;
-    ether->destAddress[2]=0xff;
-    ether->destAddress[3]=0xff;
-    ether->destAddress[4]=0xff;
-    ether->destAddress[5]=0xff;
-
-    ether->frameType =  htons(0x0800);
-
-    ip->sourceIp[0]=0;
-    ip->sourceIp[1]=0;
-    ip->sourceIp[2]=0;
-    ip->sourceIp[3]=0;
-
-    ip->destIp[0]=0xff;
-    ip->destIp[1]=0xff;
-    ip->destIp[2]=0xff;
-    ip->destIp[3]=0xff;
-
-
-    ip->typeOfService = 0x00;
-    ip->id = htons(0x0000);
-    ip->flagsAndOffset =htons(0x0000);
-    ip->ttl=0xff;
-    ip->protocol= 17;
-    ip->headerChecksum =0x00;
-
-    // set source port of resp will be dest port of req
-    // dest port of resp will be left at source port of req
-    // unusual nomenclature, but this allows a different tx
-    // and rx port on other machine
-    udp->sourcePort = htons(68);
-    udp->destPort = htons(67);
-    udp->check =0;
-
-    dhcpFrame* dhcp = (dhcpFrame*)&udp->data;
+    packetBuffer* buffer;
+    uint8_t i;
 
-    memset(dhcp, 0, 400);
+    buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
+    dhcpFrame* dhcp = (dhcpFrame*)appendPacketBuffer(buffer, 240 + 19);
+    memset(dhcp, 0, 240 + 19);
 
 
     dhcp->op = 1;
@@ -1789,31 +4175,16 @@ void etherSendDHCPRelease()
 
     d_options->endoption = 255;
 
-
-    udp->length=htons(8+240+19);
-    //adjust lengths
-    ip->length = htons(((ip->revSize & 0xF) * 4) + 8 + 240+19);
-
-    sum = 0;
-    etherSumWords(&ip->revSize, 10);
-    etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-    ip->headerChecksum = getEtherChecksum();
-
-    sum = 0;
-    etherSumWords(ip->sourceIp, 8);
-    tmp16 = ip->protocol;
-    sum += (tmp16 & 0xff) << 8;
-    etherSumWords(&udp->length, 2);
-    // add udp header except crc
-    etherSumWords(udp, 6);
-    etherSumWords(&udp->data, 259);
-    udp->check = getEtherChecksum();
-    // send packet with size = ether + udp hdr + ip header + udp_size + dhcp size + options
-    etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + 8 + 240+19);
+    etherPrependUdp(buffer, DHCP_CLIENT_PORT, 67);
+    etherPrependIp(buffer, 17, unspecifiedIp, broadcastIp);
+    etherPrependEther(buffer, broadcastAddress, 0x0800);
+    etherSendBuffer(buffer);
 }
 
 void etherSendDHCPRebind()
 {
+    // replies are broadcast until the lease is bound
+    etherSetDhcpPending(true);
 //    uint8_t blah[500];
 //    etherFrame* ether = (etherFrame*)blah;
 //    ipFrame* ip = (ipFrame*)&ether->data;
@@ -1998,6 +4369,8 @@ void etherSendDHCPRebind()
 
 void etherSendDHCPRequest()
 {
+    // replies are broadcast until the lease is bound
+    etherSetDhcpPending(true);
 //       uint8_t blah[500];
 //       etherFrame* ether = (etherFrame*)blah;
 //       ipFrame* ip = (ipFrame*)&ether->data;
@@ -2376,10 +4749,10 @@ void send_syn_ack(uint8_t packet[])
     etherFrame* ether = (etherFrame*)packet;
         ipFrame* ip = (ipFrame*)&ether->data;
         tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-       uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
+       uint16_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
         uint8_t *copyData;
         uint8_t i, tmp8;
-        uint16_t tmp16,tmps;
+        uint16_t tmps,check,oldLength;
         // swap source and destination fields
         for (i = 0; i < HW_ADD_LENGTH; i++)
         {
@@ -2401,20 +4774,26 @@ void send_syn_ack(uint8_t packet[])
         tcp->srcport = tcp->destport;
         tcp->destport = tmps;
 
+        // swapping addresses and ports leaves both checksums alone, so only
+        // the fields changed below are taken out of the sums and put back in
+        check = tcp->checksum;
+        check = updateChecksum(check, tcp->data_offset, htons(0x8012));
         tcp->data_offset = htons(0x8012);
         uint32_t temp_seq = tcp->seq_no;
 
         tcp->seq_no = (temp_seq);
+        check = updateChecksum32(check, tcp->ack_no, htonl((htonl(temp_seq)+1)));
         tcp->ack_no = htonl((htonl(temp_seq)+1));
         tcp->checksum = 0x00;
+        check = updateChecksum(check, tcp->urgent_pointer, 0x00);
         tcp->urgent_pointer = 0x00;
        // tcp->
 
 
         // adjust lengths
+        oldLength = ip->length;
         ip->length = htons(((ip->revSize & 0xF) * 4) + tcp_length);
-        // 32-bit sum over ip header
-        sum = 0;
+        ip->headerChecksum = updateChecksum(ip->headerChecksum, oldLength, ip->length);
         //etherSumWords(&ip->revSize, 10);
         //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
         //ip->headerChecksum = getEtherChecksum();
@@ -2424,15 +4803,8 @@ void send_syn_ack(uint8_t packet[])
        // for (i = 0; i < udpSize; i++)
          //   copyData[i] = udpData[i];
         // 32-bit sum over pseudo-header
-        sum = 0;
-               etherSumWords(ip->sourceIp, 8);
-               tmp16 = ip->protocol;
-               sum += (tmp16 & 0xff) << 8;
-               sum += htons(tcp_length);
-               //etherSumWords(tcp_length, 2);
-               // add udp header and data
-               etherSumWords(tcp, (tcp_length));
-               tcp->checksum = getEtherChecksum();
+        if (!etherIsChecksumOffload())
+            tcp->checksum = check;
 
         // send packet with size = ether + udp hdr + ip header + udp_size
         etherPutPacket(ether, 14 + ((ip->revSize & 0xF) * 4) + tcp_length);
@@ -2444,11 +4816,11 @@ void send_ack(uint8_t packet[])
         etherFrame* ether = (etherFrame*)packet;
            ipFrame* ip = (ipFrame*)&ether->data;
            tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-          uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          uint8_t tcp_data_length = tcp_length - 20 ;
+          uint16_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
+          uint16_t tcp_data_length = tcp_length - 20 ;
            uint8_t *copyData;
            uint8_t i, tmp8;
-           uint16_t tmp16,tmps;
+           uint16_t tmps,check,oldLength;
            // swap source and destination fields
            for (i = 0; i < HW_ADD_LENGTH; i++)
            {
@@ -2470,20 +4842,29 @@ void send_ack(uint8_t packet[])
            tcp->srcport = tcp->destport;
            tcp->destport = tmps;
 
+           // swapping addresses and ports leaves both checksums alone, so only
+           // the fields changed below are taken out of the sums and put back in
+           check = tcp->checksum;
+           check = updateChecksum(check, tcp->data_offset, htons(0x5018));
            tcp->data_offset = htons(0x5018);
            uint32_t temp_seq = tcp->seq_no;
+           uint32_t temp_ack = tcp->ack_no;
 
-           tcp->seq_no = tcp->ack_no;
+           // the ack field still holds the old ack, now copied into seq
+           check = updateChecksum32(check, temp_seq, temp_ack);
+           tcp->seq_no = temp_ack;
+           check = updateChecksum32(check, temp_ack, htonl((htonl(temp_seq)+tcp_data_length)));
            tcp->ack_no = htonl((htonl(temp_seq)+tcp_data_length));
            tcp->checksum = 0x00;
+           check = updateChecksum(check, tcp->urgent_pointer, 0x00);
            tcp->urgent_pointer = 0x00;
           // tcp->
 
 
            // adjust lengths
+           oldLength = ip->length;
            ip->length = htons(((ip->revSize & 0xF) * 4) + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
+           ip->headerChecksum = updateChecksum(ip->headerChecksum, oldLength, ip->length);
            //etherSumWords(&ip->revSize, 10);
            //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
            //ip->headerChecksum = getEtherChecksum();
@@ -2493,15 +4874,8 @@ void send_ack(uint8_t packet[])
           // for (i = 0; i < udpSize; i++)
             //   copyData[i] = udpData[i];
            // 32-bit sum over pseudo-header
-           sum = 0;
-                  etherSumWords(ip->sourceIp, 8);
-                  tmp16 = ip->protocol;
-                  sum += (tmp16 & 0xff) << 8;
-                  sum += htons(tcp_length);
-                  //etherSumWords(tcp_length, 2);
-                  // add udp header and data
-                  etherSumWords(tcp, (tcp_length));
-                  tcp->checksum = getEtherChecksum();
+           if (!etherIsChecksumOffload())
+               tcp->checksum = check;
 
            // send packet with size = ether + udp hdr + ip header + udp_size
            etherPutPacket(ether, 14 + htons(ip->length));
@@ -2510,12 +4884,13 @@ void send_ack(uint8_t packet[])
 
 void send_fin_ack(uint8_t packet[])
 {
+    checksumContext csum;
     uint8_t blah;
             etherFrame* ether = (etherFrame*)packet;
                ipFrame* ip = (ipFrame*)&ether->data;
                tcpFrame* tcp = (tcpFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-              uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-              uint8_t tcp_data_length = tcp_length - 20 ;
+              uint16_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
+              uint16_t tcp_data_length = tcp_length - 20 ;
                uint8_t *copyData;
                uint8_t i, tmp8;
                uint16_t tmp16,tmps;
@@ -2553,7 +4928,7 @@ void send_fin_ack(uint8_t packet[])
                // adjust lengths
                ip->length = htons(((ip->revSize & 0xF) * 4) + tcp_length);
                // 32-bit sum over ip header
-               sum = 0;
+               initChecksum(&csum);
                //etherSumWords(&ip->revSize, 10);
                //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
                //ip->headerChecksum = getEtherChecksum();
@@ -2563,461 +4938,79 @@ void send_fin_ack(uint8_t packet[])
               // for (i = 0; i < udpSize; i++)
                 //   copyData[i] = udpData[i];
                // 32-bit sum over pseudo-header
-               sum = 0;
-                      etherSumWords(ip->sourceIp, 8);
-                      tmp16 = ip->protocol;
-                      sum += (tmp16 & 0xff) << 8;
-                      sum += htons(tcp_length);
-                      //etherSumWords(tcp_length, 2);
-                      // add udp header and data
-                      etherSumWords(tcp, (tcp_length));
-                      tcp->checksum = getEtherChecksum();
-
-               // send packet with size = ether + udp hdr + ip header + udp_size
-               etherPutPacket(ether, 14 + htons(ip->length));
-}
-
-void send_syn()
-{
-        uint8_t blah[1522];
-        etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-         // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-           uint8_t *copyData;
-           uint8_t tmp8;
-           uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x8002);
-          // uint32_t temp_seq = tcp->seq_no;
-
-           //tcp->seq_no = htonl(0x1729);
-           //tcp->ack_no = htonl((htonl(tcp->seq_no)+1));
-
-           tcp->seq_no = 0;
-           tcp->ack_no = 0;
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-          // tcp->
-
-           uint8_t *tcp_options = (uint8_t*)&tcp->options;
-
-           uint8_t i=0;
-           tcp_options[i++]= 0x02;
-           tcp_options[i++]= 0x04;
-           tcp_options[i++]= 0xff;
-           tcp_options[i++]= 0xc3;
-           tcp_options[i++]= 0x01;
-           tcp_options[i++]= 0x03;
-           tcp_options[i++]= 0x03;
-           tcp_options[i++]= 0x08;
-           tcp_options[i++]= 0x01;
-           tcp_options[i++]= 0x01;
-           tcp_options[i++]= 0x04;
-           tcp_options[i++]= 0x02;
-
-
-
-           uint8_t tcp_length = 20+12;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-           //udp->length = htons(8 + udpSize);
-           // copy data
-        //   copyData = &udp->data;
-          // for (i = 0; i < udpSize; i++)
-            //   copyData[i] = udpData[i];
-           // 32-bit sum over pseudo-header
-           sum = 0;
-                  etherSumWords(ip->sourceIp, 8);
-                  tmp16 = ip->protocol;
-                  sum += (tmp16 & 0xff) << 8;
-                  sum += htons(tcp_length);
-                  //etherSumWords(tcp_length, 2);
-                  // add udp header and data
-                  etherSumWords(tcp, (tcp_length));
-                  tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
-}
-
-
-void send_mqtt_ack(uint32_t tcp_ack, uint32_t tcp_seq)
-{
-        uint8_t blah[1522];
-        etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-         // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-           uint8_t *copyData;
-           uint8_t tmp8;
-           uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5010);
-          // uint32_t temp_seq = tcp->seq_no;
-
-           //tcp->seq_no = htonl(0x1729);
-           //tcp->ack_no = htonl((htonl(tcp->seq_no)+1));
-           //uint32_t temp_seq = tcp->seq_no;
-
-                   tcp->seq_no = tcp_seq;
-                   tcp->ack_no = tcp_ack;
-
-                   g_sekno = tcp->seq_no;
-                   g_ackno = tcp->ack_no;
-         //  tcp->seq_no = 0;
-           //tcp->ack_no = 0;
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-          // tcp->
-
-//           uint8_t *tcp_options = (uint8_t*)&tcp->options;
-//
-//           uint8_t i=0;
-//           tcp_options[i++]= 0x02;
-//           tcp_options[i++]= 0x04;
-//           tcp_options[i++]= 0xff;
-//           tcp_options[i++]= 0xc3;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x03;
-//           tcp_options[i++]= 0x03;
-//           tcp_options[i++]= 0x08;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x04;
-//           tcp_options[i++]= 0x02;
-
-
-
-           uint8_t tcp_length = 20;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-           //udp->length = htons(8 + udpSize);
-           // copy data
-        //   copyData = &udp->data;
-          // for (i = 0; i < udpSize; i++)
-            //   copyData[i] = udpData[i];
-           // 32-bit sum over pseudo-header
-           sum = 0;
-                  etherSumWords(ip->sourceIp, 8);
-                  tmp16 = ip->protocol;
-                  sum += (tmp16 & 0xff) << 8;
-                  sum += htons(tcp_length);
-                  //etherSumWords(tcp_length, 2);
-                  // add udp header and data
-                  etherSumWords(tcp, (tcp_length));
-                  tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
-}
-
-
-void send_mqtt_finack(uint32_t tcp_ack, uint32_t tcp_seq)
-{
-        uint8_t blah[1522];
-        etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-         // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-           uint8_t *copyData;
-           uint8_t tmp8;
-           uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5011);
-          // uint32_t temp_seq = tcp->seq_no;
-
-           //tcp->seq_no = htonl(0x1729);
-           //tcp->ack_no = htonl((htonl(tcp->seq_no)+1));
-           //uint32_t temp_seq = tcp->seq_no;
-
-                   tcp->seq_no = tcp_seq;
-                   tcp->ack_no = tcp_ack;
-
-                   g_sekno = tcp->seq_no;
-                   g_ackno = tcp->ack_no;
-         //  tcp->seq_no = 0;
-           //tcp->ack_no = 0;
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-          // tcp->
-
-//           uint8_t *tcp_options = (uint8_t*)&tcp->options;
-//
-//           uint8_t i=0;
-//           tcp_options[i++]= 0x02;
-//           tcp_options[i++]= 0x04;
-//           tcp_options[i++]= 0xff;
-//           tcp_options[i++]= 0xc3;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x03;
-//           tcp_options[i++]= 0x03;
-//           tcp_options[i++]= 0x08;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x01;
-//           tcp_options[i++]= 0x04;
-//           tcp_options[i++]= 0x02;
-
-
-
-           uint8_t tcp_length = 20;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-           //udp->length = htons(8 + udpSize);
-           // copy data
-        //   copyData = &udp->data;
-          // for (i = 0; i < udpSize; i++)
-            //   copyData[i] = udpData[i];
-           // 32-bit sum over pseudo-header
-           sum = 0;
-                  etherSumWords(ip->sourceIp, 8);
-                  tmp16 = ip->protocol;
-                  sum += (tmp16 & 0xff) << 8;
-                  sum += htons(tcp_length);
-                  //etherSumWords(tcp_length, 2);
-                  // add udp header and data
-                  etherSumWords(tcp, (tcp_length));
-                  tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
-}
-
-void send_mqtt_connect()
-{
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-
-
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
+               if (!etherIsChecksumOffload())
+               {
+                   initChecksum(&csum);
+                          addChecksumData(&csum, ip->sourceIp, 8);
+                          tmp16 = ip->protocol;
+                          addChecksumWord(&csum, (tmp16 & 0xff) << 8);
+                          addChecksumWord(&csum, htons(tcp_length));
+                          //etherSumWords(tcp_length, 2);
+                          // add udp header and data
+                          addChecksumData(&csum, tcp, (tcp_length));
+                          tcp->checksum = getChecksum(&csum);
+               }
 
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
+               // send packet with size = ether + udp hdr + ip header + udp_size
+               etherPutPacket(ether, 14 + htons(ip->length));
+}
 
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
+// Follows the broker connection: logs in once it is up and prints the topics
+// of messages the broker publishes
+void mqttEvent(uint8_t connection, uint8_t event, const uint8_t data[], uint16_t size)
+{
+    uint16_t i = 1, topicLength;
 
+    if (event == TCP_EVENT_CONNECTED)
+        send_mqtt_connect();
+    else if (event == TCP_EVENT_DATA && size > 0 && (data[0] & 0xF0) == 0x30)
+    {
+        // skip the remaining length, 7 bits to a byte with the top bit set on all but the last
+        while (i < size && i < 5 && (data[i] & 0x80) != 0)
+            i++;
+        if (i + 2 >= size)
+            return;
+        i++;
+        topicLength = (data[i] << 8) | data[i + 1];
+        for (i += 2; topicLength > 0 && i < size; topicLength--)
+            putcUart0(data[i++]);
+        putsUart0("\n\r");
+        putsUart0("\n\r");
+    }
+    else if (event == TCP_EVENT_CLOSED)
+    {
+        tcpClose(connection);
+        mqttConnection = TCP_NONE;
+    }
+    else if (event == TCP_EVENT_ABORTED)
+        mqttConnection = TCP_NONE;
+}
 
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
+// Sends the mqtt message in buffer on the broker connection and frees the buffer
+void mqttSendBuffer(packetBuffer* buffer)
+{
+    etherSpan span;
+    span.data = buffer->data;
+    span.size = buffer->size;
+    tcpSendSpans(mqttConnection, &span, 1);
+    freePacketBuffer(buffer);
+}
 
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
+// Opens the broker connection; the mqtt connect message goes out once it is up
+void send_syn()
+{
+    if (mqttConnection != TCP_NONE)
+        tcpAbort(mqttConnection);
+    mqttConnection = tcpOpen(brokerIp, MQTT_BROKER_PORT, mqttEvent);
+}
 
+void send_mqtt_connect()
+{
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
 
-           MQTTFrame *mqtt = (MQTTFrame*)&tcp->options;
+           MQTTFrame *mqtt = (MQTTFrame*)appendPacketBuffer(buffer, sizeof(MQTTFrame));
 
            mqtt->msgtype=0x10;
            //mqtt->msglength= 23;
@@ -3042,106 +5035,18 @@ void send_mqtt_connect()
 
            mqtt->msglength= 18;
 
-           uint8_t tcp_length = 20+18+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+           trimPacketBuffer(buffer, mqtt->msglength + 2);
+           mqttSendBuffer(buffer);
 }
 
 
 void send_mqtt_subreq(char topic[topic_length],uint16_t topic_length)
 {
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
 
-
-           id++;
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(id++);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
-
-
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
-
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-
-
-           MQTTSubFrame *mqtt = (MQTTSubFrame*)&tcp->options;
+           MQTTSubFrame *mqtt = (MQTTSubFrame*)appendPacketBuffer(buffer, sizeof(MQTTSubFrame));
 
            //char topic_name[12] = "device1/test";
            uint8_t i=0;
@@ -3204,274 +5109,49 @@ void send_mqtt_subreq(char topic[topic_length],uint16_t topic_length)
 
            mqtt->msglength= 5 + topic_length;
 
-           uint8_t tcp_length = 20+mqtt->msglength+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+           trimPacketBuffer(buffer, mqtt->msglength + 2);
+           mqttSendBuffer(buffer);
 }
 
 void send_mqtt_pubmsg(char topic[topic_length],char data[d_length],uint16_t topic_length,uint16_t d_length)
 {
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-
-
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
-
-
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
-
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-
-
-           MQTTPubFrame *mqtt = (MQTTPubFrame*)&tcp->options;
-
-           //char topic_name[12] = "device1/test";
-           uint8_t i=0;
-
-           mqtt->msgtype=0x30;
-//           uint8_t *mqtt_data = &tcp->options;
-//           uint8_t topic_len;
-//           topic_len = mqtt_data[1];
-
-           //uint8_t mqtt->msglength = 1;
-         //  mqtt->msgid=htons(0x0001);
-           mqtt->topiclength=htons(topic_length);
-           //mqtt->topicname="";
-//          for(i=0;i<12;i++)
-//          {
-//              mqtt->topicname[i]=topic_name[i];
-//          }
-           for(i=0;i<topic_length;i++)
-           {
-               mqtt->topicname[i]=topic[i];
-           }
-           uint8_t j=0;
-
-           for(i=topic_length;i<(topic_length+d_length);i++)
-           {
-               mqtt->topicname[i]=data[j];
-               j++;
-           }
-
-           for(i=topic_length+d_length;i<40;i++)
-           {
-               mqtt->topicname[i]='\0';
-           }
-
-
-
-//           for(i=0;i<(d_length);i++)
-//           {
-//               mqtt->data[i]=data[i];
-//
-//
-//           }
-////
-//           for(i=d_length;i<20;i++)
-//           {
-//               mqtt->data[i]='\0';
-//           }
-
-           mqtt->req_qos=htons(0);
-           //mqtt->msglength= 23;
-           //mqtt->protocol_length=htons(0x04);
-
-          // uint8_t *mqtt_p_name = (uint8_t*)&mqtt->protocol_name;
-
-          // char msg[5]="Hello";
-
-//           for(i=0;i<d_length;i++)
-//           {
-//               mqtt->data[i]=data[i];
-//           }
-
-          // mqtt->data[d_length]=0;
-
-//           for(i=d_length;i<20;i++)
-//           {
-//               mqtt->data[i]=0;
-//           }
-
-           mqtt->msglength= 4 + 20 + 20;
-
-           uint8_t tcp_length = 20+mqtt->msglength+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+    etherSpan spans[3];
+    uint32_t remaining = 2 + (uint32_t)topic_length + d_length;
+    uint8_t header[7];
+    uint8_t size = 0;
+
+    // only the fixed header and topic length are built here; the topic and
+    // message stream out from where they are, in as many segments as they need
+    header[size++] = 0x30;
+    // remaining length is sent 7 bits at a time, low bits first
+    do
+    {
+        header[size] = remaining & 0x7F;
+        remaining >>= 7;
+        if (remaining > 0)
+            header[size] |= 0x80;
+        size++;
+    }
+    while (remaining > 0);
+    header[size++] = topic_length >> 8;
+    header[size++] = topic_length & 0xFF;
+
+    spans[0].data = header;
+    spans[0].size = size;
+    spans[1].data = (uint8_t*)topic;
+    spans[1].size = topic_length;
+    spans[2].data = (uint8_t*)data;
+    spans[2].size = d_length;
+    tcpSendSpans(mqttConnection, spans, 3);
 }
 
 void send_mqtt_ping()
 {
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-
-
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
 
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
-
-
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
-
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-
-
-           MQTTPingFrame *mqtt = (MQTTPingFrame*)&tcp->options;
+           MQTTPingFrame *mqtt = (MQTTPingFrame*)appendPacketBuffer(buffer, sizeof(MQTTPingFrame));
 
 //           char topic_name[12] = "device1/test";
   //         uint8_t i=0;
@@ -3487,105 +5167,17 @@ void send_mqtt_ping()
 
            mqtt->msglength= 0;
 
-           uint8_t tcp_length = 20+mqtt->msglength+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+           trimPacketBuffer(buffer, mqtt->msglength + 2);
+           mqttSendBuffer(buffer);
 }
 
 void send_mqtt_disconnect()
 {
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-
-
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
-
-
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
-
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
 
-
-           MQTTPingFrame *mqtt = (MQTTPingFrame*)&tcp->options;
+           MQTTPingFrame *mqtt = (MQTTPingFrame*)appendPacketBuffer(buffer, sizeof(MQTTPingFrame));
 
 //           char topic_name[6] = "nikita";
   //         uint8_t i=0;
@@ -3601,105 +5193,17 @@ void send_mqtt_disconnect()
 
            mqtt->msglength= 0;
 
-           uint8_t tcp_length = 20+mqtt->msglength+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+           trimPacketBuffer(buffer, mqtt->msglength + 2);
+           mqttSendBuffer(buffer);
 }
 
 void send_mqtt_unsub(char topic[topic_length],uint16_t topic_length)
 {
-           uint8_t blah[1522];
-           etherFrame* ether = (etherFrame*)blah;
-
-           ipFrame* ip = (ipFrame*)&ether->data;
-           ip->revSize=0x45;
-           tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-
-
+    packetBuffer* buffer = allocPacketBuffer();
+    if (buffer == NULL)
+        return;
 
-
-           // uint8_t tcp_length = htons(ip->length) - ((ip->revSize & 0xF) * 4);
-          //uint8_t tcp_data_length = tcp_length - 20 ;
-
-               uint8_t *copyData;
-               uint8_t tmp8;
-               uint16_t tmp16,tmps;
-
-                 ether->sourceAddress[0]=0x02;
-                 ether->sourceAddress[1]=0x03;
-                 ether->sourceAddress[2]=0x04;
-                 ether->sourceAddress[3]=0x05;
-                 ether->sourceAddress[4]=0x06;
-                 ether->sourceAddress[5]=0x76;
-
-                 ether->destAddress[0]=0x00;
-                 ether->destAddress[1]=0x0E;
-                 ether->destAddress[2]=0xC6;
-                 ether->destAddress[3]=0x55;
-                 ether->destAddress[4]=0x72;
-                 ether->destAddress[5]=0xAC;
-
-                 ether->frameType =  htons(0x0800);
-
-                 ip->sourceIp[0]=192;
-                 ip->sourceIp[1]=168;
-                 ip->sourceIp[2]=1;
-                 ip->sourceIp[3]=118;
-
-                 ip->destIp[0]=192;
-                 ip->destIp[1]=168;
-                 ip->destIp[2]=1;
-                 ip->destIp[3]=198;
-
-
-                 ip->typeOfService = 0x00;
-                 ip->id = htons(0x0000);
-                 ip->flagsAndOffset =htons(0x0000);
-                 ip->ttl=0xff;
-                 ip->protocol= 0x06;
-                 ip->headerChecksum =0x0000;
-
-           // swap source and destination fields
-
-           // set source port of resp will be dest port of req
-           // dest port of resp will be left at source port of req
-           // unusual nomenclature, but this allows a different tx
-           // and rx port on other machine
-           //tmps = tcp->srcport;
-           tcp->srcport = htons(0x8963);
-           tcp->destport = htons(1883);
-
-           tcp->data_offset = htons(0x5018);
-          // uint32_t temp_seq = tcp->seq_no;
-
-
-           tcp->seq_no = g_sekno;
-           tcp->ack_no = g_ackno;
-
-           tcp->checksum = 0x00;
-           tcp->urgent_pointer = 0x00;
-           tcp->win_size = 0xffff;
-
-
-           MQTTUnSubFrame *mqtt = (MQTTUnSubFrame*)&tcp->options;
+           MQTTUnSubFrame *mqtt = (MQTTUnSubFrame*)appendPacketBuffer(buffer, sizeof(MQTTUnSubFrame));
 
            //char topic_name[6] = "nikita";
            uint8_t i=0;
@@ -3748,27 +5252,8 @@ void send_mqtt_unsub(char topic[topic_length],uint16_t topic_length)
 
            mqtt->msglength= 4+topic_length;
 
-           uint8_t tcp_length = 20+mqtt->msglength+2;
-           // adjust lengths
-           ip->length = htons(20 + tcp_length);
-           // 32-bit sum over ip header
-           sum = 0;
-           etherSumWords(&ip->revSize, 20);
-           //etherSumWords(ip->sourceIp, ((ip->revSize & 0xF) * 4) - 12);
-           ip->headerChecksum = getEtherChecksum();
-
-           sum = 0;
-           etherSumWords(ip->sourceIp, 8);
-           tmp16 = ip->protocol;
-           sum += (tmp16 & 0xff) << 8;
-           sum += htons(tcp_length);
-           //etherSumWords(tcp_length, 2);
-           // add udp header and data
-           etherSumWords(tcp, (tcp_length));
-           tcp->checksum = getEtherChecksum();
-
-           // send packet with size = ether + udp hdr + ip header + udp_size
-           etherPutPacket(ether, 14 + htons(ip->length));
+           trimPacketBuffer(buffer, mqtt->msglength + 2);
+           mqttSendBuffer(buffer);
 }
 uint16_t etherGetId()
 {
@@ -3784,11 +5269,14 @@ void etherIncId()
 void etherEnableDhcpMode()
 {
     dhcpEnabled = true;
+    etherUpdateFilter();
 }
 
 void etherDisableDhcpMode()
 {
     dhcpEnabled = false;
+    dhcpPending = false;
+    etherUpdateFilter();
 }
 
 bool etherIsDhcpEnabled()
@@ -3808,6 +5296,8 @@ void etherSetIpAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
     ipAddress[1] = ip1;
     ipAddress[2] = ip2;
     ipAddress[3] = ip3;
+    etherUpdateFilter();
+    etherInvalidateRoutes();
 }
 
 // Gets IP address
@@ -3839,6 +5329,7 @@ void etherSetIpSubnetMask(uint8_t mask0, uint8_t mask1, uint8_t mask2, uint8_t m
     ipSubnetMask[1] = mask1;
     ipSubnetMask[2] = mask2;
     ipSubnetMask[3] = mask3;
+    etherInvalidateRoutes();
 }
 
 // Gets IP subnet mask
@@ -3856,6 +5347,7 @@ void etherSetIpGatewayAddress(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3
     ipGwAddress[1] = ip1;
     ipGwAddress[2] = ip2;
     ipGwAddress[3] = ip3;
+    etherInvalidateRoutes();
 }
 
 void etherSet_g_DNS(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3)
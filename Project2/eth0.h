@@ -16,7 +16,7 @@
 //   SCLK (SSI0Clk) on PA2
 //   ~CS (SW controlled) on PA3
 //   WOL on PB3
-//   INT on PC6
+//   INT on PC6 (falling edge, etherIntIsr in the GPIO Port C vector)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -27,6 +27,10 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "pool.h"
+
+#define IP_ADD_LENGTH 4
+#define HW_ADD_LENGTH 6
 
 #define ETHER_UNICAST        0x80
 #define ETHER_BROADCAST      0x01
@@ -39,12 +43,132 @@
 #define ETHER_HALFDUPLEX     0x00
 #define ETHER_FULLDUPLEX     0x100
 
+#define ETHER_UDMA           0x200
+#define ETHER_INTERRUPT      0x400
+#define ETHER_EARLYDROP      0x800
+#define ETHER_CSUMOFFLOAD    0x1000  // saves cpu time, but pauses reception for every sum (errata)
+#define ETHER_AUTOFILTER     0x2000
+#define ETHER_ADAPTIVEMEM    0x4000
+
+// Buffer memory profiles
+#define ETHER_MEM_RXHEAVY       0
+#define ETHER_MEM_BALANCED      1
+#define ETHER_MEM_TXHEAVY       2
+#define ETHER_MEM_PROFILES      3
+
+// Receive filter manager states
+#define ETHER_FILTER_FIXED      0
+#define ETHER_FILTER_UNICAST    1
+#define ETHER_FILTER_ARP        2
+#define ETHER_FILTER_DHCP       3
+#define ETHER_FILTER_BROADCAST  4
+#define ETHER_FILTER_STATES     5
+
+// Packet classes, used to pick a handler for a classified frame
+#define ETHER_CLASS_OTHER       0
+#define ETHER_CLASS_ARP         1
+#define ETHER_CLASS_ICMP        2
+#define ETHER_CLASS_TCP         3
+#define ETHER_CLASS_UDP         4
+#define ETHER_CLASS_DHCP        5
+#define ETHER_CLASSES           6
+
+// Packet descriptor flags
+#define ETHER_PKT_ARP_REQUEST   0x01    // arp request for this ip
+#define ETHER_PKT_IP            0x02    // ipv4 with a good header checksum
+#define ETHER_PKT_UNICAST       0x04    // sent to this ip
+#define ETHER_PKT_BROADCAST     0x08    // sent to 255.255.255.255
+#define ETHER_PKT_L4_OK         0x10    // good tcp or udp checksum
+#define ETHER_PKT_PING_REQUEST  0x20    // icmp echo request
+
 #define LOBYTE(x) ((x) & 0xFF)
 #define HIBYTE(x) (((x) >> 8) & 0xFF)
 
 uint16_t topic_length;
 uint8_t d_length;
 
+typedef void (*_etherCallback)(uint16_t size);
+typedef void (*_etherHandler)(uint8_t packet[], uint16_t size);
+
+#define ETHER_DRAIN_BUCKETS 5
+
+typedef struct _etherSpiStats
+{
+    uint32_t transactions;
+    uint32_t bankSwitches;
+    uint32_t bankSkips;
+    uint32_t cachedWrites;
+    uint32_t rxFrames;
+    uint32_t rxTransactions;
+    uint32_t txFrames;
+    uint32_t txTransactions;
+} etherSpiStats;
+
+typedef struct _etherTxStats
+{
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t aborted;
+    uint32_t collisions;
+    uint32_t lateCollisions;
+    uint32_t excessCollisions;
+    uint32_t underruns;
+    uint32_t bytesOnWire;
+    uint32_t full;
+    uint32_t fragmented;        // datagrams larger than the path mtu
+    uint32_t fragments;         // frames they were sent as
+    uint32_t pmtuUpdates;       // path mtus lowered by icmp fragmentation needed
+    uint8_t maxDepth;
+} etherTxStats;
+
+typedef struct _etherRxStats
+{
+    uint32_t frames;
+    uint32_t dropped;
+    uint32_t errors;            // frames the mac flagged as bad (crc, length)
+    uint32_t bytesSaved;
+    uint32_t badChecksum;
+    uint32_t filterChanges;
+    uint32_t overflows;
+    uint32_t repartitions;
+    uint32_t drainCalls;
+    uint32_t drainFrames;
+    uint32_t drainBudgetHits;
+    uint32_t drainBatches[ETHER_DRAIN_BUCKETS];
+    uint8_t drainMax;
+    uint32_t delivered[ETHER_FILTER_STATES];
+    uint32_t unwanted[ETHER_FILTER_STATES];
+} etherRxStats;
+
+// Result of parsing a received frame once
+// Offsets are from the start of the frame; ports are in host order
+typedef struct _etherPacket
+{
+    uint8_t* frame;
+    uint16_t size;
+    uint16_t frameType;
+    uint16_t l3Offset;
+    uint16_t l4Offset;
+    uint16_t payloadOffset;
+    uint16_t payloadSize;
+    uint16_t sourcePort;
+    uint16_t destPort;
+    uint16_t tcpFlags;          // data offset and flags word, as stored in the frame
+    uint8_t protocol;
+    uint8_t packetClass;
+    uint8_t flags;
+} etherPacket;
+
+typedef void (*_etherPacketHandler)(etherPacket* packet);
+
+// Part of a frame to transmit, e.g. the headers, a topic, or a payload
+#define ETHER_MAX_SPANS 4
+typedef struct _etherSpan
+{
+    const uint8_t* data;
+    uint16_t size;
+} etherSpan;
+
 typedef struct _enc28j60Frame // 4-bytes
 {
     uint16_t size;
@@ -123,6 +247,43 @@ typedef struct _tcpFrame
 
 }tcpFrame;
 
+// Cached next hop and mac for one destination
+// The result stands while generation matches the global one, which changes
+// whenever the address, mask, gateway, or an arp entry does
+typedef struct _etherRoute
+{
+    uint8_t destIp[4];
+    uint8_t nextHop[4];
+    uint8_t mac[6];
+    uint32_t generation;
+} etherRoute;
+
+// Path mtus learned from icmp fragmentation needed messages (rfc 1191)
+// Entries age out so a larger mtu is tried again once the path may have changed
+#define ETHER_MTU           1500
+#define ETHER_MIN_MTU       68
+#define ETHER_PMTU_ENTRIES  4
+#define ETHER_PMTU_TTL      600         // seconds
+typedef struct _etherPathMtu
+{
+    uint8_t ip[4];
+    uint16_t mtu;
+    uint16_t ttl;               // 0 if the entry is unused
+} etherPathMtu;
+
+// Prebuilt ethernet, ip, and tcp headers for one connection
+// ipSum and tcpSum are the folded sums of the fields that stay the same
+#define ETHER_TCP_HEADERS 54
+typedef struct _etherTcpTemplate
+{
+    uint8_t header[ETHER_TCP_HEADERS];
+    uint16_t ipSum;
+    uint16_t tcpSum;
+    uint16_t id;
+    etherRoute route;
+    bool valid;
+} etherTcpTemplate;
+
 typedef struct _tcpMQTTFrame
 {
     uint16_t srcport;
@@ -208,11 +369,74 @@ bool etherIsLinkUp();
 
 bool etherIsDataAvailable();
 bool etherIsOverflow();
+void etherIntIsr();
 uint16_t etherGetPacket(uint8_t packet[], uint16_t maxSize);
+bool etherGetPacketAsync(uint8_t packet[], uint16_t maxSize, _etherCallback callback);
+bool etherIsRxBusy();
+bool etherIsDmaMode();
+uint8_t etherGetPacketCount();
+uint8_t etherDrainPackets(uint8_t packet[], uint16_t maxSize, _etherHandler handler, uint8_t budget);
 bool etherPutPacket(uint8_t packet[], uint16_t size);
+uint16_t etherQueuePacket(uint8_t packet[], uint16_t size);
+uint16_t etherQueueSpans(const etherSpan spans[], uint8_t count);
+bool etherPutSpans(const etherSpan spans[], uint8_t count);
+bool etherIsTxDone(uint16_t seq);
+uint8_t etherGetTxQueueDepth();
+void etherGetTxStats(etherTxStats* stats);
+void etherGetRxStats(etherRxStats* stats);
+void etherGetSpiStats(etherSpiStats* stats);
+void etherBenchmarkSpi(uint8_t buffer[]);
+bool etherIsChecksumOffload();
+uint8_t etherGetFilterState();
+bool etherSetMemoryProfile(uint8_t profile);
+uint8_t etherGetMemoryProfile();
+uint16_t etherGetRxRingSize();
+void etherSetMemoryAdaptive(bool enable);
+bool etherIsMemoryAdaptive();
+void etherAdaptMemoryMap();
+bool etherJoinMulticastGroup(uint8_t ip[4]);
+void etherLeaveMulticastGroup(uint8_t ip[4]);
+bool etherTestChecksum(uint8_t buffer[]);
+uint8_t etherClassifyPacket(uint8_t packet[], uint16_t size, etherPacket* info);
+void etherBenchmarkClassifier(uint8_t buffer[]);
+void etherBenchmarkTemplate();
+tcpFrame* etherPrependTcp(packetBuffer* buffer, uint16_t sourcePort, uint16_t destPort,
+                          uint32_t seq, uint32_t ack, uint16_t offsetAndFlags, uint16_t window);
+udpFrame* etherPrependUdp(packetBuffer* buffer, uint16_t sourcePort, uint16_t destPort);
+ipFrame* etherPrependIp(packetBuffer* buffer, uint8_t protocol, const uint8_t sourceIp[], const uint8_t destIp[]);
+ipFrame* etherPrependIpHeader(packetBuffer* buffer, uint8_t protocol, const uint8_t sourceIp[],
+                              const uint8_t destIp[], uint16_t l4Size);
+etherFrame* etherPrependEther(packetBuffer* buffer, const uint8_t destAddress[], uint16_t frameType);
+bool etherSendBuffer(packetBuffer* buffer);
+void etherInvalidateRoutes();
+bool etherIsOnLink(const uint8_t ip[]);
+bool etherIsBroadcastIp(const uint8_t ip[]);
+void etherGetNextHop(const uint8_t ip[], uint8_t nextHop[]);
+void etherInitRoute(etherRoute* route, const uint8_t destIp[]);
+bool etherResolveRoute(etherRoute* route, uint8_t mac[]);
+bool etherSendRouted(packetBuffer* buffer, etherRoute* route);
+uint16_t etherGetPathMtu(const uint8_t destIp[]);
+void etherUpdatePathMtu(const uint8_t destIp[], uint16_t mtu);
+void etherPathMtuTick();
+void etherHandleIcmpError(uint8_t packet[]);
+uint8_t etherSliceSpans(const etherSpan spans[], uint8_t count, uint16_t offset, uint16_t size, etherSpan out[]);
+bool etherPutIpSpans(const uint8_t destMac[], const uint8_t destIp[], uint8_t protocol,
+                     const etherSpan data[], uint8_t count);
+bool etherSendUdpSpans(etherRoute* route, uint16_t sourcePort, uint16_t destPort,
+                       const etherSpan data[], uint8_t count);
+bool etherTestFragmentation();
+bool etherTestRouting();
+void etherInitTcpTemplate(etherTcpTemplate* t, const uint8_t destIp[], uint16_t sourcePort, uint16_t destPort);
+tcpFrame* etherPrependTcpTemplate(packetBuffer* buffer, etherTcpTemplate* t, uint32_t seq, uint32_t ack,
+                                  uint16_t offsetAndFlags, uint16_t window, uint16_t spanSize);
+bool etherSendTcp(etherTcpTemplate* t, packetBuffer* buffer, uint32_t seq, uint32_t ack, uint16_t offsetAndFlags,
+                  uint16_t window);
+void etherBenchmarkTcp(uint8_t buffer[]);
 
 bool etherIsIp(uint8_t packet[]);
+bool etherIsIpFragment(uint8_t packet[], uint16_t size);
 bool etherIsIpUnicast(uint8_t packet[]);
+void etherCalcIpChecksum(ipFrame* ip);
 
 bool etherIsPingRequest(uint8_t packet[]);
 void etherSendPingResponse(uint8_t packet[]);
@@ -223,7 +447,7 @@ void etherSendArpRequest(uint8_t packet[], uint8_t ip[]);
 
 bool etherIsUdp(uint8_t packet[]);
 uint8_t* etherGetUdpData(uint8_t packet[]);
-void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint8_t udpSize);
+void etherSendUdpResponse(uint8_t packet[], uint8_t* udpData, uint16_t udpSize);
 
 void etherSendDiscoverMessage();
 void etherSendDHCPRequest();
@@ -267,14 +491,13 @@ void send_mqtt_subreq(char topic[topic_length],uint16_t topic_length);
 void send_mqtt_pubmsg(char topic[topic_length],char data[d_length],uint16_t topic_length,uint16_t d_length);
 void send_mqtt_ping();
 void send_mqtt_disconnect();
-void send_mqtt_finack(uint32_t tcp_ack, uint32_t tcp_seq);
 void send_mqtt_unsub(char topic[topic_length],uint16_t topic_length);
 uint16_t get_mqtt_tcp_flag(uint8_t packet[]);
-void send_mqtt_ack(uint32_t tcp_ack, uint32_t tcp_seq);
 uint32_t get_ip_lease_time();
 void etherSet_g_DNS(uint8_t ip0, uint8_t ip1, uint8_t ip2, uint8_t ip3);
 void etherGetdnsAddress(uint8_t ip[4]);
 uint8_t get_topic_length();
 #define ntohs htons
+#define ntohl htonl
 
 #endif
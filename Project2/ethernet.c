@@ -16,7 +16,7 @@
 //   SCLK (SSI0Clk) on PA2
 //   ~CS (SW controlled) on PA3
 //   WOL on PB3
-//   INT on PC6
+//   INT on PC6 (falling edge, etherIntIsr in the GPIO Port C vector)
 
 // Pinning for IoT projects with wireless modules:
 // N24L01+ RF transceiver
@@ -39,6 +39,10 @@
 #include <string.h>
 #include "tm4c123gh6pm.h"
 #include "eth0.h"
+#include "checksum.h"
+#include "arp.h"
+#include "tcp.h"
+#include "reassembly.h"
 #include "gpio.h"
 #include "spi0.h"
 #include "uart0.h"
@@ -57,6 +61,13 @@
 
 #define MAX_CHARS 100
 
+// EEPROM word selecting polled or uDMA buffer transfers (erased = polled)
+#define EEPROM_SPI_MODE 18
+#define SPI_MODE_UDMA   1
+
+// Pattern written over the unused stack at reset to find the deepest use
+#define STACK_PAINT 0xC5C5C5C5
+
 
 uint8_t f_dhcp=2;
 uint8_t f_discover =2;
@@ -82,6 +93,8 @@ bool istime =0;
 char topics[10][20]={'\0'};
 uint8_t topic_count;
 int periodic_time_value;
+// Most packets handled per main loop pass before the shell gets a turn
+uint8_t rxBudget = 8;
 #define AIN3_MASK 1
 struct stringStuff
 {
@@ -112,6 +125,10 @@ struct stringStuff
 struct Time set_time = {0,0,0,0};
 struct Date set_date = {0,0,0};
 
+// Stack limits from the linker
+extern uint32_t __stack;
+extern uint32_t __STACK_END;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -162,6 +179,25 @@ int16_t readAdc0Ss3()
     return ADC0_SSFIFO3_R;                           // get single result from the FIFO
 }
 
+// Paints the stack below the current frame so getStackUsed can find the high-water mark
+void paintStack()
+{
+    uint32_t top;
+    uint32_t* p = &__stack;
+    // stop short of this frame
+    while (p < &top - 8)
+        *p++ = STACK_PAINT;
+}
+
+// Returns the deepest stack use since paintStack in bytes
+uint16_t getStackUsed()
+{
+    uint32_t* p = &__stack;
+    while (p < &__STACK_END && *p == STACK_PAINT)
+        p++;
+    return (uint8_t*)&__STACK_END - (uint8_t*)p;
+}
+
 void EnableSleepClocking()
 {
     SYSCTL_SCGC0_R |=SYSCTL_SCGC0_HIB;
@@ -233,6 +269,202 @@ void displayConnectionInfo()
         putsUart0("Link is down\n");
 }
 
+void displayEtherStats()
+{
+    const char* filterNames[] = {"fixed", "unicast", "arp", "dhcp", "broadcast"};
+    const char* memNames[] = {"rx-heavy", "balanced", "tx-heavy"};
+    uint8_t i;
+    char str[60];
+    etherTxStats tx;
+    etherRxStats rx;
+    etherSpiStats spi;
+    packetPoolStats pool;
+    reassemblyStats reasm;
+    etherGetRxStats(&rx);
+    sprintf(str, "RX: %lu frames, %lu dropped early\r\n",
+            (unsigned long)rx.frames, (unsigned long)rx.dropped);
+    putsUart0(str);
+    sprintf(str, "RX: %lu frames with receive errors\r\n", (unsigned long)rx.errors);
+    putsUart0(str);
+    sprintf(str, "RX: %lu spi bytes saved by drops\r\n", (unsigned long)rx.bytesSaved);
+    putsUart0(str);
+    sprintf(str, "RX: %lu bad checksums caught in buffer memory\r\n", (unsigned long)rx.badChecksum);
+    putsUart0(str);
+    sprintf(str, "Drain: %lu calls, %lu packets, max %u, %lu at budget %u\r\n",
+            (unsigned long)rx.drainCalls, (unsigned long)rx.drainFrames, rx.drainMax,
+            (unsigned long)rx.drainBudgetHits, rxBudget);
+    putsUart0(str);
+    sprintf(str, "  batch 1:%lu 2:%lu 3-4:%lu 5-8:%lu 9+:%lu\r\n",
+            (unsigned long)rx.drainBatches[0], (unsigned long)rx.drainBatches[1],
+            (unsigned long)rx.drainBatches[2], (unsigned long)rx.drainBatches[3],
+            (unsigned long)rx.drainBatches[4]);
+    putsUart0(str);
+    etherGetSpiStats(&spi);
+    sprintf(str, "SPI: %lu transactions, %lu bank switches\r\n",
+            (unsigned long)spi.transactions, (unsigned long)spi.bankSwitches);
+    putsUart0(str);
+    sprintf(str, "SPI: %lu bank selects and %lu writes skipped\r\n",
+            (unsigned long)spi.bankSkips, (unsigned long)spi.cachedWrites);
+    putsUart0(str);
+    if (spi.rxFrames > 0)
+    {
+        sprintf(str, "SPI: %lu.%02lu transactions per rx frame\r\n",
+                (unsigned long)(spi.rxTransactions / spi.rxFrames),
+                (unsigned long)(spi.rxTransactions * 100 / spi.rxFrames % 100));
+        putsUart0(str);
+    }
+    if (spi.txFrames > 0)
+    {
+        sprintf(str, "SPI: %lu.%02lu transactions per tx frame\r\n",
+                (unsigned long)(spi.txTransactions / spi.txFrames),
+                (unsigned long)(spi.txTransactions * 100 / spi.txFrames % 100));
+        putsUart0(str);
+    }
+    sprintf(str, "Memory: %s%s, %lu repartitions, %lu overflows\r\n",
+            memNames[etherGetMemoryProfile()], etherIsMemoryAdaptive() ? " (auto)" : "",
+            (unsigned long)rx.repartitions, (unsigned long)rx.overflows);
+    putsUart0(str);
+    // frames the filter rejects never reach the mcu, so only what passed is counted
+    sprintf(str, "Filter: %s, %lu changes\r\n", filterNames[etherGetFilterState()],
+            (unsigned long)rx.filterChanges);
+    putsUart0(str);
+    for (i = 0; i < ETHER_FILTER_STATES; i++)
+    {
+        sprintf(str, "  %-9s %lu delivered, %lu unwanted\r\n", filterNames[i],
+                (unsigned long)rx.delivered[i], (unsigned long)rx.unwanted[i]);
+        putsUart0(str);
+    }
+    etherGetTxStats(&tx);
+    sprintf(str, "TX: %lu queued, %lu sent, %lu aborted\r\n",
+            (unsigned long)tx.queued, (unsigned long)tx.sent, (unsigned long)tx.aborted);
+    putsUart0(str);
+    sprintf(str, "TX: %lu collisions, %lu late, %lu excessive\r\n",
+            (unsigned long)tx.collisions, (unsigned long)tx.lateCollisions,
+            (unsigned long)tx.excessCollisions);
+    putsUart0(str);
+    sprintf(str, "TX: %lu underruns, %lu bytes on wire\r\n",
+            (unsigned long)tx.underruns, (unsigned long)tx.bytesOnWire);
+    putsUart0(str);
+    sprintf(str, "TX: depth %u, max %u, %lu waits for space\r\n",
+            etherGetTxQueueDepth(), tx.maxDepth, (unsigned long)tx.full);
+    putsUart0(str);
+    sprintf(str, "TX: %lu datagrams sent as %lu fragments\r\n",
+            (unsigned long)tx.fragmented, (unsigned long)tx.fragments);
+    putsUart0(str);
+    sprintf(str, "TX: %lu path mtus lowered\r\n", (unsigned long)tx.pmtuUpdates);
+    putsUart0(str);
+    getPacketPoolStats(&pool);
+    sprintf(str, "Pool: %u of %u in use, max %u\r\n", pool.inUse, PACKET_BUFFERS, pool.highWater);
+    putsUart0(str);
+    sprintf(str, "Pool: %lu allocs, %lu failures\r\n",
+            (unsigned long)pool.allocs, (unsigned long)pool.failures);
+    putsUart0(str);
+    getReassemblyStats(&reasm);
+    sprintf(str, "Reassembly: %lu fragments, %lu datagrams\r\n",
+            (unsigned long)reasm.fragments, (unsigned long)reasm.datagrams);
+    putsUart0(str);
+    sprintf(str, "Reassembly: %lu timeouts, %lu evictions\r\n",
+            (unsigned long)reasm.timeouts, (unsigned long)reasm.evictions);
+    putsUart0(str);
+    sprintf(str, "Reassembly: %lu overlaps, %lu dropped\r\n",
+            (unsigned long)reasm.overlaps, (unsigned long)reasm.dropped);
+    putsUart0(str);
+    sprintf(str, "Stack: %u of %u bytes used\r\n", getStackUsed(),
+            (uint16_t)((uint8_t*)&__STACK_END - (uint8_t*)&__stack));
+    putsUart0(str);
+}
+
+// Lists the arp cache and its counters
+void displayArpTable()
+{
+    const char* stateNames[] = {"free", "incomplete", "resolved"};
+    arpEntry entry;
+    arpStats stats;
+    uint8_t i, count = 0;
+    char str[80];
+
+    for (i = 0; i < ARP_ENTRIES; i++)
+    {
+        if (getArpEntry(i, &entry))
+        {
+            sprintf(str, "%u.%u.%u.%u  %02x:%02x:%02x:%02x:%02x:%02x  %-10s %3us  %u queued\r\n",
+                    entry.ip[0], entry.ip[1], entry.ip[2], entry.ip[3],
+                    entry.mac[0], entry.mac[1], entry.mac[2], entry.mac[3], entry.mac[4], entry.mac[5],
+                    stateNames[entry.state], entry.ttl, entry.queued);
+            putsUart0(str);
+            count++;
+        }
+    }
+    sprintf(str, "%u of %u entries used\r\n", count, ARP_ENTRIES);
+    putsUart0(str);
+    getArpStats(&stats);
+    sprintf(str, "ARP: %lu hits, %lu misses, %lu requests\r\n",
+            (unsigned long)stats.hits, (unsigned long)stats.misses, (unsigned long)stats.requests);
+    putsUart0(str);
+    sprintf(str, "ARP: %lu learned, %lu expired, %lu failed, %lu evicted\r\n",
+            (unsigned long)stats.learned, (unsigned long)stats.expired,
+            (unsigned long)stats.failed, (unsigned long)stats.evicted);
+    putsUart0(str);
+    sprintf(str, "ARP: %lu frames queued, %lu dropped\r\n",
+            (unsigned long)stats.queued, (unsigned long)stats.dropped);
+    putsUart0(str);
+}
+
+// Lists the tcp connections and their counters
+void displayTcpTable()
+{
+    const char* stateNames[] = {"closed", "listen", "syn-sent", "syn-rcvd", "established", "fin-wait-1",
+                                "fin-wait-2", "close-wait", "closing", "last-ack", "time-wait"};
+    tcpConnection c;
+    tcpStats stats;
+    uint8_t i, count = 0;
+    char str[112];
+
+    for (i = 0; i < TCP_CONNECTIONS; i++)
+    {
+        if (getTcpConnection(i, &c))
+        {
+            sprintf(str, "%u  %u -> %u.%u.%u.%u:%u  %s\r\n", i, c.localPort,
+                    c.remoteIp[0], c.remoteIp[1], c.remoteIp[2], c.remoteIp[3], c.remotePort,
+                    stateNames[c.state]);
+            putsUart0(str);
+            sprintf(str, "   snd una %lu nxt %lu max %lu wnd %u  rcv nxt %lu wnd %u held %u/%u\r\n",
+                    (unsigned long)(c.sndUna - c.iss), (unsigned long)(c.sndNxt - c.iss),
+                    (unsigned long)(c.sndMax - c.iss), c.sndWnd, (unsigned long)(c.rcvNxt - c.irs), c.rcvWnd,
+                    c.heldCount, c.heldBytes);
+            putsUart0(str);
+            sprintf(str, "   cwnd %lu ssthresh %lu  %lu acks saved%s\r\n", (unsigned long)c.cwnd,
+                    (unsigned long)c.ssthresh, (unsigned long)c.acksSaved,
+                    (c.flags & TCP_STOP_AND_WAIT) ? "  stop-and-wait" : "");
+            putsUart0(str);
+            sprintf(str, "   srtt %lu ms rttvar %lu ms rto %u ms  %lu retransmits (%lu fast)  %u queued\r\n",
+                    (unsigned long)(c.srtt >> 3), (unsigned long)(c.rttvar >> 2), c.rto,
+                    (unsigned long)c.retransmits, (unsigned long)c.fastRetransmits, c.rtxCount);
+            putsUart0(str);
+            count++;
+        }
+    }
+    sprintf(str, "%u of %u connections used\r\n", count, TCP_CONNECTIONS);
+    putsUart0(str);
+    getTcpStats(&stats);
+    sprintf(str, "TCP: %lu segments in, %lu out, %lu resets sent\r\n",
+            (unsigned long)stats.segmentsIn, (unsigned long)stats.segmentsOut, (unsigned long)stats.resets);
+    putsUart0(str);
+    sprintf(str, "TCP: %lu opened, %lu accepted, %lu refused, %lu dropped\r\n",
+            (unsigned long)stats.opened, (unsigned long)stats.accepted,
+            (unsigned long)stats.full, (unsigned long)stats.dropped);
+    putsUart0(str);
+    sprintf(str, "TCP: %lu retransmits (%lu fast), %lu connections timed out\r\n",
+            (unsigned long)stats.retransmits, (unsigned long)stats.fastRetransmits,
+            (unsigned long)stats.timeouts);
+    putsUart0(str);
+    sprintf(str, "TCP: %lu ack frames saved by delaying or riding on data\r\n", (unsigned long)stats.acksSaved);
+    putsUart0(str);
+    sprintf(str, "TCP: %lu out-of-order segments held, %lu trimmed of old data\r\n",
+            (unsigned long)stats.held, (unsigned long)stats.trimmed);
+    putsUart0(str);
+}
+
 int strlnt(char *str1)
 {
     uint16_t Length = 0;
@@ -631,6 +863,190 @@ bool search_topics(char name[20])
     return 0;
 }
 
+// Handles arp requests for this ip
+void handleArp(etherPacket* packet)
+{
+    arpInput(packet->frame);
+    if ((packet->flags & ETHER_PKT_ARP_REQUEST) != 0)
+    {
+        if(isack == 1)
+        {
+            isarp = 1;
+            isack=0;
+        }
+        etherSendArpResponse(packet->frame);
+    }
+}
+
+// Handles icmp ping requests and fragmentation needed reports to this ip
+void handleIcmp(etherPacket* packet)
+{
+    if ((packet->flags & ETHER_PKT_UNICAST) == 0)
+        return;
+    if ((packet->flags & ETHER_PKT_PING_REQUEST) != 0)
+        etherSendPingResponse(packet->frame);
+    else
+        etherHandleIcmpError(packet->frame);
+}
+
+// Handles tcp segments to this ip; the tcp module passes them to their connection
+void handleTcp(etherPacket* packet)
+{
+    if ((packet->flags & ETHER_PKT_UNICAST) != 0)
+        tcpInput(packet);
+}
+
+// Handles udp datagrams to this ip
+// test this with a udp send utility like sendip
+//   if sender IP (-is) is 192.168.1.198, this will attempt to
+//   send the udp datagram (-d) to 192.168.1.199, port 1024 (-ud)
+// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "on" 192.168.1.199
+// sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "off" 192.168.1.199
+void handleUdp(etherPacket* packet)
+{
+    uint8_t* udpData;
+
+    if ((packet->flags & ETHER_PKT_UNICAST) == 0)
+        return;
+    udpData = packet->frame + packet->payloadOffset;
+
+    if (strcmp((char*)udpData, "on") == 0)
+        setPinValue(GREEN_LED, 1);
+    if (strcmp((char*)udpData, "off") == 0)
+        setPinValue(GREEN_LED, 0);
+    etherSendUdpResponse(packet->frame, (uint8_t*)"Nikita", 9);
+}
+
+// Handles dhcp messages to the client port
+// Acks sent to this ip are renewals, broadcast ones complete discovery
+void handleDhcp(etherPacket* packet)
+{
+    uint8_t* data = packet->frame;
+
+    if ((packet->flags & ETHER_PKT_UNICAST) != 0)
+    {
+        if(etherIsAck(data))
+        {
+            // in renew
+            isack = 1;
+            etherSendGratuitousArpRequest();
+            restartTimer(testip);
+            etherSet_g_IP();
+            set_renewal_flag_true();
+            stopTimer(etherSendDHCPRequest);
+            stopTimer(etherSendDHCPRebind);
+            stopTimer(t1);
+            restartTimer(t1);
+            stopTimer(t2);
+            restartTimer(t2);
+
+            //stopTimer(etherSendDHCPRequest);
+            // startOneshotTimer(t1,30);
+            //restartTimer(t1);
+        }
+    }
+    else
+    {
+        if(etherIsOffer(data))
+        {
+            //stop timer discover
+            stopTimer(discover_flag_check);
+            set_offer_flag_true();
+            etherSetOffer(data);
+            f_offer=1;
+            f_dhcp =0;
+            etherSendDHCPRequest();
+            f_discover =  1;
+
+            f_request=1;
+            //  putsUart0("offer");
+
+            putsUart0("\r\n");
+
+
+        }
+
+        if(etherIsAck(data))
+        {
+            //start one shot timer to test ip (Gratuitios arp for 2 seconds wait for response)
+            f_request =1;
+            f_offer =1;
+            f_discover =1;
+            f_ack =1;
+            etherSetAck(data);
+            isack=1;
+            // startOneshotTimer(flash3, 5);
+            //startOneshotTimer(flash4, 10);
+
+            //uint8_t ip_g[4];
+            // etherGet_g_IpAddress(ip_g);
+
+
+
+            //  etherSendDHCPRebind();
+            //if(f_ack ==1)
+            //{   etherSet_g_IP();
+            //startOneshotTimer(t1, 15);
+            //}
+
+            uint32_t ip_lease_time=get_ip_lease_time();
+
+            //                              char str[100];
+            //                              sprintf(str, "%02x",ip_lease_time);
+            //                              putsUart0("ip_lease_time");
+            //                              putsUart0(str);
+            //                              putsUart0("\r\n");
+
+            uint32_t half_lease_time = 0.5*ip_lease_time;
+            uint32_t t2_lease_time = 87.5*ip_lease_time;
+
+            etherSendGratuitousArpRequest();
+            startOneshotTimer(testip, 2);
+            etherSet_g_IP();
+            stopTimer(t2);
+            startOneshotTimer(t1, 15);
+            startOneshotTimer(t2, 100);
+            startOneshotTimer(discover_flag_check,120);
+
+
+
+
+
+        }
+    }
+}
+
+// Handlers for each packet class
+const _etherPacketHandler packetHandlers[ETHER_CLASSES] =
+{
+    NULL,                       // ETHER_CLASS_OTHER
+    handleArp,
+    handleIcmp,
+    handleTcp,
+    handleUdp,
+    handleDhcp
+};
+
+// Handles one received frame
+// The frame is parsed once and passed to the handler for its class
+// Fragments are held until their datagram is complete, which is then handled as one frame
+void processPacket(uint8_t data[], uint16_t size)
+{
+    etherPacket packet;
+
+    if (etherIsIpFragment(data, size))
+    {
+        data = reassembleFragment(data, &size);
+        if (data == NULL)
+            return;
+    }
+    etherClassifyPacket(data, size, &packet);
+    if ((packet.flags & ETHER_PKT_IP) != 0)
+        arpInputIp(data);
+    if (packetHandlers[packet.packetClass] != NULL)
+        packetHandlers[packet.packetClass](&packet);
+}
+
 //-----------------------------------------------------------------------------
 // Main
 //-----------------------------------------------------------------------------
@@ -641,10 +1057,46 @@ bool search_topics(char name[20])
 
 
 
+// Receive buffers are static so frames do not take up the stack
+// The second lets a frame be parsed while the next streams in
+uint8_t rxData[MAX_PACKET_SIZE];
+uint8_t dmaData[MAX_PACKET_SIZE];
+volatile bool packetReady = false;
+volatile uint16_t packetSize;
+
+// Called when an asynchronous receive completes
+void packetReceived(uint16_t size)
+{
+    packetSize = size;
+    packetReady = true;
+}
+
+// Handles each packet of a receive batch
+void handlePacket(uint8_t packet[], uint16_t size)
+{
+    processPacket(packet, size);
+}
+
+// Once a second work (memory map adaptation, arp, reassembly, path mtu, and tcp timers) runs from the main loop,
+// since it needs the spi bus
+volatile bool secondTick = false;
+
+void secondTimer()
+{
+    secondTick = true;
+}
+
 int main(void)
 {
-    uint8_t* udpData;
-    uint8_t data[MAX_PACKET_SIZE];
+    uint8_t* rxBuffer[2] = {rxData, dmaData};
+    uint8_t rxFill = 0;
+    uint8_t profile;
+    // checksum offload is left off: the dma engine has to pause reception while it
+    // runs (errata), which loses frames that arrive back to back, e.g. tcp bursts
+    uint16_t etherMode = ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX | ETHER_INTERRUPT | ETHER_EARLYDROP
+                       | ETHER_AUTOFILTER | ETHER_ADAPTIVEMEM;
+
+    paintStack();
 
     // Init controller
     initHw();
@@ -653,6 +1105,7 @@ int main(void)
     StartRTCCounting();
     EnableSleepClocking();
     initTimer();
+    initCycleCounter();
     // Setup UART0
     initUart0();
     initEeprom();
@@ -661,7 +1114,12 @@ int main(void)
     // Init ethernet interface (eth0)
     putsUart0("\nStarting eth0\n");
     etherSetMacAddress(2, 3, 4, 5, 6, 118);
-    etherInit(ETHER_UNICAST | ETHER_BROADCAST | ETHER_HALFDUPLEX);
+    if (readEeprom(EEPROM_SPI_MODE) == SPI_MODE_UDMA)
+        etherMode |= ETHER_UDMA;
+    etherInit(etherMode);
+    initArp();
+    initTcp();
+    initReassembly();
 
     etherDisableDhcpMode();
     etherSetIpAddress(192, 168, 1, 118);
@@ -687,6 +1145,7 @@ int main(void)
     //  etherSendDiscoverMessage();
 
     //send_syn();
+    startPeriodicTimer(secondTimer, 1);
     while (true)
     {
 
@@ -1541,6 +2000,79 @@ int main(void)
 
             }
 
+            else if(isCommand("spi",1,string1))
+            {
+                // buffer transfer mode is picked at startup
+                if(strComp(string_test->argument,"dma")==0)
+                    writeEeprom(EEPROM_SPI_MODE,SPI_MODE_UDMA);
+                else if(strComp(string_test->argument,"polled")==0)
+                    writeEeprom(EEPROM_SPI_MODE,0xFFFFFFFF);
+                putsUart0("spi mode takes effect after reboot\r\n");
+            }
+
+            else if(isCommand("budget",1,string1))
+            {
+                // packets per drain before the shell is checked again
+                rxBudget = getValue(0,string1);
+                if (rxBudget == 0)
+                    rxBudget = 1;
+            }
+
+            else if(isCommand("mem",1,string1))
+            {
+                // fixed profile, or auto to follow traffic
+                if(strComp(string_test->argument,"auto")==0)
+                    etherSetMemoryAdaptive(true);
+                else
+                {
+                    etherSetMemoryAdaptive(false);
+                    if(strComp(string_test->argument,"rx")==0)
+                        profile = ETHER_MEM_RXHEAVY;
+                    else if(strComp(string_test->argument,"tx")==0)
+                        profile = ETHER_MEM_TXHEAVY;
+                    else
+                        profile = ETHER_MEM_BALANCED;
+                    if (!etherSetMemoryProfile(profile))
+                        putsUart0("receive ring busy, try again\r\n");
+                }
+            }
+
+            else if(isCommand("bench",1,string1))
+            {
+                // the receive buffer not being filled is free between frames
+                uint8_t* buffer = rxBuffer[rxFill ^ 1];
+                if(strComp(string_test->argument,"spi")==0)
+                    etherBenchmarkSpi(buffer);
+                else if(strComp(string_test->argument,"csum")==0)
+                {
+                    if (etherTestChecksum(buffer))
+                        putsUart0("checksum engine matches software\r\n");
+                    else
+                        putsUart0("checksum engine mismatch\r\n");
+                }
+                else if(strComp(string_test->argument,"sum")==0)
+                {
+                    if (testChecksum(buffer, MAX_PACKET_SIZE))
+                        putsUart0("word sum matches byte sum\r\n");
+                    else
+                        putsUart0("word sum mismatch\r\n");
+                    if (testIncrementalChecksum(buffer, MAX_PACKET_SIZE))
+                        putsUart0("incremental updates match full sums\r\n");
+                    else
+                        putsUart0("incremental update mismatch\r\n");
+                }
+                else if(strComp(string_test->argument,"parse")==0)
+                    etherBenchmarkClassifier(buffer);
+                else if(strComp(string_test->argument,"tmpl")==0)
+                    etherBenchmarkTemplate();
+                else if(strComp(string_test->argument,"route")==0)
+                    etherTestRouting();
+                else if(strComp(string_test->argument,"frag")==0)
+                    etherTestFragmentation();
+                else if(strComp(string_test->argument,"tcp")==0)
+                    etherBenchmarkTcp(buffer);
+            }
+
             else if(isCommand("ifconfig",0,string1))
             {
                 //ifconfig
@@ -1548,6 +2080,20 @@ int main(void)
                 displayConnectionInfo();
             }
 
+            else if(isCommand("stats",0,string1))
+            {
+                displayEtherStats();
+            }
+
+            else if(isCommand("tcp",0,string1))
+            {
+                displayTcpTable();
+            }
+            else if(isCommand("arp",0,string1))
+            {
+                displayArpTable();
+            }
+
 //            else if(isCommand("connect",0,string1))
 //            {
 //                send_mqtt_connect();
@@ -1628,8 +2174,46 @@ int main(void)
 
 
 
+        // timer callbacks, e.g. the dhcp senders
+        processTimers();
+        if (secondTick)
+        {
+            secondTick = false;
+            etherAdaptMemoryMap();
+            arpTick();
+            reassemblyTick();
+            etherPathMtuTick();
+            tcpTick();
+        }
+        tcpPoll();
+
         // Packet processing
-        if (etherIsDataAvailable())
+        if (etherIsDmaMode())
+        {
+            // parse the previous frame while the next one streams into the other buffer
+            uint8_t* frame = NULL;
+            uint16_t size;
+            if (packetReady)
+            {
+                packetReady = false;
+                frame = rxBuffer[rxFill];
+                size = packetSize;
+                rxFill ^= 1;
+            }
+            if (!etherIsRxBusy() && etherIsDataAvailable())
+            {
+                if (etherIsOverflow())
+                {
+                    setPinValue(RED_LED, 1);
+                    waitMicrosecond(100000);
+                    setPinValue(RED_LED, 0);
+                }
+                etherGetPacketAsync(rxBuffer[rxFill], MAX_PACKET_SIZE, packetReceived);
+            }
+            if (frame != NULL)
+                processPacket(frame, size);
+        }
+        else if (etherIsDataAvailable())
         {
             if (etherIsOverflow())
             {
@@ -1638,265 +2222,9 @@ int main(void)
                 setPinValue(RED_LED, 0);
             }
 
-            // Get packet
-            etherGetPacket(data, MAX_PACKET_SIZE);
-
-            // Handle ARP request
-            if (etherIsArpRequest(data))
-            {   if(isack == 1)
-            {
-                isarp = 1;
-                isack=0;
-            }
-            etherSendArpResponse(data);
-            }
-
-            // Handle IP datagram
-            if (etherIsIp(data))
-            {
-                if (etherIsIpUnicast(data))
-                {
-
-                    if(etherIsAck(data))
-                    {
-                        // in renew
-                        isack = 1;
-                        etherSendGratuitousArpRequest();
-                        restartTimer(testip);
-                        etherSet_g_IP();
-                        set_renewal_flag_true();
-                        stopTimer(etherSendDHCPRequest);
-                        stopTimer(etherSendDHCPRebind);
-                        stopTimer(t1);
-                        restartTimer(t1);
-                        stopTimer(t2);
-                        restartTimer(t2);
-
-                        //stopTimer(etherSendDHCPRequest);
-                        // startOneshotTimer(t1,30);
-                        //restartTimer(t1);
-                    }
-                    // handle icmp ping request
-                    if (etherIsPingRequest(data))
-                    {
-                        etherSendPingResponse(data);
-                    }
-
-                    if(etherIsTcp(data))
-                    {
-                        // waitMicrosecond(1000);
-                        // setPinValue(GREEN_LED, 1);
-
-                        //                        if(get_tcp_flag(data)==htons(0x8012))
-                        //                        {
-                        //                            send_mqtt_ack();
-                        //                        }
-
-                        etherFrame* ether = (etherFrame*)data;
-                        ipFrame* ip = (ipFrame*)&ether->data;
-                        tcpMQTTFrame* tcp = (tcpMQTTFrame*)((uint8_t*)ip + ((ip->revSize & 0xF) * 4));
-                        MQTTPubFrame *mqtt = (MQTTPubFrame*)&tcp->options;
-                        uint32_t tcp_seqno = tcp->seq_no;
-                        uint32_t tcp_ackno = tcp->ack_no;
-
-
-                        //
-                        //                        if(get_tcp_flag(data)==htons(0x8002))
-                        //                        {
-                        //                        send_syn_ack(data);
-                        //                        }
-                        //                        uint16_t flag_tcp = get_tcp_flag(data);
-                        //                        char str[100];
-                        //                        sprintf(str, "%02x",flag_tcp);
-                        //                        putsUart0("flag_tcp");
-                        //                        putsUart0(str);
-                        //                        putsUart0("\r\n");
-
-                        //                         if(get_tcp_flag(data)==htons(0x5018))
-                        //                        {
-                        //                            send_ack(data);
-                        //                        }
-
-                        //                        else if(get_tcp_flag(data)==htons(0x5011))
-                        //                        {
-                        //                            send_fin_ack(data);
-                        //                        }
-
-                        if(get_mqtt_tcp_flag(data)==htons(0x8012))
-                        {
-
-                            tcp_seqno = tcp->ack_no;
-                            tcp_ackno = htonl(htonl(tcp->seq_no)+1);
-                            send_mqtt_ack(tcp_ackno,tcp_seqno);
-
-                                send_mqtt_connect(data);
-                        }
-
-                        else if(get_mqtt_tcp_flag(data)==htons(0x5018))
-                        {
-                            uint32_t datasize = htons(ip->length)-40;
-                            tcp_seqno = tcp->ack_no;
-                            tcp_ackno = htonl(htonl(tcp->seq_no)+datasize);
-                            //if(search_topics(mqtt->topicname))
-                            //{
-                            char string[100];
-                            uint8_t length = get_topic_length();
-                            uint8_t i=0;
-
-                             putsUart0(mqtt->topicname);
-//                             putsUart0(mqtt->data);
-
-//                            for(i=0;i<length;i++)
-//                            {
-//                                if(mqtt->topicname[i]=='0')
-//                                {
-//                                    continue;
-//                                }
-//                                else
-//                                {
-//                                    putcUart0(mqtt->topicname[i]);
-//                                }
-//                            }
-//
-//                            for(i=0;i<d_length;i++)
-//                            {
-//                                if(mqtt->data[i]=='0')
-//                                {
-//                                    continue;
-//                                }
-//                                else
-//                                {
-//                                    putcUart0(mqtt->data[i]);
-//                                }
-//                            }
-
-
-                            putsUart0("\n\r");
-                            putsUart0("\n\r");
-
-//                            for(i=0;i<d_length;i++)
-//                            {
-//                                putcUart0(mqtt->data[i]);
-//                            }
-//                            putsUart0("\n\r");
-//                            putsUart0("\n\r");
-                                //putsUart0(mqtt->data);
-//                                putsUart0("\n\r");
-                            //}
-                            send_mqtt_ack(tcp_ackno,tcp_seqno);
-
-                        }
-
-                        else if(get_mqtt_tcp_flag(data)==htons(0x5011))
-                        {
-                            uint32_t datasize = htons(ip->length)-40;
-                            tcp_seqno = tcp->ack_no;
-                            tcp_ackno = htonl(htonl(tcp->seq_no)+datasize);
-
-                            send_mqtt_finack(tcp_ackno,tcp_seqno);
-
-                        }
-
-                        //setPinValue(GREEN_LED, 0);
-                        //  setPinValue(RED_LED, 1);
-                    }
-
-                    // Process UDP datagram
-                    // test this with a udp send utility like sendip
-                    //   if sender IP (-is) is 192.168.1.198, this will attempt to
-                    //   send the udp datagram (-d) to 192.168.1.199, port 1024 (-ud)
-                    // sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "on" 192.168.1.199
-                    // sudo sendip -p ipv4 -is 192.168.1.198 -p udp -ud 1024 -d "off" 192.168.1.199
-                    if (etherIsUdp(data))
-                    {
-                        udpData = etherGetUdpData(data);
-                        if (strcmp((char*)udpData, "on") == 0)
-                            setPinValue(GREEN_LED, 1);
-                        if (strcmp((char*)udpData, "off") == 0)
-                            setPinValue(GREEN_LED, 0);
-                        etherSendUdpResponse(data, (uint8_t*)"Nikita", 9);
-
-                    }
-
-
-                }
-
-                if (etherIsIpBroadcast(data))
-                {
-
-
-                    if(etherIsOffer(data))
-                    {
-                        //stop timer discover
-                        stopTimer(discover_flag_check);
-                        set_offer_flag_true();
-                        etherSetOffer(data);
-                        f_offer=1;
-                        f_dhcp =0;
-                        etherSendDHCPRequest();
-                        f_discover =  1;
-
-                        f_request=1;
-                        //  putsUart0("offer");
-
-                        putsUart0("\r\n");
-
-
-                    }
-
-                    if(etherIsAck(data))
-                    {
-                        //start one shot timer to test ip (Gratuitios arp for 2 seconds wait for response)
-                        f_request =1;
-                        f_offer =1;
-                        f_discover =1;
-                        f_ack =1;
-                        etherSetAck(data);
-                        isack=1;
-                        // startOneshotTimer(flash3, 5);
-                        //startOneshotTimer(flash4, 10);
-
-                        //uint8_t ip_g[4];
-                        // etherGet_g_IpAddress(ip_g);
-
-
-
-                        //  etherSendDHCPRebind();
-                        //if(f_ack ==1)
-                        //{   etherSet_g_IP();
-                        //startOneshotTimer(t1, 15);
-                        //}
-
-                        uint32_t ip_lease_time=get_ip_lease_time();
-
-                        //                              char str[100];
-                        //                              sprintf(str, "%02x",ip_lease_time);
-                        //                              putsUart0("ip_lease_time");
-                        //                              putsUart0(str);
-                        //                              putsUart0("\r\n");
-
-                        uint32_t half_lease_time = 0.5*ip_lease_time;
-                        uint32_t t2_lease_time = 87.5*ip_lease_time;
-
-                        etherSendGratuitousArpRequest();
-                        startOneshotTimer(testip, 2);
-                        etherSet_g_IP();
-                        stopTimer(t2);
-                        startOneshotTimer(t1, 15);
-                        startOneshotTimer(t2, 100);
-                        startOneshotTimer(discover_flag_check,120);
-
-
-
-
-
-                    }
-                }
-
-
-
-
-            }
+            // Get the waiting packets, up to the budget
+            // (frames nothing here listens for are skipped)
+            etherDrainPackets(rxData, MAX_PACKET_SIZE, handlePacket, rxBudget);
         }
     }
 }
@@ -0,0 +1,130 @@
+// Packet Buffer Pool Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "pool.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+packetBuffer packetPool[PACKET_BUFFERS];
+packetPoolStats poolStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Takes a free buffer from the pool with one reference and the standard headroom
+// Senders can run from timer callbacks, so the pool is changed with interrupts off;
+// they are left as the caller had them, so this can be called in a critical section
+// Returns NULL if every buffer is in use
+packetBuffer* allocPacketBuffer()
+{
+    packetBuffer* buffer = NULL;
+    uint32_t primask;
+    uint8_t i;
+
+    primask = _disable_interrupts();
+    for (i = 0; i < PACKET_BUFFERS && buffer == NULL; i++)
+    {
+        if (packetPool[i].refs == 0)
+        {
+            buffer = &packetPool[i];
+            buffer->refs = 1;
+        }
+    }
+    if (buffer != NULL)
+    {
+        poolStats.allocs++;
+        poolStats.inUse++;
+        if (poolStats.inUse > poolStats.highWater)
+            poolStats.highWater = poolStats.inUse;
+    }
+    else
+        poolStats.failures++;
+    _restore_interrupts(primask);
+
+    if (buffer != NULL)
+        resetPacketBuffer(buffer, PACKET_HEADROOM);
+    return buffer;
+}
+
+// Adds a reference, e.g. while a buffer waits in a queue
+void holdPacketBuffer(packetBuffer* buffer)
+{
+    uint32_t primask = _disable_interrupts();
+    buffer->refs++;
+    _restore_interrupts(primask);
+}
+
+// Drops a reference; the buffer goes back to the pool with the last one
+void freePacketBuffer(packetBuffer* buffer)
+{
+    uint32_t primask = _disable_interrupts();
+    if (buffer->refs > 0)
+    {
+        buffer->refs--;
+        if (buffer->refs == 0)
+            poolStats.inUse--;
+    }
+    _restore_interrupts(primask);
+}
+
+// Empties a buffer, leaving headroom bytes in front for headers
+// Receive buffers use no headroom, so the whole buffer holds the frame
+void resetPacketBuffer(packetBuffer* buffer, uint16_t headroom)
+{
+    buffer->data = buffer->mem + headroom;
+    buffer->size = 0;
+}
+
+// Extends the packet at its end
+// Returns a pointer to the new bytes, or NULL if there is no room
+uint8_t* appendPacketBuffer(packetBuffer* buffer, uint16_t size)
+{
+    uint8_t* tail = buffer->data + buffer->size;
+    if (tail + size > buffer->mem + PACKET_BUFFER_SIZE)
+        return NULL;
+    buffer->size += size;
+    return tail;
+}
+
+// Extends the packet at its start, e.g. to add a header
+// Returns the new start of the packet, or NULL if the headroom is used up
+uint8_t* prependPacketBuffer(packetBuffer* buffer, uint16_t size)
+{
+    if (buffer->data - size < buffer->mem)
+        return NULL;
+    buffer->data -= size;
+    buffer->size += size;
+    return buffer->data;
+}
+
+// Shortens the packet to size bytes
+void trimPacketBuffer(packetBuffer* buffer, uint16_t size)
+{
+    if (size < buffer->size)
+        buffer->size = size;
+}
+
+void getPacketPoolStats(packetPoolStats* stats)
+{
+    *stats = poolStats;
+}
@@ -0,0 +1,81 @@
+// Packet Buffer Pool Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// SRAM budget (32 KB on the TM4C123GH6PM), largest users first:
+//   packet pool        PACKET_BUFFERS x 1612 bytes            9.4 KB
+//   reassembly         REASM_BUDGET arena and its slots       4.8 KB
+//   receive buffers    rxData and dmaData in ethernet.c       3.0 KB
+//   tcp and arp tables                                        1.8 KB
+//   everything else                                           about 1 KB
+//   stack, set by the linker                                  4 KB
+// That leaves about 7 KB, which anything new comes out of
+// Six buffers cover the TCP_RTX_SEGMENTS segments one connection keeps until they
+// are acked, with two to spare for acks, arp, and dhcp
+#define PACKET_BUFFERS      6
+#define PACKET_HEADROOM     80      // ethernet (14) + ip (20) + tcp with options (up to 40), rounded up
+#define PACKET_BUFFER_SIZE  (PACKET_HEADROOM + 1522)
+
+// The pool, and other state shared with timer callbacks, is changed with
+// interrupts off; _disable_interrupts returns the old primask and
+// _restore_interrupts puts it back, so a caller's critical section stays closed
+// They are intrinsics of the TI compiler; the host tests supply stand-ins
+#ifndef __TI_COMPILER_VERSION__
+uint32_t _disable_interrupts();
+void _restore_interrupts(uint32_t primask);
+#endif
+
+// Fixed-size packet buffer
+// A sender appends its payload after the headroom, then prepends each header
+// in turn (tcp or udp, ip, ethernet), so data always points at the outermost one
+// mem comes first so it is word aligned; with the headroom a multiple of 4,
+// the ip header of a tcp or udp frame then starts on a word boundary too
+typedef struct _packetBuffer
+{
+    uint8_t mem[PACKET_BUFFER_SIZE];
+    uint8_t* data;              // start of the packet
+    uint16_t size;              // bytes from data to the end of the packet
+    uint8_t refs;
+} packetBuffer;
+
+typedef struct _packetPoolStats
+{
+    uint32_t allocs;
+    uint32_t failures;
+    uint8_t inUse;
+    uint8_t highWater;
+} packetPoolStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+packetBuffer* allocPacketBuffer();
+void holdPacketBuffer(packetBuffer* buffer);
+void freePacketBuffer(packetBuffer* buffer);
+void resetPacketBuffer(packetBuffer* buffer, uint16_t headroom);
+uint8_t* appendPacketBuffer(packetBuffer* buffer, uint16_t size);
+uint8_t* prependPacketBuffer(packetBuffer* buffer, uint16_t size);
+void trimPacketBuffer(packetBuffer* buffer, uint16_t size);
+void getPacketPoolStats(packetPoolStats* stats);
+
+#endif
@@ -0,0 +1,291 @@
+// IPv4 Reassembly Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "reassembly.h"
+#include "eth0.h"
+
+// Datagram being put back together
+// Each datagram holds a region of the shared arena; data goes after the headroom,
+// so the headers of the first fragment can be copied in front of it and the whole
+// datagram handed on as one frame
+typedef struct _reasmSlot
+{
+    uint8_t sourceIp[4];
+    uint8_t destIp[4];
+    uint16_t id;
+    uint8_t protocol;
+    bool used;
+    uint8_t age;                    // seconds since the first fragment arrived
+    uint8_t headerSize;             // ip header size, or 0 until the first fragment is in
+    uint16_t total;                 // data size, or 0 until the last fragment is in
+    uint16_t received;              // data bytes held
+    uint16_t base;                  // start of the region in the arena
+    uint16_t space;                 // size of the region, headroom included
+    uint8_t blocks[(REASM_BLOCKS + 7) / 8];     // 8-byte blocks held
+} reasmSlot;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+reasmSlot reasmSlots[REASM_SLOTS];
+reassemblyStats reasmStats;
+
+// Word array so every region starts on a 4-byte boundary
+uint32_t reasmArena[REASM_BUDGET / 4];
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initReassembly()
+{
+    uint8_t i;
+    for (i = 0; i < REASM_SLOTS; i++)
+        reasmSlots[i].used = false;
+}
+
+// Finds the slot of the datagram ip belongs to, or takes a new one
+// If every slot is in use, the oldest incomplete datagram is given up
+reasmSlot* findReassemblySlot(ipFrame* ip)
+{
+    reasmSlot* slot;
+    reasmSlot* oldest = NULL;
+    reasmSlot* unused = NULL;
+    uint8_t i;
+
+    for (i = 0; i < REASM_SLOTS; i++)
+    {
+        slot = &reasmSlots[i];
+        if (!slot->used)
+        {
+            if (unused == NULL)
+                unused = slot;
+        }
+        else if (slot->id == ip->id && slot->protocol == ip->protocol
+                 && memcmp(slot->sourceIp, ip->sourceIp, IP_ADD_LENGTH) == 0
+                 && memcmp(slot->destIp, ip->destIp, IP_ADD_LENGTH) == 0)
+            return slot;
+        else if (oldest == NULL || slot->age > oldest->age)
+            oldest = slot;
+    }
+    if (unused == NULL)
+    {
+        unused = oldest;
+        reasmStats.evictions++;
+    }
+    memcpy(unused->sourceIp, ip->sourceIp, IP_ADD_LENGTH);
+    memcpy(unused->destIp, ip->destIp, IP_ADD_LENGTH);
+    unused->id = ip->id;
+    unused->protocol = ip->protocol;
+    unused->used = true;
+    unused->age = 0;
+    unused->headerSize = 0;
+    unused->total = 0;
+    unused->received = 0;
+    unused->base = 0;
+    unused->space = 0;
+    memset(unused->blocks, 0, sizeof(unused->blocks));
+    return unused;
+}
+
+// Grows the region of slot to at least size bytes
+// The other regions are packed against the ends of the arena so the free bytes sit
+// right after this one; if the budget is short, the oldest other datagrams are given up
+// Returns false if the datagram cannot fit even on its own
+bool reserveReassemblySpace(reasmSlot* slot, uint16_t size)
+{
+    uint8_t* arena = (uint8_t*)reasmArena;
+    reasmSlot* order[REASM_SLOTS];
+    reasmSlot* oldest;
+    uint16_t used, next;
+    uint8_t i, j, count, position;
+
+    size = (size + 3) & ~3;
+    if (size <= slot->space)
+        return true;
+    if (size > REASM_BUDGET)
+        return false;
+    while (true)
+    {
+        used = size;
+        oldest = NULL;
+        for (i = 0; i < REASM_SLOTS; i++)
+        {
+            if (reasmSlots[i].used && &reasmSlots[i] != slot)
+            {
+                used += reasmSlots[i].space;
+                if (oldest == NULL || reasmSlots[i].age > oldest->age)
+                    oldest = &reasmSlots[i];
+            }
+        }
+        if (used <= REASM_BUDGET)
+            break;
+        oldest->used = false;
+        reasmStats.evictions++;
+    }
+
+    // sort the regions by where they start
+    count = 0;
+    for (i = 0; i < REASM_SLOTS; i++)
+    {
+        if (!reasmSlots[i].used)
+            continue;
+        for (j = count; j > 0 && order[j - 1]->base > reasmSlots[i].base; j--)
+            order[j] = order[j - 1];
+        order[j] = &reasmSlots[i];
+        count++;
+    }
+    for (position = 0; order[position] != slot; position++);
+
+    // regions up to this one move down, lowest first, and the rest move up, highest first
+    next = 0;
+    for (i = 0; i <= position; i++)
+    {
+        if (order[i]->base != next)
+        {
+            memmove(arena + next, arena + order[i]->base, order[i]->space);
+            order[i]->base = next;
+        }
+        next += order[i]->space;
+    }
+    next = REASM_BUDGET;
+    for (i = count - 1; i > position; i--)
+    {
+        next -= order[i]->space;
+        if (order[i]->base != next)
+        {
+            memmove(arena + next, arena + order[i]->base, order[i]->space);
+            order[i]->base = next;
+        }
+    }
+    slot->space = size;
+    return true;
+}
+
+// Adds a fragment (an ip frame with more fragments set or a non-zero offset, and a
+// good header checksum) to its datagram
+// When the datagram is complete, returns the reassembled frame and sets size; it is
+// only valid until the next call, so it must be handled straight away
+// Returns NULL while fragments are still missing or if the datagram was dropped
+// Where fragments overlap, the bytes that arrived first are kept
+uint8_t* reassembleFragment(uint8_t packet[], uint16_t* size)
+{
+    etherFrame* ether = (etherFrame*)packet;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    reasmSlot* slot;
+    uint8_t* data;
+    uint8_t* region;
+    uint8_t* frame;
+    uint16_t headerSize = (ip->revSize & 0xF) * 4;
+    uint16_t flags = ntohs(ip->flagsAndOffset);
+    uint16_t offset = (flags & 0x1FFF) * 8;
+    uint16_t length, block, n;
+    uint32_t end;
+    bool last = (flags & 0x2000) == 0;
+    bool overlap = false;
+
+    reasmStats.fragments++;
+    if (ntohs(ip->length) < headerSize || 14 + ntohs(ip->length) > *size)
+    {
+        reasmStats.dropped++;
+        return NULL;
+    }
+    length = ntohs(ip->length) - headerSize;
+    data = (uint8_t*)ip + headerSize;
+    slot = findReassemblySlot(ip);
+
+    // all but the last fragment carry a multiple of 8 bytes, and the last one
+    // fixes the size; anything else means the datagram cannot be trusted
+    end = offset + length;
+    if (length == 0 || headerSize + end > REASM_MAX_SIZE || (!last && (length & 7) != 0)
+        || (last && slot->total != 0 && slot->total != end) || (slot->total != 0 && end > slot->total))
+    {
+        slot->used = false;
+        reasmStats.dropped++;
+        return NULL;
+    }
+    if (last)
+        slot->total = end;
+    // once the size is known the whole datagram is reserved, so later fragments
+    // do not move it again
+    if (!reserveReassemblySpace(slot, REASM_HEADROOM + (slot->total != 0 ? slot->total : end)))
+    {
+        slot->used = false;
+        reasmStats.dropped++;
+        return NULL;
+    }
+    region = (uint8_t*)reasmArena + slot->base;
+
+    for (block = offset / 8; block * 8 < end; block++)
+    {
+        n = (end - block * 8 < 8) ? end - block * 8 : 8;
+        if ((slot->blocks[block / 8] & (1 << (block % 8))) != 0)
+            overlap = true;
+        else
+        {
+            memcpy(region + REASM_HEADROOM + block * 8, data + block * 8 - offset, n);
+            slot->blocks[block / 8] |= 1 << (block % 8);
+            slot->received += n;
+        }
+    }
+    if (overlap)
+        reasmStats.overlaps++;
+
+    // the headers of the first fragment go right in front of the data
+    if (offset == 0 && slot->headerSize == 0)
+    {
+        memcpy(region + REASM_HEADROOM - headerSize - 14, packet, 14 + headerSize);
+        slot->headerSize = headerSize;
+    }
+
+    if (slot->headerSize == 0 || slot->total == 0 || slot->received != slot->total)
+        return NULL;
+
+    frame = region + REASM_HEADROOM - slot->headerSize - 14;
+    ip = (ipFrame*)(frame + 14);
+    ip->length = htons(slot->headerSize + slot->total);
+    ip->flagsAndOffset = 0;
+    etherCalcIpChecksum(ip);
+    *size = 14 + slot->headerSize + slot->total;
+    slot->used = false;
+    reasmStats.datagrams++;
+    return frame;
+}
+
+// Ages the datagrams being reassembled; call once a second from the main loop
+// Datagrams still incomplete after REASM_TIMEOUT seconds are dropped
+void reassemblyTick()
+{
+    uint8_t i;
+    for (i = 0; i < REASM_SLOTS; i++)
+    {
+        if (reasmSlots[i].used && ++reasmSlots[i].age >= REASM_TIMEOUT)
+        {
+            reasmSlots[i].used = false;
+            reasmStats.timeouts++;
+        }
+    }
+}
+
+void getReassemblyStats(reassemblyStats* stats)
+{
+    *stats = reasmStats;
+}
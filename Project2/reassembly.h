@@ -0,0 +1,54 @@
+// IPv4 Reassembly Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef REASSEMBLY_H_
+#define REASSEMBLY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Memory used is REASM_BUDGET bytes, shared by the datagrams being put back together,
+// plus REASM_BLOCKS / 8 bytes of bookkeeping per slot
+// Fragmented datagrams are by definition larger than the link mtu, so the budget
+// holds one of REASM_MAX_SIZE bytes with room to spare for smaller ones
+#define REASM_SLOTS         3       // datagrams put back together at once
+#define REASM_BUDGET        4608    // bytes shared by all slots, headroom included (multiple of 4)
+#define REASM_MAX_SIZE      4096    // largest datagram accepted (ip header and data)
+#define REASM_TIMEOUT       15      // seconds a datagram has to complete
+#define REASM_HEADROOM      74      // ethernet header and the largest ip header
+#define REASM_BLOCKS        ((REASM_MAX_SIZE + 7) / 8)
+
+typedef struct _reassemblyStats
+{
+    uint32_t fragments;
+    uint32_t datagrams;             // completed and passed on
+    uint32_t timeouts;
+    uint32_t evictions;             // incomplete datagrams pushed out for a new one or for space
+    uint32_t overlaps;              // fragments that repeated bytes already held
+    uint32_t dropped;               // too large or inconsistent
+} reassemblyStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initReassembly();
+uint8_t* reassembleFragment(uint8_t packet[], uint16_t* size);
+void reassemblyTick();
+void getReassemblyStats(reassemblyStats* stats);
+
+#endif
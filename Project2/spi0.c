@@ -15,6 +15,9 @@
 //   MISO on PA4 (SSI0Rx)
 //   ~CS on PA3  (SSI0Fss)
 //   SCLK on PA2 (SSI0Clk)
+// uDMA (optional):
+//   SSI0 RX on channel 10, SSI0 TX on channel 11
+//   Completion interrupt on the SSI0 vector (spi0Isr)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -22,6 +25,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "tm4c123gh6pm.h"
 #include "gpio.h"
 #include "spi0.h"
@@ -32,10 +36,29 @@
 #define SSI0FSS PORTA,3
 #define SSI0CLK PORTA,2
 
+// uDMA channels (channel map encoding 0)
+#define SSI0_RX_DMA_CH 10
+#define SSI0_TX_DMA_CH 11
+#define DMA_MAX_XFER   1024
+
 //-----------------------------------------------------------------------------
 // Global variables
 //-----------------------------------------------------------------------------
 
+// Primary control structures for all 32 channels (4 words each)
+#pragma DATA_ALIGN(dmaControlTable, 1024)
+uint32_t dmaControlTable[128];
+
+bool spi0DmaMode = false;
+volatile bool spi0DmaBusy = false;
+const uint8_t* spi0DmaTxData;
+uint8_t* spi0DmaRxData;
+uint16_t spi0DmaRemaining;
+uint16_t spi0DmaChunk;
+_spi0Callback spi0DmaCallback;
+uint8_t spi0DmaFill = 0;
+uint8_t spi0DmaSink;
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -103,3 +126,182 @@ uint32_t readSpi0Data()
 {
     return SSI0_DR_R;
 }
+
+// Blocking function that transfers a block of bytes
+// Keeps the tx fifo full while draining the rx fifo, but never lets more than
+// the fifo depth be outstanding so the rx fifo cannot overrun
+// If txData is NULL, the fill byte is sent; if rxData is NULL, rx data is discarded
+void transferSpi0Block(const uint8_t txData[], uint8_t rxData[], uint16_t size, uint8_t fill)
+{
+    uint16_t txCount = 0, rxCount = 0;
+    uint8_t data;
+    while (rxCount < size)
+    {
+        while ((txCount < size) && ((uint16_t)(txCount - rxCount) < SSI0_FIFO_DEPTH)
+               && (SSI0_SR_R & SSI_SR_TNF))
+        {
+            SSI0_DR_R = (txData != NULL) ? txData[txCount] : fill;
+            txCount++;
+        }
+        while (SSI0_SR_R & SSI_SR_RNE)
+        {
+            data = SSI0_DR_R;
+            if (rxData != NULL)
+                rxData[rxCount] = data;
+            rxCount++;
+        }
+    }
+}
+
+// Writes a block of bytes, discarding the data clocked in
+// Uses uDMA when enabled, but still blocks until the transfer completes
+void writeSpi0Block(const uint8_t data[], uint16_t size)
+{
+    startSpi0Transfer(data, NULL, size, NULL);
+    while (spi0DmaBusy);
+}
+
+// Reads a block of bytes, clocking out zeros
+// Uses uDMA when enabled, but still blocks until the transfer completes
+void readSpi0Block(uint8_t data[], uint16_t size)
+{
+    startSpi0Transfer(NULL, data, size, NULL);
+    while (spi0DmaBusy);
+}
+
+// Enables uDMA for block transfers
+// Call after initSpi0(); the SSI0 vector must point to spi0Isr
+void initSpi0Dma()
+{
+    // Enable clocks
+    SYSCTL_RCGCDMA_R |= SYSCTL_RCGCDMA_R0;
+    _delay_cycles(3);
+
+    // Enable controller and point it at the control table
+    UDMA_CFG_R = UDMA_CFG_MASTEN;
+    UDMA_CTLBASE_R = (uint32_t)dmaControlTable;
+
+    // Use the default SSI0 channel mapping, primary structures, single and burst requests
+    UDMA_CHMAP1_R &= ~(UDMA_CHMAP1_CH10SEL_M | UDMA_CHMAP1_CH11SEL_M);
+    UDMA_ALTCLR_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+    UDMA_USEBURSTCLR_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+    UDMA_REQMASKCLR_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+
+    // Drain rx ahead of tx so the rx fifo cannot overrun
+    UDMA_PRIOSET_R = 1 << SSI0_RX_DMA_CH;
+    UDMA_PRIOCLR_R = 1 << SSI0_TX_DMA_CH;
+
+    // Completion is signaled on the SSI0 interrupt
+    NVIC_EN0_R |= 1 << (INT_SSI0-16);
+    spi0DmaMode = true;
+}
+
+bool isSpi0DmaMode()
+{
+    return spi0DmaMode;
+}
+
+// Returns true while an asynchronous transfer is in progress
+bool isSpi0Busy()
+{
+    return spi0DmaBusy;
+}
+
+// Programs both channels for the next chunk (at most 1024 bytes) and starts it
+void startSpi0DmaChunk()
+{
+    uint32_t* rx = &dmaControlTable[SSI0_RX_DMA_CH * 4];
+    uint32_t* tx = &dmaControlTable[SSI0_TX_DMA_CH * 4];
+    uint32_t size;
+
+    spi0DmaChunk = spi0DmaRemaining;
+    if (spi0DmaChunk > DMA_MAX_XFER)
+        spi0DmaChunk = DMA_MAX_XFER;
+    size = (uint32_t)(spi0DmaChunk - 1) << UDMA_CHCTL_XFERSIZE_S;
+
+    rx[0] = (uint32_t)&SSI0_DR_R;
+    if (spi0DmaRxData != NULL)
+    {
+        rx[1] = (uint32_t)&spi0DmaRxData[spi0DmaChunk - 1];
+        rx[2] = UDMA_CHCTL_DSTINC_8 | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCINC_NONE
+              | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4 | size | UDMA_CHCTL_XFERMODE_BASIC;
+    }
+    else
+    {
+        rx[1] = (uint32_t)&spi0DmaSink;
+        rx[2] = UDMA_CHCTL_DSTINC_NONE | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCINC_NONE
+              | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4 | size | UDMA_CHCTL_XFERMODE_BASIC;
+    }
+
+    tx[1] = (uint32_t)&SSI0_DR_R;
+    if (spi0DmaTxData != NULL)
+    {
+        tx[0] = (uint32_t)&spi0DmaTxData[spi0DmaChunk - 1];
+        tx[2] = UDMA_CHCTL_DSTINC_NONE | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCINC_8
+              | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4 | size | UDMA_CHCTL_XFERMODE_BASIC;
+    }
+    else
+    {
+        tx[0] = (uint32_t)&spi0DmaFill;
+        tx[2] = UDMA_CHCTL_DSTINC_NONE | UDMA_CHCTL_DSTSIZE_8 | UDMA_CHCTL_SRCINC_NONE
+              | UDMA_CHCTL_SRCSIZE_8 | UDMA_CHCTL_ARBSIZE_4 | size | UDMA_CHCTL_XFERMODE_BASIC;
+    }
+
+    // enable rx first so no received byte is missed
+    UDMA_ENASET_R = 1 << SSI0_RX_DMA_CH;
+    UDMA_ENASET_R = 1 << SSI0_TX_DMA_CH;
+}
+
+// Starts a block transfer and calls callback (if not NULL) when it completes
+// In uDMA mode the transfer runs in the background and the callback is called
+// from spi0Isr; otherwise (or for short blocks) it completes before returning
+// Buffers must stay valid until completion
+// Returns false if a transfer is already in progress
+bool startSpi0Transfer(const uint8_t txData[], uint8_t rxData[], uint16_t size, _spi0Callback callback)
+{
+    if (spi0DmaBusy)
+        return false;
+    if (!spi0DmaMode || size < SPI0_DMA_MIN_SIZE)
+    {
+        transferSpi0Block(txData, rxData, size, 0);
+        if (callback != NULL)
+            (*callback)();
+        return true;
+    }
+    spi0DmaTxData = txData;
+    spi0DmaRxData = rxData;
+    spi0DmaRemaining = size;
+    spi0DmaCallback = callback;
+    spi0DmaBusy = true;
+    startSpi0DmaChunk();
+    SSI0_DMACTL_R = SSI_DMACTL_RXDMAE | SSI_DMACTL_TXDMAE;
+    return true;
+}
+
+// Handles uDMA completion for SSI0
+// rx completes after tx, so the transfer is done when the rx channel finishes
+void spi0Isr()
+{
+    if ((UDMA_CHIS_R & (1 << SSI0_RX_DMA_CH)) == 0)
+    {
+        UDMA_CHIS_R = 1 << SSI0_TX_DMA_CH;
+        return;
+    }
+    UDMA_CHIS_R = (1 << SSI0_RX_DMA_CH) | (1 << SSI0_TX_DMA_CH);
+
+    spi0DmaRemaining -= spi0DmaChunk;
+    if (spi0DmaTxData != NULL)
+        spi0DmaTxData += spi0DmaChunk;
+    if (spi0DmaRxData != NULL)
+        spi0DmaRxData += spi0DmaChunk;
+    if (spi0DmaRemaining > 0)
+    {
+        startSpi0DmaChunk();
+        return;
+    }
+
+    SSI0_DMACTL_R = 0;
+    spi0DmaBusy = false;
+    if (spi0DmaCallback != NULL)
+        (*spi0DmaCallback)();
+}
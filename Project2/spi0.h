@@ -15,6 +15,9 @@
 //   MISO on PA4 (SSI0Rx)
 //   ~CS on PA3  (SSI0Fss)
 //   SCLK on PA2 (SSI0Clk)
+// uDMA (optional):
+//   SSI0 RX on channel 10, SSI0 TX on channel 11
+//   Completion interrupt on the SSI0 vector (spi0Isr)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -26,6 +29,13 @@
 #define USE_SSI0_FSS 1
 #define USE_SSI0_RX  2
 
+#define SSI0_FIFO_DEPTH 8
+
+// Transfers shorter than this stay polled even in uDMA mode
+#define SPI0_DMA_MIN_SIZE 32
+
+typedef void (*_spi0Callback)();
+
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
@@ -35,5 +45,13 @@ void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc);
 void setSpi0Mode(uint8_t polarity, uint8_t phase);
 void writeSpi0Data(uint32_t data);
 uint32_t readSpi0Data();
+void transferSpi0Block(const uint8_t txData[], uint8_t rxData[], uint16_t size, uint8_t fill);
+void writeSpi0Block(const uint8_t data[], uint16_t size);
+void readSpi0Block(uint8_t data[], uint16_t size);
+void initSpi0Dma();
+bool isSpi0DmaMode();
+bool isSpi0Busy();
+bool startSpi0Transfer(const uint8_t txData[], uint8_t rxData[], uint16_t size, _spi0Callback callback);
+void spi0Isr();
 
 #endif
@@ -0,0 +1,1052 @@
+// TCP Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (sends through eth0)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "tcp.h"
+#include "eth0.h"
+#include "pool.h"
+#include "timer.h"
+
+typedef struct _tcpListener
+{
+    uint16_t port;                  // 0 if unused
+    _tcpCallback callback;
+} tcpListener;
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+// Blocks are chained from a hash bucket of their 4-tuple, so demultiplexing a
+// segment only visits the blocks that share its bucket; unused blocks are chained
+// on a free list
+// Connections are only used from the main loop, never from a timer callback
+tcpConnection tcpTable[TCP_CONNECTIONS];
+uint8_t tcpBuckets[TCP_BUCKETS];
+uint8_t tcpFreeList;
+tcpListener tcpListeners[TCP_LISTENERS];
+uint16_t tcpNextPort = 49152;
+uint32_t tcpIssClock;               // moves on like the 4 us clock of rfc 793
+tcpStats tcpCounters;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// The local address is always this host's, so it is left out of the hash
+uint8_t tcpHash(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort)
+{
+    return (remoteIp[2] ^ remoteIp[3] ^ remotePort ^ (remotePort >> 8)
+            ^ localPort ^ (localPort >> 8)) & (TCP_BUCKETS - 1);
+}
+
+// Initial congestion window (rfc 5681): 2 to 4 segments, about 4 kB
+uint32_t tcpGetInitialWindow(uint16_t mss)
+{
+    if (mss > 2190)
+        return 2 * mss;
+    if (mss > 1095)
+        return 3 * mss;
+    return 4 * mss;
+}
+
+void initTcp()
+{
+    uint8_t i;
+    for (i = 0; i < TCP_BUCKETS; i++)
+        tcpBuckets[i] = TCP_NONE;
+    for (i = 0; i < TCP_CONNECTIONS; i++)
+    {
+        tcpTable[i].state = TCP_CLOSED;
+        tcpTable[i].next = (i + 1 < TCP_CONNECTIONS) ? i + 1 : TCP_NONE;
+    }
+    tcpFreeList = 0;
+    for (i = 0; i < TCP_LISTENERS; i++)
+        tcpListeners[i].port = 0;
+}
+
+// Returns the index of the connection for the 4-tuple, or TCP_NONE
+uint8_t tcpFind(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort)
+{
+    uint8_t i = tcpBuckets[tcpHash(remoteIp, remotePort, localPort)];
+    while (i != TCP_NONE && (tcpTable[i].remotePort != remotePort || tcpTable[i].localPort != localPort
+                             || memcmp(tcpTable[i].remoteIp, remoteIp, IP_ADD_LENGTH) != 0))
+        i = tcpTable[i].next;
+    return i;
+}
+
+// Takes a block from the free list and links it into the bucket of its 4-tuple
+// Returns its index, or TCP_NONE if every block is in use
+uint8_t tcpAdd(const uint8_t remoteIp[], uint16_t remotePort, uint16_t localPort, _tcpCallback callback)
+{
+    tcpConnection* c;
+    uint8_t index = tcpFreeList, hash;
+
+    if (index == TCP_NONE)
+    {
+        tcpCounters.full++;
+        return TCP_NONE;
+    }
+    c = &tcpTable[index];
+    tcpFreeList = c->next;
+    memset(c, 0, sizeof(tcpConnection));
+    memcpy(c->remoteIp, remoteIp, IP_ADD_LENGTH);
+    c->remotePort = remotePort;
+    c->localPort = localPort;
+    c->callback = callback;
+    c->sndMss = TCP_DEFAULT_MSS;
+    c->rcvMss = TCP_DEFAULT_MSS;
+    c->cwnd = tcpGetInitialWindow(TCP_DEFAULT_MSS);
+    c->ssthresh = TCP_MAX_CWND;
+    c->rto = TCP_INITIAL_RTO;
+    tcpIssClock += 64000;
+    c->iss = tcpIssClock;
+    c->sndUna = c->iss;
+    c->sndNxt = c->iss;
+    c->sndMax = c->iss;
+    etherInitTcpTemplate(&c->header, remoteIp, localPort, remotePort);
+    hash = tcpHash(remoteIp, remotePort, localPort);
+    c->next = tcpBuckets[hash];
+    tcpBuckets[hash] = index;
+    return index;
+}
+
+// Unlinks a block, lets go of its unacknowledged and held segments, and returns it to the free list
+void tcpRemove(uint8_t index)
+{
+    tcpConnection* c = &tcpTable[index];
+    uint8_t* link = &tcpBuckets[tcpHash(c->remoteIp, c->remotePort, c->localPort)];
+
+    while (*link != index)
+        link = &tcpTable[*link].next;
+    *link = c->next;
+    while (c->rtxCount > 0)
+    {
+        freePacketBuffer(c->rtx[c->rtxHead].buffer);
+        c->rtxHead = (c->rtxHead + 1) % TCP_RTX_SEGMENTS;
+        c->rtxCount--;
+    }
+    while (c->heldCount > 0)
+        freePacketBuffer(c->held[--c->heldCount].buffer);
+    c->state = TCP_CLOSED;
+    c->next = tcpFreeList;
+    tcpFreeList = index;
+}
+
+// Frees a connection and tells its owner
+void tcpDrop(uint8_t index, uint8_t event)
+{
+    _tcpCallback callback = tcpTable[index].callback;
+    tcpRemove(index);
+    if (callback != NULL)
+        callback(index, event, NULL, 0);
+}
+
+// Largest segment to send: the peer's mss, cut to fit the path mtu
+uint16_t tcpGetMss(tcpConnection* c)
+{
+    uint16_t mss = etherGetPathMtu(c->remoteIp) - 40;
+    return (c->sndMss < mss) ? c->sndMss : mss;
+}
+
+// Window to advertise: the data that fits in the receive ring as full-size
+// segments, since segments wait there until the main loop reads and delivers them
+// The ring is shared, so this is an upper bound that moves with the memory profile
+uint16_t tcpGetWindow()
+{
+    return (etherGetRxRingSize() / TCP_RX_FRAME) * (ETHER_MTU - 40);
+}
+
+// Notes that an ack went out, on a bare segment or riding on one with data, syn, or fin
+// Against an ack frame for every data segment, a bare ack saves all but one of the
+// segments it covers, and one that rides saves them all
+void tcpAckSent(tcpConnection* c, bool bare)
+{
+    uint16_t saved = c->ackSegments;
+
+    if (bare && saved > 0)
+        saved--;
+    c->acksSaved += saved;
+    tcpCounters.acksSaved += saved;
+    c->ackSegments = 0;
+    c->ackBytes = 0;
+    c->flags &= ~(TCP_ACK_NOW | TCP_ACK_DELAYED);
+}
+
+// Sends a queued segment with the current ack and window; every segment but the
+// first syn carries an ack, so any ack owed rides along
+// The buffer is put back to the bare options and data before fresh headers go on
+// Returns false if it could not go out; it stays queued either way
+bool tcpTransmit(tcpConnection* c, tcpSegment* s)
+{
+    packetBuffer* buffer = s->buffer;
+    uint8_t flags = s->flags;
+
+    // the last copy is still waiting for arp
+    if (buffer->refs > 1)
+        return false;
+    holdPacketBuffer(buffer);
+    resetPacketBuffer(buffer, PACKET_HEADROOM);
+    appendPacketBuffer(buffer, s->size);
+    if (c->state != TCP_SYN_SENT)
+    {
+        flags |= TCP_ACK;
+        tcpAckSent(c, false);
+    }
+    c->rcvWnd = tcpGetWindow();
+    tcpCounters.segmentsOut++;
+    return etherSendTcp(&c->header, buffer, htonl(s->seq), htonl(c->rcvNxt), (s->offset << 12) | flags,
+                        c->rcvWnd);
+}
+
+// Sends the queued segments after sndNxt while they fit in the smaller of the
+// congestion window and the peer's window
+// With force, the next segment goes out even if nothing fits, e.g. to probe a
+// zero window or to resend after a timeout
+void tcpOutput(tcpConnection* c, bool force)
+{
+    tcpSegment* s;
+    uint32_t window = (c->cwnd < c->sndWnd) ? c->cwnd : c->sndWnd;
+    uint32_t end;
+    uint8_t i;
+
+    for (i = 0; i < c->rtxCount; i++)
+    {
+        s = &c->rtx[(c->rtxHead + i) % TCP_RTX_SEGMENTS];
+        end = s->seq + s->length;
+        if ((int32_t)(end - c->sndNxt) <= 0)
+            continue;
+        // a syn or fin takes no room in the window
+        if (!force && (end - ((s->flags & (TCP_SYN | TCP_FIN)) != 0) - c->sndUna > window
+                       || ((c->flags & TCP_STOP_AND_WAIT) != 0 && c->sndNxt != c->sndUna)))
+            break;
+        force = false;
+        if ((int32_t)(s->seq - c->sndMax) < 0)
+        {
+            c->retransmits++;
+            tcpCounters.retransmits++;
+        }
+        else if ((c->flags & TCP_RTT_TIMING) == 0)
+        {
+            c->flags |= TCP_RTT_TIMING;
+            c->rttSeq = s->seq;
+            c->rttStart = getMillis();
+        }
+        if (c->sndNxt == c->sndUna)
+            c->rtxDeadline = getMillis() + c->rto;
+        c->sndNxt = end;
+        if ((int32_t)(end - c->sndMax) > 0)
+            c->sndMax = end;
+        tcpTransmit(c, s);
+    }
+}
+
+// Adds a segment carrying flags and any data spans (up to ETHER_MAX_SPANS - 1) to
+// the end of the queue and sends what the windows allow
+// A syn carries an mss option; every segment but the first syn carries an ack
+// A segment that uses sequence space (syn, fin, or data) is copied into a pool buffer
+// that stays on the queue until acked; a bare ack or reset is sent once at sndMax
+// Returns false if it could not be queued (or a bare segment could not go out)
+bool tcpSendSegment(tcpConnection* c, uint8_t flags, const etherSpan data[], uint8_t count)
+{
+    packetBuffer* buffer;
+    tcpSegment* s;
+    uint8_t* p;
+    uint16_t offset = 5, length = 0;
+    uint8_t i;
+
+    for (i = 0; i < count; i++)
+        length += data[i].size;
+    if ((flags & (TCP_SYN | TCP_FIN)) != 0)
+        length++;
+    if ((length > 0 && c->rtxCount == TCP_RTX_SEGMENTS) || (buffer = allocPacketBuffer()) == NULL)
+        return false;
+    if ((flags & TCP_SYN) != 0)
+    {
+        p = appendPacketBuffer(buffer, 4);
+        p[0] = 2;
+        p[1] = 4;
+        p[2] = (ETHER_MTU - 40) >> 8;
+        p[3] = (ETHER_MTU - 40) & 0xFF;
+        offset = 6;
+    }
+    for (i = 0; i < count; i++)
+    {
+        p = appendPacketBuffer(buffer, data[i].size);
+        memcpy(p, data[i].data, data[i].size);
+    }
+
+    if (length == 0)
+    {
+        if (c->state != TCP_SYN_SENT)
+        {
+            flags |= TCP_ACK;
+            tcpAckSent(c, true);
+        }
+        c->rcvWnd = tcpGetWindow();
+        tcpCounters.segmentsOut++;
+        return etherSendTcp(&c->header, buffer, htonl(c->sndMax), htonl(c->rcvNxt), (offset << 12) | flags,
+                            c->rcvWnd);
+    }
+
+    s = &c->rtx[(c->rtxHead + c->rtxCount) % TCP_RTX_SEGMENTS];
+    s->buffer = buffer;
+    if (c->rtxCount == 0)
+        s->seq = c->sndMax;
+    else
+        s->seq = c->rtx[(c->rtxHead + c->rtxCount - 1) % TCP_RTX_SEGMENTS].seq
+                 + c->rtx[(c->rtxHead + c->rtxCount - 1) % TCP_RTX_SEGMENTS].length;
+    s->length = length;
+    s->size = buffer->size;
+    s->flags = flags;
+    s->offset = offset;
+    // the timer also runs while the windows hold everything back, to probe them
+    if (c->rtxCount++ == 0)
+        c->rtxDeadline = getMillis() + c->rto;
+    tcpOutput(c, false);
+    return true;
+}
+
+// Sends the oldest unacknowledged segment again after TCP_DUP_ACKS duplicate acks,
+// and halves the congestion window (rfc 5681 fast retransmit)
+// Karn's rule: the rtt sample in progress is given up, since an ack could now be
+// for either copy
+void tcpFastRetransmit(tcpConnection* c)
+{
+    uint32_t flight = c->sndNxt - c->sndUna;
+    uint16_t mss = tcpGetMss(c);
+
+    c->ssthresh = (flight / 2 > 2 * mss) ? flight / 2 : 2 * mss;
+    c->cwnd = c->ssthresh;
+    c->flags &= ~TCP_RTT_TIMING;
+    c->retransmits++;
+    c->fastRetransmits++;
+    tcpCounters.retransmits++;
+    tcpCounters.fastRetransmits++;
+    tcpTransmit(c, &c->rtx[c->rtxHead]);
+}
+
+// Folds an rtt sample (ms) into srtt and rttvar and sets the rto (rfc 6298, Jacobson/Karels)
+void tcpUpdateRtt(tcpConnection* c, uint32_t rtt)
+{
+    int32_t delta;
+    uint32_t rto;
+
+    if (rtt == 0)
+        rtt = 1;
+    if (c->srtt == 0)
+    {
+        c->srtt = rtt << 3;
+        c->rttvar = rtt << 1;
+    }
+    else
+    {
+        // srtt += (rtt - srtt) / 8 and rttvar += (|rtt - srtt| - rttvar) / 4, on the scaled values
+        delta = (int32_t)rtt - (int32_t)(c->srtt >> 3);
+        c->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        c->rttvar += delta - (c->rttvar >> 2);
+    }
+    rto = (c->srtt >> 3) + ((c->rttvar > 1) ? c->rttvar : 1);
+    if (rto < TCP_MIN_RTO)
+        rto = TCP_MIN_RTO;
+    if (rto > TCP_MAX_RTO)
+        rto = TCP_MAX_RTO;
+    c->rto = rto;
+}
+
+// Takes in an ack that moves sndUna forward: times the segment being timed, frees
+// the segments now fully acked, opens the congestion window (slow start below
+// ssthresh, then about a segment per rtt), and restarts the retransmission timer
+// Returns the number of sequence numbers acked
+uint32_t tcpAckSegments(tcpConnection* c, uint32_t ack)
+{
+    tcpSegment* s;
+    uint32_t acked = ack - c->sndUna;
+    uint16_t mss = tcpGetMss(c);
+
+    if ((c->flags & TCP_RTT_TIMING) != 0 && (int32_t)(ack - c->rttSeq) > 0)
+    {
+        c->flags &= ~TCP_RTT_TIMING;
+        tcpUpdateRtt(c, getMillis() - c->rttStart);
+    }
+    while (c->rtxCount > 0)
+    {
+        s = &c->rtx[c->rtxHead];
+        if ((int32_t)(ack - (s->seq + s->length)) < 0)
+            break;
+        freePacketBuffer(s->buffer);
+        c->rtxHead = (c->rtxHead + 1) % TCP_RTX_SEGMENTS;
+        c->rtxCount--;
+    }
+    c->sndUna = ack;
+    if ((int32_t)(c->sndNxt - ack) < 0)
+        c->sndNxt = ack;
+
+    if (c->cwnd < c->ssthresh)
+        c->cwnd += (acked < mss) ? acked : mss;
+    else
+        c->cwnd += (mss * mss / c->cwnd > 0) ? mss * mss / c->cwnd : 1;
+    if (c->cwnd > TCP_MAX_CWND)
+        c->cwnd = TCP_MAX_CWND;
+
+    c->backoff = 0;
+    c->dupAcks = 0;
+    if (c->rtxCount > 0)
+        c->rtxDeadline = getMillis() + c->rto;
+    return acked;
+}
+
+// Holds data that arrived past a gap at rcvNxt until the gap is filled
+// Where it overlaps data already held, the bytes that arrived first are kept, and
+// a segment that would have to be split keeps only its front; data past the window,
+// or that does not fit the TCP_OOO_SEGMENTS and TCP_OOO_BUDGET limits, is left for
+// the peer to send again
+// Returns true if any of it was kept
+bool tcpHoldSegment(tcpConnection* c, uint32_t seq, const uint8_t data[], uint16_t size)
+{
+    packetBuffer* buffer;
+    packetPoolStats pool;
+    uint32_t end = seq + size;
+    uint32_t windowEnd = c->rcvNxt + c->rcvWnd;
+    uint32_t heldEnd;
+    uint8_t i;
+
+    if ((int32_t)(seq - windowEnd) >= 0)
+        return false;
+    if ((int32_t)(end - windowEnd) > 0)
+        end = windowEnd;
+    for (i = 0; i < c->heldCount; i++)
+    {
+        heldEnd = c->held[i].seq + c->held[i].size;
+        if ((int32_t)(heldEnd - seq) <= 0)
+            continue;
+        if ((int32_t)(c->held[i].seq - end) >= 0)
+            break;
+        if ((int32_t)(c->held[i].seq - seq) > 0)
+        {
+            end = c->held[i].seq;
+            break;
+        }
+        if ((int32_t)(heldEnd - end) >= 0)
+            return false;
+        data += heldEnd - seq;
+        seq = heldEnd;
+    }
+    size = end - seq;
+
+    getPacketPoolStats(&pool);
+    if (c->heldCount == TCP_OOO_SEGMENTS || c->heldBytes + size > TCP_OOO_BUDGET
+        || pool.inUse + TCP_OOO_SPARE >= PACKET_BUFFERS || (buffer = allocPacketBuffer()) == NULL)
+        return false;
+    memcpy(appendPacketBuffer(buffer, size), data, size);
+    memmove(&c->held[i + 1], &c->held[i], (c->heldCount - i) * sizeof(tcpHeld));
+    c->held[i].buffer = buffer;
+    c->held[i].seq = seq;
+    c->held[i].size = size;
+    c->heldCount++;
+    c->heldBytes += size;
+    return true;
+}
+
+// Passes on the held data that in-order data has made contiguous, skipping any
+// bytes the in-order data already covered
+// Each segment is unlinked before the callback, which may close the connection
+void tcpDeliverHeld(tcpConnection* c, uint8_t index)
+{
+    tcpHeld h;
+    uint32_t skip;
+
+    while (c->heldCount > 0 && (int32_t)(c->held[0].seq - c->rcvNxt) <= 0)
+    {
+        h = c->held[0];
+        c->heldCount--;
+        c->heldBytes -= h.size;
+        memmove(&c->held[0], &c->held[1], c->heldCount * sizeof(tcpHeld));
+        skip = c->rcvNxt - h.seq;
+        if (skip < h.size)
+        {
+            c->rcvNxt += h.size - skip;
+            c->ackBytes += h.size - skip;
+            if (c->callback != NULL)
+                c->callback(index, TCP_EVENT_DATA, h.buffer->data + skip, h.size - skip);
+        }
+        freePacketBuffer(h.buffer);
+        if (c->state == TCP_CLOSED)
+            break;
+    }
+}
+
+// Answers a segment that belongs to no connection with a reset (rfc 793 p. 36)
+void tcpSendReset(etherPacket* packet, uint32_t seq, uint32_t ack, uint8_t flags, uint16_t size)
+{
+    etherFrame* ether = (etherFrame*)packet->frame;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    packetBuffer* buffer;
+    uint8_t localIp[IP_ADD_LENGTH];
+
+    if ((flags & TCP_RST) != 0 || (buffer = allocPacketBuffer()) == NULL)
+        return;
+    if ((flags & TCP_SYN) != 0)
+        size++;
+    if ((flags & TCP_FIN) != 0)
+        size++;
+    if ((flags & TCP_ACK) != 0)
+        etherPrependTcp(buffer, packet->destPort, packet->sourcePort, htonl(ack), 0, 0x5000 | TCP_RST, 0);
+    else
+        etherPrependTcp(buffer, packet->destPort, packet->sourcePort, 0, htonl(seq + size),
+                        0x5000 | TCP_RST | TCP_ACK, 0);
+    etherGetIpAddress(localIp);
+    etherPrependIp(buffer, 0x06, localIp, ip->sourceIp);
+    etherPrependEther(buffer, ether->sourceAddress, 0x0800);
+    etherSendBuffer(buffer);
+    tcpCounters.resets++;
+}
+
+// Opens a connection to remoteIp (active open) from a free local port
+// callback hears TCP_EVENT_CONNECTED once the handshake completes
+// Returns the connection, or TCP_NONE if the table is full
+uint8_t tcpOpen(const uint8_t remoteIp[], uint16_t remotePort, _tcpCallback callback)
+{
+    tcpConnection* c;
+    uint8_t index;
+
+    do
+    {
+        if (++tcpNextPort == 0)
+            tcpNextPort = 49152;
+    }
+    while (tcpIsLocalPort(tcpNextPort));
+    index = tcpAdd(remoteIp, remotePort, tcpNextPort, callback);
+    if (index == TCP_NONE)
+        return TCP_NONE;
+    c = &tcpTable[index];
+    c->state = TCP_SYN_SENT;
+    c->timer = TCP_CONNECT_TIMEOUT;
+    if (!tcpSendSegment(c, TCP_SYN, NULL, 0))
+    {
+        tcpRemove(index);
+        return TCP_NONE;
+    }
+    tcpCounters.opened++;
+    return index;
+}
+
+// Accepts connections to port (passive open); each one is handed to callback,
+// which hears TCP_EVENT_CONNECTED once its handshake completes
+// Returns false if every listener is in use
+bool tcpListen(uint16_t port, _tcpCallback callback)
+{
+    uint8_t i;
+    for (i = 0; i < TCP_LISTENERS; i++)
+    {
+        if (tcpListeners[i].port == 0 || tcpListeners[i].port == port)
+        {
+            tcpListeners[i].port = port;
+            tcpListeners[i].callback = callback;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sends data on a connection, split into segments of the mss
+bool tcpSend(uint8_t connection, const uint8_t data[], uint16_t size)
+{
+    etherSpan span;
+    span.data = data;
+    span.size = size;
+    return tcpSendSpans(connection, &span, 1);
+}
+
+// Sends data given as spans (up to ETHER_MAX_SPANS - 1) on a connection, split
+// into segments of the mss; the spans are copied, so they can be reused on return
+// Returns false if the connection cannot send, or there is no room on the
+// retransmission queue for all of the data (nothing is sent then), or the pool
+// ran out part way
+bool tcpSendSpans(uint8_t connection, const etherSpan data[], uint8_t count)
+{
+    tcpConnection* c;
+    etherSpan spans[ETHER_MAX_SPANS];
+    uint32_t total = 0, offset = 0;
+    uint16_t mss, n;
+    uint8_t i, used;
+
+    if (connection >= TCP_CONNECTIONS || count >= ETHER_MAX_SPANS)
+        return false;
+    c = &tcpTable[connection];
+    if (c->state != TCP_ESTABLISHED && c->state != TCP_CLOSE_WAIT)
+        return false;
+    for (i = 0; i < count; i++)
+        total += data[i].size;
+    mss = tcpGetMss(c);
+    if (c->rtxCount + (total + mss - 1) / mss > TCP_RTX_SEGMENTS)
+        return false;
+    while (offset < total)
+    {
+        n = (total - offset > mss) ? mss : total - offset;
+        used = etherSliceSpans(data, count, offset, n, spans);
+        if (!tcpSendSegment(c, TCP_PSH, spans, used))
+            return false;
+        offset += n;
+    }
+    return true;
+}
+
+// Closes the sending side of a connection with a fin; the block is freed once
+// both sides are done
+void tcpClose(uint8_t connection)
+{
+    tcpConnection* c;
+
+    if (connection >= TCP_CONNECTIONS)
+        return;
+    c = &tcpTable[connection];
+    if (c->state == TCP_SYN_SENT)
+        tcpRemove(connection);
+    else if ((c->state == TCP_SYN_RECEIVED || c->state == TCP_ESTABLISHED || c->state == TCP_CLOSE_WAIT)
+             && tcpSendSegment(c, TCP_FIN, NULL, 0))
+    {
+        c->state = (c->state == TCP_CLOSE_WAIT) ? TCP_LAST_ACK : TCP_FIN_WAIT_1;
+    }
+}
+
+// Resets a connection and frees it at once
+void tcpAbort(uint8_t connection)
+{
+    tcpConnection* c;
+
+    if (connection >= TCP_CONNECTIONS)
+        return;
+    c = &tcpTable[connection];
+    if (c->state == TCP_CLOSED)
+        return;
+    if (c->state != TCP_SYN_SENT)
+        tcpSendSegment(c, TCP_RST, NULL, 0);
+    tcpRemove(connection);
+}
+
+// Limits a connection to one segment in flight, as a baseline for the windowed sender
+void tcpSetStopAndWait(uint8_t connection, bool enable)
+{
+    if (connection >= TCP_CONNECTIONS)
+        return;
+    if (enable)
+        tcpTable[connection].flags |= TCP_STOP_AND_WAIT;
+    else
+        tcpTable[connection].flags &= ~TCP_STOP_AND_WAIT;
+}
+
+uint8_t tcpGetState(uint8_t connection)
+{
+    if (connection >= TCP_CONNECTIONS)
+        return TCP_CLOSED;
+    return tcpTable[connection].state;
+}
+
+// Determines whether segments to port have a listener or connection, so the
+// receive filter can drop the rest before they are read
+bool tcpIsLocalPort(uint16_t port)
+{
+    uint8_t i;
+    for (i = 0; i < TCP_LISTENERS; i++)
+        if (tcpListeners[i].port == port)
+            return true;
+    for (i = 0; i < TCP_CONNECTIONS; i++)
+        if (tcpTable[i].state != TCP_CLOSED && tcpTable[i].localPort == port)
+            return true;
+    return false;
+}
+
+// Reads the mss option of a syn
+void tcpParseOptions(tcpConnection* c, const uint8_t options[], uint16_t size)
+{
+    uint16_t i = 0;
+    while (i < size && options[i] != 0)
+    {
+        if (options[i] == 1)
+            i++;
+        else if (i + 1 >= size || options[i + 1] < 2)
+            return;
+        else
+        {
+            if (options[i] == 2 && options[i + 1] == 4 && i + 4 <= size)
+                c->sndMss = (options[i + 2] << 8) | options[i + 3];
+            i += options[i + 1];
+        }
+    }
+}
+
+// Starts a connection for a syn to a listening port
+void tcpAccept(etherPacket* packet, tcpListener* listener, uint32_t seq)
+{
+    etherFrame* ether = (etherFrame*)packet->frame;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpConnection* c;
+    uint8_t index;
+
+    index = tcpAdd(ip->sourceIp, packet->sourcePort, packet->destPort, listener->callback);
+    if (index == TCP_NONE)
+        return;
+    c = &tcpTable[index];
+    c->state = TCP_SYN_RECEIVED;
+    c->timer = TCP_CONNECT_TIMEOUT;
+    c->irs = seq;
+    c->rcvNxt = seq + 1;
+    tcpParseOptions(c, packet->frame + packet->l4Offset + 20, packet->payloadOffset - packet->l4Offset - 20);
+    if (!tcpSendSegment(c, TCP_SYN, NULL, 0))
+    {
+        // the peer sends its syn again
+        tcpRemove(index);
+        return;
+    }
+    tcpCounters.accepted++;
+}
+
+// Handles a tcp segment to this ip with a good checksum (rfc 793 segment arrives)
+// The segment is matched to its connection by 4-tuple; in-order data and the
+// peer's fin are passed to the connection's callback
+// Data already taken in is trimmed off; data past a gap is held until the gap is
+// filled and answered with a duplicate ack; other segments that are not the next
+// expected are acknowledged and dropped
+void tcpInput(etherPacket* packet)
+{
+    etherFrame* ether = (etherFrame*)packet->frame;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    tcpFrame* tcp = (tcpFrame*)(packet->frame + packet->l4Offset);
+    const uint8_t* data = packet->frame + packet->payloadOffset;
+    uint16_t size = 14 + ntohs(ip->length) - packet->payloadOffset;
+    uint8_t flags = ntohs(packet->tcpFlags) & 0x3F;
+    uint32_t seq = htonl(tcp->seq_no);
+    uint32_t ack = htonl(tcp->ack_no);
+    tcpConnection* c;
+    uint16_t acked = 0, n;
+    uint8_t index, i;
+    bool finAcked;
+
+    tcpCounters.segmentsIn++;
+    index = tcpFind(ip->sourceIp, packet->sourcePort, packet->destPort);
+    if (index == TCP_NONE)
+    {
+        if ((flags & (TCP_SYN | TCP_ACK | TCP_RST)) == TCP_SYN)
+        {
+            for (i = 0; i < TCP_LISTENERS; i++)
+            {
+                if (tcpListeners[i].port != 0 && tcpListeners[i].port == packet->destPort)
+                {
+                    tcpAccept(packet, &tcpListeners[i], seq);
+                    return;
+                }
+            }
+        }
+        tcpSendReset(packet, seq, ack, flags, size);
+        return;
+    }
+    c = &tcpTable[index];
+
+    if (c->state == TCP_SYN_SENT)
+    {
+        if ((flags & TCP_ACK) != 0 && ack != c->iss + 1)
+        {
+            tcpSendReset(packet, seq, ack, flags, size);
+            return;
+        }
+        if ((flags & TCP_RST) != 0)
+        {
+            if ((flags & TCP_ACK) != 0)
+                tcpDrop(index, TCP_EVENT_ABORTED);
+            return;
+        }
+        if ((flags & TCP_SYN) == 0)
+            return;
+        c->irs = seq;
+        c->rcvNxt = seq + 1;
+        tcpParseOptions(c, packet->frame + packet->l4Offset + 20, packet->payloadOffset - packet->l4Offset - 20);
+        if ((flags & TCP_ACK) != 0)
+        {
+            tcpAckSegments(c, ack);
+            c->sndWnd = ntohs(tcp->win_size);
+            c->cwnd = tcpGetInitialWindow(tcpGetMss(c));
+            c->state = TCP_ESTABLISHED;
+            c->timer = 0;
+            tcpSendSegment(c, 0, NULL, 0);
+            if (c->callback != NULL)
+                c->callback(index, TCP_EVENT_CONNECTED, NULL, 0);
+        }
+        else
+        {
+            // simultaneous open; the queued syn goes again, now with an ack
+            c->state = TCP_SYN_RECEIVED;
+            tcpTransmit(c, &c->rtx[c->rtxHead]);
+        }
+        return;
+    }
+
+    // a segment that starts with data already taken in, e.g. a resend that was
+    // cut up differently, keeps only the new data (and fin)
+    if ((flags & (TCP_SYN | TCP_RST)) == 0 && (int32_t)(seq - c->rcvNxt) < 0
+        && (int32_t)(seq + size + (flags & TCP_FIN) - c->rcvNxt) > 0)
+    {
+        n = c->rcvNxt - seq;
+        data += n;
+        size -= n;
+        seq = c->rcvNxt;
+        tcpCounters.trimmed++;
+    }
+
+    // only the next expected segment is taken; a reset must match it exactly
+    // (rfc 5961), and anything else just gets the expected sequence number back
+    // Data past a gap is held first, and the duplicate ack tells the peer where
+    // the gap is, so a few of them bring a fast retransmit; a fin on it is not
+    // kept and comes again with the peer's resend
+    if (seq != c->rcvNxt)
+    {
+        if (c->state == TCP_SYN_RECEIVED && (flags & TCP_SYN) != 0 && seq == c->irs)
+        {
+            // our syn-ack was lost
+            tcpTransmit(c, &c->rtx[c->rtxHead]);
+        }
+        else if ((flags & TCP_RST) == 0 || (int32_t)(seq - c->rcvNxt) > 0)
+        {
+            if (size > 0 && (flags & (TCP_SYN | TCP_RST)) == 0 && (int32_t)(seq - c->rcvNxt) > 0
+                && (c->state == TCP_ESTABLISHED || c->state == TCP_FIN_WAIT_1 || c->state == TCP_FIN_WAIT_2)
+                && tcpHoldSegment(c, seq, data, size))
+                tcpCounters.held++;
+            else
+                tcpCounters.dropped++;
+            tcpSendSegment(c, 0, NULL, 0);
+            return;
+        }
+        tcpCounters.dropped++;
+        return;
+    }
+    if ((flags & TCP_RST) != 0)
+    {
+        tcpDrop(index, TCP_EVENT_ABORTED);
+        return;
+    }
+    if ((flags & TCP_SYN) != 0)
+    {
+        // a syn inside the window gets a challenge ack (rfc 5961)
+        tcpSendSegment(c, 0, NULL, 0);
+        return;
+    }
+    if ((flags & TCP_ACK) == 0)
+        return;
+
+    // acknowledgment
+    if ((int32_t)(ack - c->sndMax) > 0)
+    {
+        tcpSendSegment(c, 0, NULL, 0);
+        tcpCounters.dropped++;
+        return;
+    }
+    if (c->state == TCP_SYN_RECEIVED)
+    {
+        if (ack != c->iss + 1)
+        {
+            tcpSendReset(packet, seq, ack, flags, size);
+            return;
+        }
+        tcpAckSegments(c, ack);
+        c->sndWnd = ntohs(tcp->win_size);
+        c->cwnd = tcpGetInitialWindow(tcpGetMss(c));
+        c->state = TCP_ESTABLISHED;
+        c->timer = 0;
+        if (c->callback != NULL)
+            c->callback(index, TCP_EVENT_CONNECTED, NULL, 0);
+        if (c->state == TCP_CLOSED)
+            return;
+    }
+    if ((int32_t)(ack - c->sndUna) > 0)
+        acked = tcpAckSegments(c, ack);
+    else if (ack == c->sndUna && size == 0 && (flags & (TCP_SYN | TCP_FIN)) == 0 && c->sndNxt != c->sndUna
+             && ntohs(tcp->win_size) == c->sndWnd && ++c->dupAcks == TCP_DUP_ACKS)
+        tcpFastRetransmit(c);
+    if (ack == c->sndUna)
+    {
+        c->sndWnd = ntohs(tcp->win_size);
+        // the peer is there, only its window is closed
+        if (c->sndWnd == 0)
+            c->backoff = 0;
+    }
+    tcpOutput(c, false);
+    if (acked > 0 && (c->state == TCP_ESTABLISHED || c->state == TCP_CLOSE_WAIT) && c->callback != NULL)
+    {
+        c->callback(index, TCP_EVENT_SENT, NULL, acked);
+        if (c->state == TCP_CLOSED)
+            return;
+    }
+    finAcked = c->rtxCount == 0;
+    if (c->state == TCP_FIN_WAIT_1 && finAcked)
+        c->state = TCP_FIN_WAIT_2;
+    else if (c->state == TCP_CLOSING && finAcked)
+    {
+        c->state = TCP_TIME_WAIT_STATE;
+        c->timer = TCP_TIME_WAIT;
+    }
+    else if (c->state == TCP_LAST_ACK && finAcked)
+    {
+        tcpRemove(index);
+        return;
+    }
+
+    // data and fin
+    // data is acked once TCP_ACK_SEGMENTS full-size segments are in, or after
+    // TCP_DELAYED_ACK, unless something is sent first to carry the ack, e.g. the
+    // callback's answer; data at a gap is acked at once (rfc 5681), with the held
+    // data it makes contiguous
+    // Full size is the largest segment the peer has sent, so a peer on a smaller
+    // mtu than this link still gets an ack every other segment
+    if (size > 0 && (c->state == TCP_ESTABLISHED || c->state == TCP_FIN_WAIT_1 || c->state == TCP_FIN_WAIT_2))
+    {
+        c->rcvNxt += size;
+        c->ackBytes += size;
+        c->ackSegments++;
+        if (size > c->rcvMss)
+            c->rcvMss = size;
+        if (c->ackBytes >= TCP_ACK_SEGMENTS * c->rcvMss)
+            c->flags |= TCP_ACK_NOW;
+        else if ((c->flags & TCP_ACK_DELAYED) == 0)
+        {
+            c->flags |= TCP_ACK_DELAYED;
+            c->ackDeadline = getMillis() + TCP_DELAYED_ACK;
+        }
+        if (c->callback != NULL)
+            c->callback(index, TCP_EVENT_DATA, data, size);
+        if (c->state == TCP_CLOSED)
+            return;
+        if (c->heldCount > 0)
+        {
+            c->flags |= TCP_ACK_NOW;
+            tcpDeliverHeld(c, index);
+            if (c->state == TCP_CLOSED)
+                return;
+        }
+    }
+    if ((flags & TCP_FIN) != 0 && c->state != TCP_CLOSE_WAIT && c->state != TCP_LAST_ACK
+        && c->state != TCP_CLOSING && c->state != TCP_TIME_WAIT_STATE)
+    {
+        c->rcvNxt++;
+        c->flags |= TCP_ACK_NOW;
+        if (c->state == TCP_ESTABLISHED)
+        {
+            c->state = TCP_CLOSE_WAIT;
+            tcpSendSegment(c, 0, NULL, 0);
+            if (c->callback != NULL)
+                c->callback(index, TCP_EVENT_CLOSED, NULL, 0);
+            return;
+        }
+        else if (c->state == TCP_FIN_WAIT_1)
+            c->state = TCP_CLOSING;
+        else
+        {
+            c->state = TCP_TIME_WAIT_STATE;
+            c->timer = TCP_TIME_WAIT;
+        }
+    }
+
+    // the callback may have sent data, which carried the ack already
+    if ((c->flags & TCP_ACK_NOW) != 0)
+        tcpSendSegment(c, 0, NULL, 0);
+}
+
+// Times out handshakes and time-wait; call once a second from the main loop
+void tcpTick()
+{
+    tcpConnection* c;
+    uint8_t i;
+
+    tcpIssClock += 250000;
+    for (i = 0; i < TCP_CONNECTIONS; i++)
+    {
+        c = &tcpTable[i];
+        if (c->state != TCP_CLOSED && c->timer > 0 && --c->timer == 0)
+        {
+            if (c->state == TCP_TIME_WAIT_STATE)
+                tcpRemove(i);
+            else
+            {
+                if (c->state == TCP_SYN_RECEIVED)
+                    tcpSendSegment(c, TCP_RST, NULL, 0);
+                tcpDrop(i, TCP_EVENT_ABORTED);
+            }
+        }
+    }
+}
+
+// Runs the delayed ack and retransmission timers; call from the main loop on every pass
+// Each time the rto runs out it doubles, the congestion window drops to one segment,
+// and sending starts over from the oldest unacknowledged segment (or, with nothing
+// in flight, the next segment probes the peer's closed window)
+// After TCP_MAX_RETRIES timeouts in a row the connection is reset
+void tcpPoll()
+{
+    tcpConnection* c;
+    uint32_t now = getMillis(), flight;
+    uint16_t mss;
+    uint8_t i;
+
+    for (i = 0; i < TCP_CONNECTIONS; i++)
+    {
+        c = &tcpTable[i];
+        if (c->state == TCP_CLOSED)
+            continue;
+        if ((c->flags & TCP_ACK_DELAYED) != 0 && (int32_t)(now - c->ackDeadline) >= 0)
+            tcpSendSegment(c, 0, NULL, 0);
+        if (c->rtxCount == 0 || (int32_t)(now - c->rtxDeadline) < 0)
+            continue;
+        if (++c->backoff > TCP_MAX_RETRIES)
+        {
+            tcpCounters.timeouts++;
+            if (c->state != TCP_SYN_SENT)
+                tcpSendSegment(c, TCP_RST, NULL, 0);
+            tcpDrop(i, TCP_EVENT_ABORTED);
+            continue;
+        }
+        c->rto = (c->rto > TCP_MAX_RTO / 2) ? TCP_MAX_RTO : c->rto * 2;
+        c->rtxDeadline = now + c->rto;
+        if (c->sndNxt != c->sndUna)
+        {
+            flight = c->sndNxt - c->sndUna;
+            mss = tcpGetMss(c);
+            c->ssthresh = (flight / 2 > 2 * mss) ? flight / 2 : 2 * mss;
+            c->cwnd = mss;
+            c->sndNxt = c->sndUna;
+            c->flags &= ~TCP_RTT_TIMING;
+        }
+        tcpOutput(c, true);
+    }
+}
+
+// Copies connection index of the table, for display
+// Returns false if index is past the table or the block is not in use
+bool getTcpConnection(uint8_t index, tcpConnection* connection)
+{
+    if (index >= TCP_CONNECTIONS)
+        return false;
+    *connection = tcpTable[index];
+    return connection->state != TCP_CLOSED;
+}
+
+void getTcpStats(tcpStats* stats)
+{
+    *stats = tcpCounters;
+}
@@ -0,0 +1,189 @@
+// TCP Library
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: EK-TM4C123GXL w/ ENC28J60
+// Target uC:       TM4C123GH6PM
+// System Clock:    -
+
+// Hardware configuration:
+// None (sends through eth0)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef TCP_H_
+#define TCP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "eth0.h"
+
+#define TCP_CONNECTIONS     4       // connection blocks, up to 254
+#define TCP_BUCKETS         8       // hash buckets, a power of 2
+#define TCP_LISTENERS       2       // ports open for passive opens
+#define TCP_NONE            0xFF
+#define TCP_RX_FRAME        (6 + 14 + ETHER_MTU + 4)    // receive ring bytes a full-size segment takes
+#define TCP_DEFAULT_MSS     536     // send mss if the peer gives none (rfc 879)
+#define TCP_CONNECT_TIMEOUT 10      // seconds for the handshake to complete
+#define TCP_TIME_WAIT       4       // seconds; far short of 2 msl so the table does not fill up
+#define TCP_RTX_SEGMENTS    4       // unacknowledged segments held per connection
+#define TCP_INITIAL_RTO     1000    // ms, until the first rtt sample (rfc 6298)
+#define TCP_MIN_RTO         200     // ms
+#define TCP_MAX_RTO         60000   // ms
+#define TCP_MAX_RETRIES     8       // timeouts in a row before the connection is aborted
+#define TCP_DUP_ACKS        3       // duplicate acks that trigger a fast retransmit
+#define TCP_MAX_CWND        0xFFFF  // no window scaling, so the peer never offers more
+#define TCP_DELAYED_ACK     200     // ms an ack may wait for data to ride on (rfc 1122 allows 500)
+#define TCP_ACK_SEGMENTS    2       // full-size segments taken in that are acked at once
+#define TCP_OOO_SEGMENTS    2       // out-of-order segments held per connection
+#define TCP_OOO_BUDGET      (2 * (ETHER_MTU - 40))  // bytes they may hold between them
+#define TCP_OOO_SPARE       2       // pool buffers they leave free for sending
+
+// States (rfc 793)
+#define TCP_CLOSED          0
+#define TCP_LISTEN          1
+#define TCP_SYN_SENT        2
+#define TCP_SYN_RECEIVED    3
+#define TCP_ESTABLISHED     4
+#define TCP_FIN_WAIT_1      5
+#define TCP_FIN_WAIT_2      6
+#define TCP_CLOSE_WAIT      7
+#define TCP_CLOSING         8
+#define TCP_LAST_ACK        9
+#define TCP_TIME_WAIT_STATE 10
+
+// Segment flags, as in the low byte of the offset and flags word
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+#define TCP_PSH             0x08
+#define TCP_ACK             0x10
+
+// Events passed to a connection's callback
+#define TCP_EVENT_CONNECTED 0       // handshake done (opened or accepted)
+#define TCP_EVENT_DATA      1       // in-order data arrived
+#define TCP_EVENT_CLOSED    2       // the peer has no more data; call tcpClose when done
+#define TCP_EVENT_ABORTED   3       // reset or timed out; the connection is gone
+#define TCP_EVENT_SENT      4       // size bytes were acked, so there is room to send more
+
+// Connection block flags
+#define TCP_ACK_NOW         0x01    // an ack is owed and no segment has carried it yet
+#define TCP_RTT_TIMING      0x02    // the segment at rttSeq is being timed
+#define TCP_STOP_AND_WAIT   0x04    // one segment in flight at a time, for comparison
+#define TCP_ACK_DELAYED     0x08    // an ack is owed but may wait until ackDeadline
+
+typedef void (*_tcpCallback)(uint8_t connection, uint8_t event, const uint8_t data[], uint16_t size);
+
+// Segment waiting to be sent or acknowledged
+// The buffer holds the options and data after the standard headroom; fresh headers
+// are put in front each time it is sent
+typedef struct _tcpSegment
+{
+    packetBuffer* buffer;           // one reference is held until the segment is acked
+    uint32_t seq;
+    uint16_t length;                // sequence space used, counting a syn or fin
+    uint16_t size;                  // bytes of options and data in the buffer
+    uint8_t flags;                  // syn, fin, or psh; ack is added when sent
+    uint8_t offset;                 // header size in words
+} tcpSegment;
+
+// Out-of-order data, held in a pool buffer until the gap before it is filled
+typedef struct _tcpHeld
+{
+    packetBuffer* buffer;           // the data starts at buffer->data
+    uint32_t seq;
+    uint16_t size;
+} tcpHeld;
+
+// Connection block
+// Sequence numbers are kept in host order
+// Segments from sndUna to sndNxt are in flight; sndNxt goes back to sndUna when the
+// retransmission timer runs out, and sndMax keeps the highest sent
+// srtt and rttvar are kept scaled by 8 and 4 as in 4.3bsd, so the smoothing needs no division
+typedef struct _tcpConnection
+{
+    uint8_t state;
+    uint8_t flags;
+    uint8_t remoteIp[4];
+    uint16_t remotePort;
+    uint16_t localPort;
+    uint32_t iss;
+    uint32_t sndUna;                // oldest unacknowledged sequence number
+    uint32_t sndNxt;                // next sequence number to send
+    uint32_t sndMax;                // highest sequence number sent, plus one
+    uint16_t sndWnd;                // window the peer last advertised
+    uint32_t cwnd;                  // congestion window (rfc 5681)
+    uint32_t ssthresh;
+    uint16_t sndMss;                // largest segment the peer accepts
+    uint32_t irs;
+    uint32_t rcvNxt;                // next sequence number expected
+    uint16_t rcvWnd;                // window last advertised
+    uint16_t rcvMss;                // largest data segment the peer has sent, as its mss
+    uint16_t ackBytes;              // data taken in since the last ack went out
+    uint16_t ackSegments;           // data segments taken in since then
+    uint32_t ackDeadline;           // getMillis() when a delayed ack must go
+    uint32_t acksSaved;             // ack frames not sent, next to one per data segment
+    uint8_t heldCount;
+    uint16_t heldBytes;
+    tcpHeld held[TCP_OOO_SEGMENTS];  // in sequence order and not overlapping, all past rcvNxt
+    uint16_t timer;                 // seconds left for the handshake or time-wait, 0 if off
+    uint32_t srtt;                  // smoothed rtt in ms times 8, or 0 before the first sample
+    uint32_t rttvar;                // rtt variation in ms times 4
+    uint16_t rto;                   // ms
+    uint32_t rttSeq;                // sequence number being timed
+    uint32_t rttStart;              // getMillis() when it was sent
+    uint32_t rtxDeadline;           // getMillis() when the oldest segment is sent again
+    uint8_t backoff;                // timeouts since the last new ack
+    uint8_t dupAcks;
+    uint8_t rtxHead;                // oldest unacknowledged segment
+    uint8_t rtxCount;
+    tcpSegment rtx[TCP_RTX_SEGMENTS];  // sent segments first, then any the windows hold back
+    uint32_t retransmits;           // timeouts and fast retransmits
+    uint32_t fastRetransmits;
+    uint8_t next;                   // next block in the same bucket, or in the free list
+    _tcpCallback callback;
+    etherTcpTemplate header;        // prebuilt headers for the 4-tuple
+} tcpConnection;
+
+typedef struct _tcpStats
+{
+    uint32_t segmentsIn;
+    uint32_t segmentsOut;
+    uint32_t opened;                // active opens
+    uint32_t accepted;              // passive opens
+    uint32_t resets;                // resets sent
+    uint32_t dropped;               // segments not acceptable in their connection's state
+    uint32_t full;                  // opens refused for want of a free block
+    uint32_t retransmits;
+    uint32_t fastRetransmits;
+    uint32_t timeouts;              // connections aborted after TCP_MAX_RETRIES
+    uint32_t acksSaved;
+    uint32_t held;                  // out-of-order segments kept until the gap was filled
+    uint32_t trimmed;               // segments cut down to the data not yet taken in
+} tcpStats;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+void initTcp();
+uint8_t tcpOpen(const uint8_t remoteIp[], uint16_t remotePort, _tcpCallback callback);
+bool tcpListen(uint16_t port, _tcpCallback callback);
+bool tcpSend(uint8_t connection, const uint8_t data[], uint16_t size);
+bool tcpSendSpans(uint8_t connection, const etherSpan data[], uint8_t count);
+void tcpClose(uint8_t connection);
+void tcpAbort(uint8_t connection);
+void tcpSetStopAndWait(uint8_t connection, bool enable);
+uint8_t tcpGetState(uint8_t connection);
+bool tcpIsLocalPort(uint16_t port);
+void tcpInput(etherPacket* packet);
+void tcpTick();
+void tcpPoll();
+bool getTcpConnection(uint8_t index, tcpConnection* connection);
+void getTcpStats(tcpStats* stats);
+
+#endif
@@ -0,0 +1,276 @@
+// Host Test Support
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None; the spi, gpio, uart, and timer functions the stack calls are stood in
+// for, and frames written to the ENC28J60 transmit buffer are captured
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "gpio.h"
+#include "spi0.h"
+#include "uart0.h"
+#include "wait.h"
+#include "timer.h"
+
+// Spi write states while watching for frames
+#define HOST_IDLE           0
+#define HOST_WBM            1       // write buffer memory opcode seen
+#define HOST_FRAME          2       // control byte seen, data is the frame
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+uint32_t hostMillis;
+uint32_t hostCycles;
+uint32_t hostFrameCount;
+uint8_t hostFrames[HOST_FRAMES][HOST_FRAME_SIZE];
+uint16_t hostFrameSizes[HOST_FRAMES];
+uint8_t hostSpiState = HOST_IDLE;
+uint8_t hostSpiOpcode;              // first byte of the current transaction
+uint8_t hostSpiCount;               // bytes written since chip select went low
+uint8_t hostEir;
+bool hostIntEnabled;
+uint32_t hostFailures;
+uint32_t hostPrimask;
+char hostUart[HOST_UART_SIZE];
+uint16_t hostUartSize;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Adds bytes written to buffer memory to the frame being captured
+// A frame starts with the per-packet control byte (0) right after the opcode;
+// other writes to buffer memory (e.g. patching a checksum) are ignored
+void hostCapture(const uint8_t data[], uint16_t size)
+{
+    uint8_t* frame;
+    uint16_t* frameSize;
+
+    if (hostSpiState == HOST_WBM && size == 1 && data[0] == 0)
+    {
+        hostFrameSizes[hostFrameCount % HOST_FRAMES] = 0;
+        hostFrameCount++;
+        hostSpiState = HOST_FRAME;
+        return;
+    }
+    if (hostSpiState != HOST_FRAME || data == NULL)
+        return;
+    frame = hostFrames[(hostFrameCount - 1) % HOST_FRAMES];
+    frameSize = &hostFrameSizes[(hostFrameCount - 1) % HOST_FRAMES];
+    if (*frameSize + size <= HOST_FRAME_SIZE)
+    {
+        memcpy(frame + *frameSize, data, size);
+        *frameSize += size;
+    }
+}
+
+// Returns frame index (counted from the start), or NULL if it is no longer kept
+uint8_t* hostGetFrame(uint32_t index, uint16_t* size)
+{
+    if (index >= hostFrameCount || hostFrameCount - index > HOST_FRAMES)
+        return NULL;
+    *size = hostFrameSizes[index % HOST_FRAMES];
+    return hostFrames[index % HOST_FRAMES];
+}
+
+// Returns the last frame sent, or NULL if there is none
+uint8_t* hostGetLastFrame(uint16_t* size)
+{
+    if (hostFrameCount == 0)
+        return NULL;
+    return hostGetFrame(hostFrameCount - 1, size);
+}
+
+void hostCheck(bool ok, const char* condition, const char* file, int line)
+{
+    if (!ok)
+    {
+        printf("%s:%d: check failed: %s\n", file, line, condition);
+        hostFailures++;
+    }
+}
+
+// Prints the result of a test program
+// Returns its exit code
+int hostReport(const char* name)
+{
+    printf("%s: %lu failures\n", name, (unsigned long)hostFailures);
+    return hostFailures == 0 ? 0 : 1;
+}
+
+// Stand-ins for the hardware
+// Registers read back as 0, so the controller is never busy and has no packets;
+// EIR is the exception and reads back hostEir
+
+void initSpi0(uint32_t pinMask)
+{
+}
+
+void setSpi0BaudRate(uint32_t clockRate, uint32_t fcyc)
+{
+}
+
+void setSpi0Mode(uint8_t polarity, uint8_t phase)
+{
+}
+
+// Follows the EIE and EIR register writes the interrupt handling depends on
+void writeSpi0Data(uint32_t data)
+{
+    hostSpiState = (data == 0x7A) ? HOST_WBM : HOST_IDLE;
+    if (hostSpiCount == 0)
+        hostSpiOpcode = data;
+    else if (hostSpiCount == 1)
+    {
+        if (hostSpiOpcode == 0x9B && (data & 0x80) != 0)        // set bits in EIE
+            hostIntEnabled = true;
+        if (hostSpiOpcode == 0xBB && (data & 0x80) != 0)        // clear bits in EIE
+            hostIntEnabled = false;
+        if (hostSpiOpcode == 0x5B)                              // write EIE
+            hostIntEnabled = (data & 0x80) != 0;
+        if (hostSpiOpcode == 0xBC)                              // clear bits in EIR
+            hostEir &= ~data;
+    }
+    hostSpiCount++;
+}
+
+uint32_t readSpi0Data()
+{
+    if (hostSpiOpcode == 0x1C && hostSpiCount == 2)             // read EIR
+        return hostEir;
+    return 0;
+}
+
+void writeSpi0Block(const uint8_t data[], uint16_t size)
+{
+    hostCapture(data, size);
+}
+
+void readSpi0Block(uint8_t data[], uint16_t size)
+{
+    memset(data, 0, size);
+}
+
+void initSpi0Dma()
+{
+}
+
+bool isSpi0DmaMode()
+{
+    return false;
+}
+
+bool isSpi0Busy()
+{
+    return false;
+}
+
+// Completes at once
+bool startSpi0Transfer(const uint8_t txData[], uint8_t rxData[], uint16_t size, _spi0Callback callback)
+{
+    hostCapture(txData, size);
+    if (rxData != NULL)
+        memset(rxData, 0, size);
+    if (callback != NULL)
+        callback();
+    return true;
+}
+
+void enablePort(PORT port)
+{
+}
+
+void selectPinPushPullOutput(PORT port, uint8_t pin)
+{
+}
+
+void selectPinDigitalInput(PORT port, uint8_t pin)
+{
+}
+
+void selectPinInterruptFallingEdge(PORT port, uint8_t pin)
+{
+}
+
+void enablePinInterrupt(PORT port, uint8_t pin)
+{
+}
+
+void clearPinInterrupt(PORT port, uint8_t pin)
+{
+}
+
+// A new spi transaction starts when chip select (PA3) goes low
+void setPinValue(PORT port, uint8_t pin, bool value)
+{
+    if (port == PORTA && pin == 3 && !value)
+        hostSpiCount = 0;
+}
+
+void waitMicrosecond(uint32_t us)
+{
+}
+
+// Interrupt masking for the pool and other shared state; hostPrimask is 1 while
+// interrupts would be off on the target
+uint32_t _disable_interrupts()
+{
+    uint32_t old = hostPrimask;
+    hostPrimask = 1;
+    return old;
+}
+
+void _restore_interrupts(uint32_t primask)
+{
+    hostPrimask = primask;
+}
+
+void hostClearUart()
+{
+    hostUartSize = 0;
+    hostUart[0] = 0;
+}
+
+void putcUart0(char c)
+{
+    if (hostUartSize + 1 < HOST_UART_SIZE)
+    {
+        hostUart[hostUartSize++] = c;
+        hostUart[hostUartSize] = 0;
+    }
+}
+
+void putsUart0(char* str)
+{
+    while (*str != 0)
+        putcUart0(*str++);
+}
+
+uint32_t getMillis()
+{
+    return hostMillis;
+}
+
+// Moves on by a little each call, so timed sections never come out as 0
+uint32_t getCycleCount()
+{
+    hostCycles += 40;
+    return hostCycles;
+}
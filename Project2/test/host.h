@@ -0,0 +1,51 @@
+// Host Test Support
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None; the spi, gpio, uart, and timer functions the stack calls are stood in
+// for, and frames written to the ENC28J60 transmit buffer are captured
+// Uart output is kept for the tests to look at rather than printed, since figures
+// such as cycle counts come from stand-ins and mean nothing on the host
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HOST_FRAMES         256     // captured frames kept, oldest overwritten first
+#define HOST_FRAME_SIZE     1600
+#define HOST_UART_SIZE      1024    // uart output kept; later output is dropped
+
+// Counts a failed check without stopping, so one run reports every failure
+#define CHECK(c) hostCheck((c), #c, __FILE__, __LINE__)
+
+extern uint32_t hostMillis;         // returned by getMillis; tests move it on
+extern uint32_t hostFrameCount;     // frames sent since the start
+extern uint32_t hostPrimask;        // 1 while the stack has interrupts off
+extern char hostUart[];             // uart output since the last hostClearUart, terminated
+extern uint8_t hostEir;             // flags the controller has latched, read back from EIR
+extern bool hostIntEnabled;         // EIE.INTIE as the stack last wrote it
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+uint8_t* hostGetFrame(uint32_t index, uint16_t* size);
+uint8_t* hostGetLastFrame(uint16_t* size);
+void hostClearUart();
+void hostCheck(bool ok, const char* condition, const char* file, int line);
+int hostReport(const char* name);
+
+#endif
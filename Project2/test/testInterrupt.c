@@ -0,0 +1,78 @@
+// Interrupt Mode Tests
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None (host.c stands in for the hardware)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "host.h"
+#include "eth0.h"
+
+// EIR flags, as in eth0.c
+#define RXERIF  0x01
+#define PKTIF   0x40
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+// etherInit waits on the controller, which the stand-ins cannot answer, so the
+// tests switch interrupt mode on directly
+extern bool intMode;
+extern volatile uint8_t pendingEvents;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Raises INT with the given flags latched in EIR, as the controller does
+void raiseInt(uint8_t flags)
+{
+    hostEir = flags;
+    hostIntEnabled = true;
+    etherIntIsr();
+    CHECK(!hostIntEnabled);
+}
+
+// An overflow with no packet waiting unmasks INT again once it is handled, or
+// no later event would ever interrupt
+void testOverflowOnly()
+{
+    raiseInt(RXERIF);
+    CHECK(!etherIsDataAvailable());
+    CHECK(etherIsOverflow());
+    CHECK(hostIntEnabled);
+    CHECK(hostEir == 0 && pendingEvents == 0);
+}
+
+// An overflow with a packet waiting leaves INT masked until the packet is read
+void testOverflowWithPacket()
+{
+    raiseInt(RXERIF | PKTIF);
+    CHECK(etherIsDataAvailable());
+    CHECK(etherIsOverflow());
+    CHECK(!hostIntEnabled);
+    CHECK(pendingEvents == PKTIF);
+    pendingEvents = 0;
+}
+
+int main()
+{
+    intMode = true;
+
+    testOverflowOnly();
+    testOverflowWithPacket();
+    return hostReport("interrupt");
+}
@@ -0,0 +1,200 @@
+// Reassembly Tests
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None (host.c stands in for the hardware)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "host.h"
+#include "eth0.h"
+#include "checksum.h"
+#include "reassembly.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const uint8_t local[4] = {192, 0, 2, 118};
+const uint8_t sender[4] = {192, 0, 2, 10};
+const uint8_t senderMac[6] = {0x02, 0, 0, 0, 0, 0x0A};
+
+uint8_t fragment[HOST_FRAME_SIZE];
+uint8_t datagram[REASM_MAX_SIZE];
+uint8_t reply[REASM_MAX_SIZE];
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Fills a datagram payload with a pattern that depends on the id
+void fillPayload(uint16_t id, uint16_t size)
+{
+    uint16_t i;
+    for (i = 0; i < size; i++)
+        datagram[i] = (uint8_t)(i * 7 + id);
+}
+
+// Builds the fragment of the datagram payload at offset and passes it to reassembly
+// Returns the reassembled frame once the datagram is complete
+uint8_t* sendFragment(uint16_t id, uint8_t protocol, uint16_t offset, uint16_t length,
+                      bool more, uint16_t* size)
+{
+    etherFrame* ether = (etherFrame*)fragment;
+    ipFrame* ip = (ipFrame*)&ether->data;
+
+    memset(ether->destAddress, 0x02, HW_ADD_LENGTH);
+    memcpy(ether->sourceAddress, senderMac, HW_ADD_LENGTH);
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->typeOfService = 0;
+    ip->length = htons(20 + length);
+    ip->id = htons(id);
+    ip->flagsAndOffset = htons((more ? 0x2000 : 0) | (offset / 8));
+    ip->ttl = 64;
+    ip->protocol = protocol;
+    memcpy(ip->sourceIp, sender, 4);
+    memcpy(ip->destIp, local, 4);
+    etherCalcIpChecksum(ip);
+    memcpy(fragment + 34, datagram + offset, length);
+    *size = 34 + length;
+    CHECK(etherIsIpFragment(fragment, *size));
+    return reassembleFragment(fragment, size);
+}
+
+// Returns true if frame holds the whole datagram payload of the given size
+bool holdsPayload(uint8_t* frame, uint16_t id, uint16_t size)
+{
+    ipFrame* ip = (ipFrame*)(frame + 14);
+    uint16_t i;
+    if (frame == NULL || ntohs(ip->length) != 20 + size || ip->flagsAndOffset != 0)
+        return false;
+    for (i = 0; i < size; i++)
+        if (frame[34 + i] != (uint8_t)(i * 7 + id))
+            return false;
+    return true;
+}
+
+// A datagram larger than the mtu, as a local sender fragments it, is put back together
+// and an echo request of that size is answered in fragments no larger than the mtu
+void testLargePing()
+{
+    icmpFrame* icmp = (icmpFrame*)datagram;
+    checksumContext csum;
+    uint8_t* frame;
+    uint8_t* sent;
+    ipFrame* ip;
+    uint32_t first;
+    uint16_t size, total = 3980, offset, length, id = 0x100;
+
+    fillPayload(id, total);
+    icmp->type = 8;
+    icmp->code = 0;
+    icmp->check = 0;
+    initChecksum(&csum);
+    addChecksumData(&csum, datagram, total);
+    icmp->check = getChecksum(&csum);
+
+    // last fragment first, then the rest
+    CHECK(sendFragment(id, 0x01, 2960, total - 2960, false, &size) == NULL);
+    CHECK(sendFragment(id, 0x01, 0, 1480, true, &size) == NULL);
+    frame = sendFragment(id, 0x01, 1480, 1480, true, &size);
+    CHECK(frame != NULL && size == 34 + total);
+    if (frame == NULL)
+        return;
+    CHECK(memcmp(frame + 34, datagram, total) == 0);
+
+    first = hostFrameCount;
+    etherSendPingResponse(frame);
+    CHECK(hostFrameCount - first == 3);
+    memset(reply, 0, sizeof(reply));
+    for (; first < hostFrameCount; first++)
+    {
+        sent = hostGetFrame(first, &size);
+        ip = (ipFrame*)(sent + 14);
+        CHECK(size <= 14 + ETHER_MTU);
+        CHECK(memcmp(ip->destIp, sender, 4) == 0);
+        offset = (ntohs(ip->flagsAndOffset) & 0x1FFF) * 8;
+        length = ntohs(ip->length) - 20;
+        if (offset + length <= total)
+            memcpy(reply + offset, sent + 34, length);
+    }
+    icmp = (icmpFrame*)reply;
+    CHECK(icmp->type == 0);
+    initChecksum(&csum);
+    addChecksumData(&csum, reply, total);
+    CHECK(getChecksum(&csum) == 0);
+    CHECK(memcmp(reply + 8, datagram + 8, total - 8) == 0);
+}
+
+// Two datagrams reassembled at once share the budget; growing the first moves
+// the second out of its way without losing what it holds
+void testSharedBudget()
+{
+    uint8_t* frame;
+    uint16_t size;
+
+    fillPayload(1, 1480);
+    CHECK(sendFragment(1, 0x11, 0, 1480, true, &size) == NULL);
+    fillPayload(2, 1480);
+    CHECK(sendFragment(2, 0x11, 0, 1480, true, &size) == NULL);
+
+    fillPayload(1, 2000);
+    frame = sendFragment(1, 0x11, 1480, 520, false, &size);
+    CHECK(holdsPayload(frame, 1, 2000));
+
+    fillPayload(2, 2400);
+    frame = sendFragment(2, 0x11, 1480, 920, false, &size);
+    CHECK(holdsPayload(frame, 2, 2400));
+}
+
+// When the budget runs short the oldest incomplete datagram is given up, and a
+// datagram larger than REASM_MAX_SIZE is refused
+void testBudgetLimits()
+{
+    reassemblyStats before, after;
+    uint8_t* frame;
+    uint16_t size;
+
+    getReassemblyStats(&before);
+    fillPayload(3, 4000);
+    CHECK(sendFragment(3, 0x11, 2960, 1040, false, &size) == NULL);
+    reassemblyTick();
+    fillPayload(4, 1480);
+    CHECK(sendFragment(4, 0x11, 0, 1480, true, &size) == NULL);
+    getReassemblyStats(&after);
+    CHECK(after.evictions == before.evictions + 1);
+
+    fillPayload(4, 1600);
+    frame = sendFragment(4, 0x11, 1480, 120, false, &size);
+    CHECK(holdsPayload(frame, 4, 1600));
+
+    fillPayload(5, REASM_MAX_SIZE);
+    CHECK(sendFragment(5, 0x11, 2960, REASM_MAX_SIZE - 2960, false, &size) == NULL);
+    getReassemblyStats(&after);
+    CHECK(after.dropped == before.dropped + 1);
+}
+
+int main()
+{
+    etherSetIpAddress(192, 0, 2, 118);
+    etherSetIpSubnetMask(255, 255, 255, 0);
+    initReassembly();
+
+    testLargePing();
+    testSharedBudget();
+    testBudgetLimits();
+    return hostReport("reassembly");
+}
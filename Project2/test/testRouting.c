@@ -0,0 +1,235 @@
+// Routing Tests
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None (host.c stands in for the hardware)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "host.h"
+#include "eth0.h"
+#include "arp.h"
+#include "pool.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const uint8_t gw[4] = {192, 0, 2, 1};
+const uint8_t newGw[4] = {192, 0, 2, 2};
+const uint8_t host[4] = {192, 0, 2, 10};
+const uint8_t waiter[4] = {192, 0, 2, 20};
+const uint8_t remote[4] = {198, 51, 100, 7};
+const uint8_t limited[4] = {255, 255, 255, 255};
+const uint8_t directed[4] = {192, 0, 2, 255};
+const uint8_t gwMac[6] = {0x02, 0, 0, 0, 0, 0x01};
+const uint8_t newGwMac[6] = {0x02, 0, 0, 0, 0, 0x02};
+const uint8_t hostMac[6] = {0x02, 0, 0, 0, 0, 0x0A};
+const uint8_t waiterMac[6] = {0x02, 0, 0, 0, 0, 0x14};
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Returns true if the last frame sent is an arp request for ip
+bool sentArpRequest(const uint8_t ip[])
+{
+    uint16_t size;
+    etherFrame* ether = (etherFrame*)hostGetLastFrame(&size);
+    arpFrame* arp;
+    if (ether == NULL || ether->frameType != htons(0x0806))
+        return false;
+    arp = (arpFrame*)&ether->data;
+    return arp->op == htons(1) && memcmp(arp->destIp, ip, 4) == 0;
+}
+
+// Counts the arp entries in use
+uint8_t countArpEntries()
+{
+    arpEntry entry;
+    uint8_t i, count = 0;
+    for (i = 0; i < ARP_ENTRIES; i++)
+        if (getArpEntry(i, &entry))
+            count++;
+    return count;
+}
+
+void testNextHop()
+{
+    uint8_t hop[4], mac[6];
+    etherRoute route;
+
+    // on-subnet: straight to the host
+    etherGetNextHop(host, hop);
+    CHECK(memcmp(hop, host, 4) == 0);
+    etherInitRoute(&route, host);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, hostMac, 6) == 0);
+
+    // off-subnet: through the gateway
+    etherGetNextHop(remote, hop);
+    CHECK(memcmp(hop, gw, 4) == 0);
+    etherInitRoute(&route, remote);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, gwMac, 6) == 0);
+    CHECK(memcmp(route.nextHop, gw, 4) == 0);
+
+    // broadcasts need no arp
+    etherInitRoute(&route, limited);
+    CHECK(etherResolveRoute(&route, mac) && mac[0] == 0xFF && mac[5] == 0xFF);
+    etherInitRoute(&route, directed);
+    CHECK(etherResolveRoute(&route, mac) && mac[0] == 0xFF && mac[5] == 0xFF);
+    CHECK(!etherIsBroadcastIp(host));
+}
+
+void testRouteCache()
+{
+    uint8_t mac[6];
+    etherRoute route;
+
+    etherInitRoute(&route, remote);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, gwMac, 6) == 0);
+
+    // the gateway's mac changes
+    arpUpdate(gw, newGwMac, false);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, newGwMac, 6) == 0);
+    arpUpdate(gw, gwMac, false);
+
+    // a new gateway makes the cached route stale
+    arpUpdate(newGw, newGwMac, true);
+    etherSetIpGatewayAddress(192, 0, 2, 2);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, newGwMac, 6) == 0);
+    CHECK(memcmp(route.nextHop, newGw, 4) == 0);
+
+    // without a gateway everything is sent direct, so the remote host is looked up
+    etherSetIpGatewayAddress(0, 0, 0, 0);
+    CHECK(!etherResolveRoute(&route, mac));
+    CHECK(sentArpRequest(remote));
+
+    // a wider mask puts the remote network on-link
+    etherSetIpGatewayAddress(192, 0, 2, 1);
+    etherSetIpSubnetMask(128, 0, 0, 0);
+    CHECK(etherIsOnLink(remote));
+    CHECK(!etherResolveRoute(&route, mac));
+    etherSetIpSubnetMask(255, 255, 255, 0);
+    CHECK(etherResolveRoute(&route, mac) && memcmp(mac, gwMac, 6) == 0);
+}
+
+// A frame to a next hop that is not resolved yet waits for the arp reply
+void testWaitingFrame()
+{
+    packetBuffer* buffer = allocPacketBuffer();
+    etherFrame* ether;
+    etherRoute route;
+    uint8_t* frame;
+    uint16_t size;
+    uint32_t sent;
+
+    memset(appendPacketBuffer(buffer, 46), 0x55, 46);
+    ether = (etherFrame*)prependPacketBuffer(buffer, 14);
+    memset(ether->destAddress, 0, 6);
+    ether->frameType = htons(0x88B5);
+    etherInitRoute(&route, waiter);
+    sent = hostFrameCount;
+    CHECK(etherSendRouted(buffer, &route));
+    CHECK(sentArpRequest(waiter));
+    CHECK(hostFrameCount == sent + 1);
+
+    arpUpdate(waiter, waiterMac, false);
+    frame = hostGetLastFrame(&size);
+    CHECK(hostFrameCount == sent + 2 && size == 60);
+    CHECK(frame != NULL && memcmp(frame, waiterMac, 6) == 0 && frame[59] == 0x55);
+}
+
+// Entries that expire take their routes with them
+void testArpExpiry()
+{
+    uint8_t mac[6];
+    etherRoute route;
+    uint16_t i;
+
+    etherInitRoute(&route, host);
+    CHECK(etherResolveRoute(&route, mac));
+    for (i = 0; i < ARP_TTL; i++)
+        arpTick();
+    CHECK(!etherResolveRoute(&route, mac));
+    CHECK(sentArpRequest(host));
+}
+
+// Pool calls made inside a critical section, as arpRemove makes them, must leave
+// interrupts off, and turn them back on only for a caller that had them on
+void testPoolInCriticalSection()
+{
+    packetBuffer* buffer;
+    uint32_t primask;
+
+    CHECK(hostPrimask == 0);
+    primask = _disable_interrupts();
+    buffer = allocPacketBuffer();
+    CHECK(buffer != NULL && hostPrimask == 1);
+    holdPacketBuffer(buffer);
+    freePacketBuffer(buffer);
+    CHECK(hostPrimask == 1);
+    freePacketBuffer(buffer);
+    CHECK(hostPrimask == 1);
+    _restore_interrupts(primask);
+    CHECK(hostPrimask == 0);
+    buffer = allocPacketBuffer();
+    freePacketBuffer(buffer);
+    CHECK(hostPrimask == 0);
+}
+
+// The on-target self-test must leave the live configuration and arp cache alone
+void testSelfTest()
+{
+    uint8_t ip[4], mask[4];
+    uint8_t entries = countArpEntries();
+    bool passed;
+
+    hostClearUart();
+    CHECK(etherTestRouting());
+    // what it printed is only shown if it failed; its cycle figure is from the stand-in
+    passed = strstr(hostUart, "routing: 0 failures") != NULL;
+    CHECK(passed);
+    if (!passed)
+        printf("%s", hostUart);
+    etherGetIpAddress(ip);
+    etherGetIpSubnetMask(mask);
+    CHECK(ip[0] == 192 && ip[1] == 0 && ip[2] == 2 && ip[3] == 118);
+    CHECK(mask[0] == 255 && mask[3] == 0);
+    CHECK(countArpEntries() == entries);
+}
+
+int main()
+{
+    packetPoolStats pool;
+
+    initArp();
+    etherSetIpAddress(192, 0, 2, 118);
+    etherSetIpSubnetMask(255, 255, 255, 0);
+    etherSetIpGatewayAddress(192, 0, 2, 1);
+    arpUpdate(gw, gwMac, true);
+    arpUpdate(host, hostMac, true);
+
+    testNextHop();
+    testRouteCache();
+    testWaitingFrame();
+    testPoolInCriticalSection();
+    testSelfTest();
+    testArpExpiry();
+
+    getPacketPoolStats(&pool);
+    CHECK(pool.inUse == 0);
+    return hostReport("routing");
+}
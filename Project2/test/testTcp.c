@@ -0,0 +1,328 @@
+// TCP Tests
+
+//-----------------------------------------------------------------------------
+// Hardware Target
+//-----------------------------------------------------------------------------
+
+// Target Platform: development machine (gcc), see Makefile
+// Target uC:       -
+// System Clock:    -
+
+// Hardware configuration:
+// None (host.c stands in for the hardware)
+
+//-----------------------------------------------------------------------------
+// Device includes, defines, and assembler directives
+//-----------------------------------------------------------------------------
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "host.h"
+#include "eth0.h"
+#include "arp.h"
+#include "checksum.h"
+#include "pool.h"
+#include "tcp.h"
+
+//-----------------------------------------------------------------------------
+// Global variables
+//-----------------------------------------------------------------------------
+
+const uint8_t peer[4] = {192, 0, 2, 50};
+const uint8_t peerMac[6] = {0x02, 0, 0, 0, 0, 0x32};
+const uint8_t local[4] = {192, 0, 2, 118};
+
+uint8_t segment[HOST_FRAME_SIZE];
+uint8_t payload[4096];
+uint8_t delivered[4096];            // data passed to the callback, in order
+uint16_t deliveredSize;
+uint8_t lastEvent;
+
+//-----------------------------------------------------------------------------
+// Subroutines
+//-----------------------------------------------------------------------------
+
+// Keeps the data delivered on any connection
+void callback(uint8_t connection, uint8_t event, const uint8_t data[], uint16_t size)
+{
+    CHECK(connection < TCP_CONNECTIONS);
+    lastEvent = event;
+    if (event == TCP_EVENT_DATA && deliveredSize + size <= sizeof(delivered))
+    {
+        memcpy(delivered + deliveredSize, data, size);
+        deliveredSize += size;
+    }
+}
+
+// Returns the ip header of the last frame sent
+ipFrame* lastIp()
+{
+    uint16_t size;
+    return (ipFrame*)(hostGetLastFrame(&size) + 14);
+}
+
+// Returns the tcp header of the last frame sent
+tcpFrame* lastTcp()
+{
+    return (tcpFrame*)((uint8_t*)lastIp() + 20);
+}
+
+// Returns true if the ip header checksum of ip is good
+bool isIpChecksumGood(ipFrame* ip)
+{
+    checksumContext csum;
+    initChecksum(&csum);
+    addChecksumData(&csum, ip, 20);
+    return getChecksum(&csum) == 0;
+}
+
+// Passes a segment from the peer to tcpInput as a received frame
+// A non-zero mss is sent as an option
+void receive(uint16_t sourcePort, uint16_t destPort, uint32_t seq, uint32_t ack, uint16_t flags,
+             const uint8_t data[], uint16_t size, uint16_t mss)
+{
+    packetBuffer* buffer = allocPacketBuffer();
+    etherFrame* ether;
+    etherPacket packet;
+    uint8_t* p;
+    uint16_t offset = 5;
+
+    if (mss != 0)
+    {
+        p = appendPacketBuffer(buffer, 4);
+        p[0] = 2;
+        p[1] = 4;
+        p[2] = mss >> 8;
+        p[3] = mss & 0xFF;
+        offset = 6;
+    }
+    if (size != 0)
+        memcpy(appendPacketBuffer(buffer, size), data, size);
+    etherPrependTcp(buffer, sourcePort, destPort, htonl(seq), htonl(ack), (offset << 12) | flags, 8192);
+    etherPrependIp(buffer, 0x06, peer, local);
+    ether = (etherFrame*)prependPacketBuffer(buffer, 14);
+    memcpy(ether->sourceAddress, peerMac, HW_ADD_LENGTH);
+    memset(ether->destAddress, 0x02, HW_ADD_LENGTH);
+    ether->frameType = htons(0x0800);
+    size = buffer->size;
+    memcpy(segment, buffer->data, size);
+    freePacketBuffer(buffer);
+
+    etherClassifyPacket(segment, size, &packet);
+    CHECK(packet.packetClass == ETHER_CLASS_TCP);
+    tcpInput(&packet);
+}
+
+// Reports a smaller path mtu toward the peer the way a router does, with an icmp
+// fragmentation needed message quoting the frame sent last
+void receiveFragNeeded(uint16_t mtu)
+{
+    etherFrame* ether = (etherFrame*)segment;
+    ipFrame* ip = (ipFrame*)&ether->data;
+    icmpFrame* icmp = (icmpFrame*)((uint8_t*)ip + 20);
+    checksumContext csum;
+
+    memset(segment, 0, 14 + 20 + 8 + 28);
+    ether->frameType = htons(0x0800);
+    ip->revSize = 0x45;
+    ip->length = htons(20 + 8 + 28);
+    ip->ttl = 64;
+    ip->protocol = 0x01;
+    memcpy(ip->sourceIp, peer, 4);
+    memcpy(ip->destIp, local, 4);
+    etherCalcIpChecksum(ip);
+    icmp->type = 3;
+    icmp->code = 4;
+    icmp->seq_no = htons(mtu);
+    memcpy(&icmp->data, lastIp(), 28);
+    initChecksum(&csum);
+    addChecksumData(&csum, icmp, 8 + 28);
+    icmp->check = getChecksum(&csum);
+    etherHandleIcmpError(segment);
+}
+
+// Opens a connection to the peer and completes the handshake with the given mss
+// The peer's syn takes sequence number peerIss, so its data starts at peerIss + 1
+uint8_t openConnection(uint16_t port, uint16_t mss, uint32_t peerIss, uint32_t* iss)
+{
+    uint8_t connection = tcpOpen(peer, port, callback);
+    CHECK(connection != TCP_NONE);
+    *iss = ntohl(lastTcp()->seq_no);
+    receive(port, ntohs(lastTcp()->srcport), peerIss, *iss + 1, TCP_SYN | TCP_ACK, NULL, 0, mss);
+    CHECK(tcpGetState(connection) == TCP_ESTABLISHED);
+    return connection;
+}
+
+// Segments queued at the old path mtu go out again without don't fragment after it
+// drops, so a router can split them; new data is cut to the new mss
+void testPathMtuDrop()
+{
+    uint32_t iss, first;
+    uint16_t size, port;
+    uint8_t connection = openConnection(80, 1460, 1000, &iss);
+
+    port = ntohs(lastTcp()->srcport);
+    first = hostFrameCount;
+    CHECK(tcpSend(connection, payload, 2920));
+    CHECK(hostFrameCount - first == 2);
+    CHECK(lastIp()->flagsAndOffset == htons(0x4000));
+    receiveFragNeeded(1006);
+    CHECK(etherGetPathMtu(peer) == 1006);
+
+    hostMillis += TCP_INITIAL_RTO;
+    first = hostFrameCount;
+    tcpPoll();
+    CHECK(hostFrameCount - first == 1);
+    hostGetLastFrame(&size);
+    CHECK(size == 14 + 20 + 20 + 1460);
+    CHECK(ntohl(lastTcp()->seq_no) == iss + 1);
+    CHECK(lastIp()->flagsAndOffset == 0);
+    CHECK(isIpChecksumGood(lastIp()));
+
+    receive(80, port, 1001, iss + 1 + 2920, TCP_ACK, NULL, 0, 0);
+    first = hostFrameCount;
+    CHECK(tcpSend(connection, payload, 1000));
+    CHECK(hostFrameCount - first == 2);
+    hostGetLastFrame(&size);
+    CHECK(size == 14 + 20 + 20 + 1000 - 966);
+    CHECK(lastIp()->flagsAndOffset == htons(0x4000));
+    tcpAbort(connection);
+}
+
+// A second full-size segment is acked at once, whatever size the peer's segments are
+void testAckEvery()
+{
+    const uint16_t sizes[2] = {536, 1460};
+    uint32_t iss, first;
+    uint16_t port, size;
+    uint8_t connection, i;
+
+    for (i = 0; i < 2; i++)
+    {
+        size = sizes[i];
+        connection = openConnection(81 + i, size, 1000, &iss);
+        port = ntohs(lastTcp()->srcport);
+        first = hostFrameCount;
+        receive(81 + i, port, 1001, iss + 1, TCP_ACK, payload, size, 0);
+        CHECK(hostFrameCount == first);
+        receive(81 + i, port, 1001 + size, iss + 1, TCP_ACK, payload, size, 0);
+        CHECK(hostFrameCount == first + 1);
+        CHECK(ntohl(lastTcp()->ack_no) == 1001 + 2 * size);
+        tcpAbort(connection);
+    }
+}
+
+// Connection numbers past the table are refused without touching it
+void testBadConnection()
+{
+    tcpConnection c;
+    CHECK(!getTcpConnection(TCP_CONNECTIONS, &c));
+    CHECK(!getTcpConnection(TCP_NONE, &c));
+    CHECK(!tcpSend(TCP_NONE, payload, 10));
+    CHECK(tcpGetState(TCP_NONE) == TCP_CLOSED);
+    tcpClose(TCP_NONE);
+    tcpAbort(TCP_NONE);
+}
+
+// Byte at offset of the streams testOutOfOrder sends
+uint8_t streamByte(uint32_t offset)
+{
+    return offset * 7 + (offset >> 8);
+}
+
+// Replays random streams through tcpInput, cut into segments that partly overlap
+// and with some sent twice, in shuffled order, resending like a peer until the
+// stream is in; the sequence numbers start at random so they wrap in some streams
+// Every stream has to come out whole and in order, with nothing left held
+void testOutOfOrder()
+{
+    const uint16_t streamSize = 2048;
+    const uint8_t streams = 64;
+    tcpConnection c;
+    tcpStats before, after;
+    uint16_t start[36], length[36], tmp;
+    uint32_t seed = 12345, base, pos, iss;
+    uint16_t i, j, n, port;
+    uint8_t count, pass, stream, connection;
+
+    getTcpStats(&before);
+    for (i = 0; i < streamSize; i++)
+        payload[i] = streamByte(i);
+    for (stream = 0; stream < streams; stream++)
+    {
+        seed = seed * 1664525 + 1013904223;
+        base = (stream % 4 == 0) ? 0xFFFFFC00 + (seed >> 24) : seed;
+        connection = openConnection(1000 + stream, 1460, base - 1, &iss);
+        port = ntohs(lastTcp()->srcport);
+        deliveredSize = 0;
+
+        // 128 to 639 bytes each, backing up less than half of that, so the
+        // stream takes at most 32 segments
+        count = 0;
+        pos = 0;
+        while (pos < streamSize)
+        {
+            seed = seed * 1664525 + 1013904223;
+            n = 128 + (seed >> 16) % 512;
+            start[count] = ((seed & 3) == 0 && pos > 0) ? pos - (seed >> 8) % (pos < 64 ? pos : 64) : pos;
+            length[count] = (start[count] + n > streamSize) ? streamSize - start[count] : n;
+            pos = start[count] + length[count];
+            count++;
+        }
+        for (i = 0; i < 4; i++)
+        {
+            seed = seed * 1664525 + 1013904223;
+            start[count] = start[(seed >> 16) % count];
+            length[count] = length[(seed >> 16) % count];
+            count++;
+        }
+        for (i = count - 1; i > 0; i--)
+        {
+            seed = seed * 1664525 + 1013904223;
+            j = (seed >> 16) % (i + 1);
+            tmp = start[i];
+            start[i] = start[j];
+            start[j] = tmp;
+            tmp = length[i];
+            length[i] = length[j];
+            length[j] = tmp;
+        }
+
+        getTcpConnection(connection, &c);
+        for (pass = 0; pass < count && c.rcvNxt != base + streamSize; pass++)
+        {
+            for (i = 0; i < count; i++)
+                receive(1000 + stream, port, base + start[i], iss + 1, TCP_ACK | TCP_PSH,
+                        payload + start[i], length[i], 0);
+            getTcpConnection(connection, &c);
+        }
+        CHECK(c.rcvNxt == base + streamSize);
+        CHECK(c.heldCount == 0 && c.heldBytes == 0);
+        CHECK(deliveredSize == streamSize && memcmp(delivered, payload, streamSize) == 0);
+        tcpAbort(connection);
+    }
+    // the streams must have gone through both the held and the trimmed paths
+    getTcpStats(&after);
+    CHECK(after.held > before.held && after.trimmed > before.trimmed);
+}
+
+int main()
+{
+    packetPoolStats pool;
+
+    initArp();
+    initTcp();
+    etherSetIpAddress(192, 0, 2, 118);
+    etherSetIpSubnetMask(255, 255, 255, 0);
+    arpUpdate(peer, peerMac, true);
+
+    testPathMtuDrop();
+    testAckEvery();
+    testOutOfOrder();
+    testBadConnection();
+
+    getPacketPoolStats(&pool);
+    CHECK(pool.inUse == 0);
+    return hostReport("tcp");
+}
@@ -10,7 +10,8 @@
 // System Clock:    40 MHz
 
 // Hardware configuration:
-// Timer 4
+// Timer 4 (1 kHz tick; the seconds timers run on every 1000th)
+// Wide timer 5A (free-running cycle counter)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -33,6 +34,9 @@ _callback fn[NUM_TIMERS];
 uint32_t period[NUM_TIMERS];
 uint32_t ticks[NUM_TIMERS];
 bool reload[NUM_TIMERS];
+volatile bool pending[NUM_TIMERS];      // expired, callback not run yet
+volatile uint32_t millis = 0;
+uint16_t msCount = 0;
 #define RED_LED PORTF,1
 #define BLUE_LED PORTF,2
 #define GREEN_LED PORTF,3
@@ -48,11 +52,11 @@ void initTimer()
     // Enable clocks
     SYSCTL_RCGCTIMER_R |= SYSCTL_RCGCTIMER_R4;
     _delay_cycles(3);
-    // Configure Timer 4 for 1 sec tick
+    // Configure Timer 4 for 1 ms tick
     TIMER4_CTL_R &= ~TIMER_CTL_TAEN;                 // turn-off timer before reconfiguring
     TIMER4_CFG_R = TIMER_CFG_32_BIT_TIMER;           // configure as 32-bit timer (A+B)
     TIMER4_TAMR_R = TIMER_TAMR_TAMR_PERIOD;          // configure for periodic mode (count down)
-    TIMER4_TAILR_R = 40000000;                       // set load value (1 Hz rate)
+    TIMER4_TAILR_R = 40000;                          // set load value (1 kHz rate)
     TIMER4_CTL_R |= TIMER_CTL_TAEN;                  // turn-on timer
     TIMER4_IMR_R |= TIMER_IMR_TATOIM;                // turn-on interrupt
     NVIC_EN2_R |= 1 << (INT_TIMER4A-80);             // turn-on interrupt 86 (TIMER4A)
@@ -63,6 +67,7 @@ void initTimer()
         ticks[i] = 0;
         fn[i] = NULL;
         reload[i] = false;
+        pending[i] = false;
     }
 }
 
@@ -79,6 +84,7 @@ bool startOneshotTimer(_callback callback, uint32_t seconds)
             ticks[i] = seconds;
             fn[i] = callback;
             reload[i] = false;
+            pending[i] = false;
         }
         i++;
     }
@@ -98,6 +104,7 @@ bool startPeriodicTimer(_callback callback, uint32_t seconds)
             ticks[i] = seconds;
             fn[i] = callback;
             reload[i] = true;
+            pending[i] = false;
         }
         i++;
     }
@@ -112,7 +119,10 @@ bool stopTimer(_callback callback)
      {
          found = fn[i] == callback;
          if (found)
+         {
              ticks[i] = 0;
+             pending[i] = false;
+         }
          i++;
      }
      return found;
@@ -132,25 +142,75 @@ bool restartTimer(_callback callback)
      return found;
 }
 
+// Counts milliseconds; the seconds timers are only walked once every 1000 ticks
+// Expired timers are only marked here; processTimers runs their callbacks
 void tickIsr()
 {
     uint8_t i;
-    for (i = 0; i < NUM_TIMERS; i++)
+    millis++;
+    if (++msCount == 1000)
     {
-        if (ticks[i] != 0)
+        msCount = 0;
+        for (i = 0; i < NUM_TIMERS; i++)
         {
-            ticks[i]--;
-            if (ticks[i] == 0)
+            if (ticks[i] != 0)
             {
-                if (reload[i])
-                    ticks[i] = period[i];
-                (*fn[i])();
+                ticks[i]--;
+                if (ticks[i] == 0)
+                {
+                    if (reload[i])
+                        ticks[i] = period[i];
+                    pending[i] = true;
+                }
             }
         }
     }
     TIMER4_ICR_R = TIMER_ICR_TATOCINT;
 }
 
+// Runs the callbacks of the timers that expired since the last call; call from
+// the main loop on every pass
+// Callbacks send frames, so they run here rather than in tickIsr, where they
+// could cut into a frame the main loop is queueing on the spi bus
+void processTimers()
+{
+    uint8_t i;
+    for (i = 0; i < NUM_TIMERS; i++)
+    {
+        if (pending[i])
+        {
+            pending[i] = false;
+            (*fn[i])();
+        }
+    }
+}
+
+// Returns milliseconds since initTimer (wraps every 49 days)
+// Compare times by their difference, e.g. (int32_t)(getMillis() - deadline) >= 0
+uint32_t getMillis()
+{
+    return millis;
+}
+
+// Starts a free-running up counter clocked at the system clock
+// Differences of getCycleCount() give elapsed cycles (wraps every 107s at 40 MHz)
+void initCycleCounter()
+{
+    SYSCTL_RCGCWTIMER_R |= SYSCTL_RCGCWTIMER_R5;
+    _delay_cycles(3);
+    WTIMER5_CTL_R &= ~TIMER_CTL_TAEN;                // turn-off timer before reconfiguring
+    WTIMER5_CFG_R = TIMER_CFG_16_BIT;                // configure as 32-bit timer (A only)
+    WTIMER5_TAMR_R = TIMER_TAMR_TAMR_PERIOD | TIMER_TAMR_TACDIR; // periodic mode (count up)
+    WTIMER5_TAILR_R = 0xFFFFFFFF;                    // full 32-bit range
+    WTIMER5_TAV_R = 0;
+    WTIMER5_CTL_R |= TIMER_CTL_TAEN;                 // turn-on timer
+}
+
+uint32_t getCycleCount()
+{
+    return WTIMER5_TAV_R;
+}
+
 // Placeholder random number function
 uint32_t random32()
 {
@@ -11,6 +11,7 @@
 
 // Hardware configuration:
 // Timer 4
+// Wide timer 5A (free-running cycle counter)
 
 //-----------------------------------------------------------------------------
 // Device includes, defines, and assembler directives
@@ -18,6 +19,7 @@
 
 #ifndef TIMER_H_
 #define TIMER_H_
+#include <stdint.h>
 #include <stdbool.h>
 typedef void (*_callback)();
 
@@ -31,6 +33,10 @@ bool startPeriodicTimer(_callback callback, uint32_t seconds);
 bool stopTimer(_callback callback);
 bool restartTimer(_callback callback);
 void tickIsr();
+void processTimers();
+uint32_t getMillis();
+void initCycleCounter();
+uint32_t getCycleCount();
 void flash();
 void flash2();
 void flash3();